@@ -0,0 +1,491 @@
+#include "BatchRenderer.h"
+#include "PluginProcessor.h"
+
+namespace
+{
+    XmlElement& getOrCreateChild(XmlElement& parent, const String& name)
+    {
+        if (auto* child = parent.getChildByName(name))
+            return *child;
+
+        return *parent.createNewChildElement(name);
+    }
+
+    File resolveFile(const String& path)
+    {
+        return File::getCurrentWorkingDirectory().getChildFile(path.unquoted());
+    }
+
+    void print(const String& line)
+    {
+        std::cout << line << std::endl;
+    }
+
+    // GM System On, without the F0 and F7 around it.
+    const uint8 gmSystemOn[] = { 0x7E, 0x7F, 0x09, 0x01 };
+
+    // Samples each file's writer can queue ahead of its encoder thread.
+    constexpr int encoderBufferSize = 1 << 18;
+}
+
+//==============================================================================
+class BatchRenderer::RenderJob : public ThreadPoolJob
+{
+public:
+    RenderJob(BatchRenderer& owner, TimeSliceThread& encoder)
+        : ThreadPoolJob("Batch render")
+        , owner(owner)
+        , encoder(encoder)
+    {
+    }
+
+    JobStatus runJob() override
+    {
+        auto processor = owner.createProcessor();
+
+        for (int index = owner.nextFile++; index < owner.options.midiFiles.size() && !shouldExit(); index = owner.nextFile++)
+        {
+            const auto& midiFile = owner.options.midiFiles.getReference(index);
+            Result result;
+
+            if (processor != nullptr)
+            {
+                result = owner.render(*processor, midiFile, encoder);
+            }
+            else
+            {
+                result.midiFile = midiFile;
+                result.error = "the soundfont could not be loaded";
+            }
+
+            owner.report(result);
+        }
+
+        deleteProcessor(processor);
+        return jobHasFinished;
+    }
+
+private:
+    BatchRenderer& owner;
+    TimeSliceThread& encoder;
+};
+
+//==============================================================================
+bool BatchRenderer::readMidiFile(const File& file, std::vector<TimedEvent>& events, double& length)
+{
+    FileInputStream stream(file);
+    MidiFile midiFile;
+
+    if (!stream.openedOk() || !midiFile.readFrom(stream))
+        return false;
+
+    midiFile.convertTimestampTicksToSeconds();
+    length = 0.0;
+
+    for (int track = 0; track < midiFile.getNumTracks(); ++track)
+    {
+        int port = 0;
+
+        for (auto* holder : *midiFile.getTrack(track))
+        {
+            const auto& message = holder->message;
+            length = jmax(length, message.getTimeStamp());
+
+            if (message.isMetaEvent())
+            {
+                if (message.getMetaEventType() == 0x21 && message.getMetaEventLength() >= 1)
+                    port = message.getMetaEventData()[0];
+
+                continue;
+            }
+
+            events.push_back({ message.getTimeStamp(), port, message });
+        }
+    }
+
+    std::stable_sort(events.begin(), events.end(), [](const TimedEvent& a, const TimedEvent& b) {
+        return a.time < b.time;
+    });
+
+    return true;
+}
+
+MidiMessage BatchRenderer::makePortPrefix(int port)
+{
+    const uint8 data[] = { 0xFF, 0x21, 0x01, (uint8)port };
+    return MidiMessage(data, (int)sizeof(data));
+}
+
+bool BatchRenderer::isRenderCommand(const ArgumentList& args)
+{
+    return args.containsOption("--render");
+}
+
+String BatchRenderer::parseCommandLine(const ArgumentList& args, Options& options)
+{
+    const StringArray valueOptions { "--soundfont", "--state", "--output", "--format",
+                                     "--rate", "--bits", "--block", "--jobs", "--tail" };
+
+    for (int i = 0; i < args.size(); ++i)
+    {
+        const auto text = args[i].text;
+
+        if (!text.startsWith("--"))
+        {
+            options.midiFiles.add(resolveFile(text));
+            continue;
+        }
+
+        const auto name = text.upToFirstOccurrenceOf("=", false, false);
+        String value;
+
+        if (name == "--render")
+            continue;
+
+        if (!valueOptions.contains(name))
+            return "Unknown option " + name;
+
+        if (text.containsChar('='))
+            value = text.fromFirstOccurrenceOf("=", false, false);
+        else if (i + 1 < args.size())
+            value = args[++i].text;
+        else
+            return "Missing a value for " + name;
+
+        if (name == "--soundfont")
+            options.soundfont = resolveFile(value);
+        else if (name == "--state")
+        {
+            std::unique_ptr<XmlElement> xml(parseXML(resolveFile(value)));
+
+            if (xml == nullptr)
+                return "Can't read the state file " + value;
+
+            options.state.reset();
+            AudioProcessor::copyXmlToBinary(*xml, options.state);
+        }
+        else if (name == "--output")
+            options.outputFolder = resolveFile(value);
+        else if (name == "--format")
+        {
+            if (!value.equalsIgnoreCase("wav") && !value.equalsIgnoreCase("flac"))
+                return "Unknown format " + value;
+
+            options.flac = value.equalsIgnoreCase("flac");
+        }
+        else if (name == "--rate")
+            options.sampleRate = value.getDoubleValue();
+        else if (name == "--bits")
+            options.bitsPerSample = value.getIntValue();
+        else if (name == "--block")
+            options.blockSize = value.getIntValue();
+        else if (name == "--jobs")
+            options.numJobs = value.getIntValue();
+        else if (name == "--tail")
+            options.tailSeconds = value.getDoubleValue();
+    }
+
+    if (options.midiFiles.isEmpty())
+        return "No MIDI files to render";
+
+    for (auto& file : options.midiFiles)
+        if (!file.existsAsFile())
+            return "Can't find " + file.getFullPathName();
+
+    if (options.soundfont == File() && options.state.isEmpty())
+        return "No soundfont given";
+
+    if (options.soundfont != File() && !options.soundfont.existsAsFile())
+        return "Can't find " + options.soundfont.getFullPathName();
+
+    if (options.outputFolder != File() && !options.outputFolder.isDirectory() && !options.outputFolder.createDirectory())
+        return "Can't create " + options.outputFolder.getFullPathName();
+
+#if ! JUCE_USE_FLAC
+    if (options.flac)
+        return "This build has no FLAC support";
+#endif
+
+    const Array<int> supportedBits = options.flac ? Array<int> { 16, 24 } : Array<int> { 16, 24, 32 };
+
+    if (!supportedBits.contains(options.bitsPerSample))
+        return "Unsupported bit depth " + String(options.bitsPerSample);
+
+    if (options.sampleRate < 8000.0 || options.sampleRate > 384000.0)
+        return "Unsupported sample rate " + String(options.sampleRate);
+
+    options.blockSize = jlimit(16, 8192, options.blockSize);
+    options.tailSeconds = jmax(0.0, options.tailSeconds);
+
+    return {};
+}
+
+String BatchRenderer::getUsage()
+{
+    return "Usage: HandySynth --render [options] file.mid...\n"
+           "\n"
+           "  --soundfont <file>   SF2/SF3 to play, instead of the one in the saved state\n"
+           "  --state <file>       plugin state saved as XML, instead of the standalone app's\n"
+           "  --output <folder>    where to write, next to each MIDI file by default\n"
+           "  --format wav|flac    wav by default\n"
+           "  --rate <hz>          44100 by default\n"
+           "  --bits 16|24|32      24 by default, FLAC goes up to 24\n"
+           "  --block <samples>    512 by default\n"
+           "  --jobs <count>       files rendered at once, one per core by default\n"
+           "  --tail <seconds>     rendered past the last event, 2 by default\n";
+}
+
+//==============================================================================
+BatchRenderer::BatchRenderer(const Options& options)
+    : options(options)
+{
+}
+
+int BatchRenderer::run()
+{
+    const int numFiles = options.midiFiles.size();
+    const int numJobs = jlimit(1, jmax(1, numFiles), options.numJobs > 0 ? options.numJobs : SystemStats::getNumCpus());
+
+    // Encoding is much cheaper than rendering, a thread per few workers keeps up.
+    OwnedArray<TimeSliceThread> encoders;
+
+    for (int i = 0; i < jmax(1, numJobs / 4); ++i)
+        encoders.add(new TimeSliceThread("Batch encoder"))->startThread();
+
+    const double startTime = Time::getMillisecondCounterHiRes();
+
+    {
+        ThreadPool pool(numJobs);
+        OwnedArray<RenderJob> jobs;
+
+        for (int i = 0; i < numJobs; ++i)
+            pool.addJob(jobs.add(new RenderJob(*this, *encoders[i % encoders.size()])), false);
+
+        for (auto* job : jobs)
+            pool.waitForJobToFinish(job, -1);
+    }
+
+    for (auto* encoder : encoders)
+        encoder->stopThread(5000);
+
+    const double wallSeconds = (Time::getMillisecondCounterHiRes() - startTime) / 1000.0;
+
+    double audioSeconds = 0.0;
+    int numFailed = 0;
+
+    for (auto& result : results)
+    {
+        audioSeconds += result.audioSeconds;
+
+        if (result.error.isNotEmpty())
+            ++numFailed;
+    }
+
+    print("Rendered " + String(numFiles - numFailed) + " of " + String(numFiles) + " files, "
+          + String(audioSeconds, 1) + " s of audio in " + String(wallSeconds, 2) + " s on "
+          + String(numJobs) + " threads: " + String(audioSeconds / jmax(wallSeconds, 0.001), 1) + "x real time");
+
+    return numFailed;
+}
+
+std::unique_ptr<HandySynthAudioProcessor> BatchRenderer::createProcessor()
+{
+    std::unique_ptr<HandySynthAudioProcessor> processor;
+
+    {
+        // Processors start timers and listen to their state on the message
+        // thread. Nothing here waits for the engine, so jobs only hold the
+        // lock while they construct and restore their processor.
+        const MessageManagerLock mml(Thread::getCurrentThread());
+
+        if (!mml.lockWasGained())
+            return nullptr;
+
+        processor = std::make_unique<HandySynthAudioProcessor>();
+        processor->setNonRealtime(true);
+        processor->setRateAndBufferSizeDetails(options.sampleRate, options.blockSize);
+        processor->prepareToPlay(options.sampleRate, options.blockSize);
+
+        auto state = getRenderState(*processor);
+        processor->setStateInformation(state.getData(), (int)state.getSize());
+    }
+
+    // The soundfont loads on the processor's own thread.
+    while (processor->isLoadingSoundfont())
+        Thread::sleep(10);
+
+    if (processor->getPresets().isEmpty())
+        deleteProcessor(processor);
+
+    return processor;
+}
+
+void BatchRenderer::deleteProcessor(std::unique_ptr<HandySynthAudioProcessor>& processor)
+{
+    if (processor == nullptr)
+        return;
+
+    const MessageManagerLock mml;
+    processor.reset();
+}
+
+MemoryBlock BatchRenderer::getRenderState(HandySynthAudioProcessor& processor) const
+{
+    MemoryBlock state(options.state);
+
+    if (state.isEmpty())
+        processor.getStateInformation(state);
+
+    std::unique_ptr<XmlElement> xml(AudioProcessor::getXmlFromBinary(state.getData(), (int)state.getSize()));
+
+    if (xml == nullptr)
+        return state;
+
+    if (options.soundfont != File())
+        getOrCreateChild(*xml, "SOUNDFONT").setAttribute("path", options.soundfont.getFullPathName());
+
+    // The workers already keep every core busy, one file each.
+    getOrCreateChild(getOrCreateChild(*xml, "PROFILES"), "OFFLINE").setAttribute("renderThreads", 1);
+
+    MemoryBlock patched;
+    AudioProcessor::copyXmlToBinary(*xml, patched);
+
+    return patched;
+}
+
+BatchRenderer::Result BatchRenderer::render(HandySynthAudioProcessor& processor, const File& midiFile, TimeSliceThread& encoder)
+{
+    Result result;
+    result.midiFile = midiFile;
+
+    std::vector<TimedEvent> events;
+    double length = 0.0;
+
+    if (!readMidiFile(midiFile, events, length))
+    {
+        result.error = "not a readable MIDI file";
+        return result;
+    }
+
+    const auto folder = options.outputFolder != File() ? options.outputFolder : midiFile.getParentDirectory();
+    result.outputFile = folder.getChildFile(midiFile.getFileNameWithoutExtension() + (options.flac ? ".flac" : ".wav"));
+    result.outputFile.deleteFile();
+
+    std::unique_ptr<AudioFormat> format;
+
+#if JUCE_USE_FLAC
+    if (options.flac)
+        format = std::make_unique<FlacAudioFormat>();
+    else
+#endif
+        format = std::make_unique<WavAudioFormat>();
+
+    auto stream = std::make_unique<FileOutputStream>(result.outputFile);
+
+    if (!stream->openedOk())
+    {
+        result.error = "can't write " + result.outputFile.getFullPathName();
+        return result;
+    }
+
+    std::unique_ptr<AudioFormatWriter> writer(format->createWriterFor(stream.get(), options.sampleRate, 2,
+                                                                      options.bitsPerSample, {}, 0));
+
+    if (writer == nullptr)
+    {
+        stream.reset();
+        result.outputFile.deleteFile();
+        result.error = "can't encode " + format->getFormatName() + " at these settings";
+        return result;
+    }
+
+    stream.release();
+
+    const double startTime = Time::getMillisecondCounterHiRes();
+
+    {
+        AudioFormatWriter::ThreadedWriter output(writer.release(), encoder, encoderBufferSize);
+
+        // Back to a clean timeline, and the latency is known once prepared.
+        processor.prepareToPlay(options.sampleRate, options.blockSize);
+
+        const int latency = processor.getLatencySamples();
+        const int64 numSamples = (int64)std::ceil((length + options.tailSeconds) * options.sampleRate);
+        const int64 totalSamples = numSamples + latency;
+
+        AudioBuffer<float> buffer(processor.getTotalNumOutputChannels(), options.blockSize);
+        MidiBuffer midi;
+        size_t nextEvent = 0;
+        int port = 0;
+
+        for (int64 position = 0; position < totalSamples; position += options.blockSize)
+        {
+            const int blockSize = (int)jmin((int64)options.blockSize, totalSamples - position);
+            buffer.setSize(buffer.getNumChannels(), blockSize, false, false, true);
+            buffer.clear();
+            midi.clear();
+
+            // Whatever the previous file left playing or set up goes, and
+            // the port goes back to the first.
+            if (position == 0)
+            {
+                midi.addEvent(MidiMessage::createSysExMessage(gmSystemOn, (int)sizeof(gmSystemOn)), 0);
+                midi.addEvent(makePortPrefix(0), 0);
+            }
+
+            for (; nextEvent < events.size(); ++nextEvent)
+            {
+                const auto& event = events[nextEvent];
+                const auto sample = (int64)(event.time * options.sampleRate + 0.5);
+
+                if (sample >= position + blockSize)
+                    break;
+
+                const int offset = (int)jmax((int64)0, sample - position);
+
+                if (event.port != port)
+                {
+                    port = event.port;
+                    midi.addEvent(makePortPrefix(port), offset);
+                }
+
+                midi.addEvent(event.message, offset);
+            }
+
+            processor.processBlock(buffer, midi);
+
+            // The resampler's delay is rendered ahead and dropped.
+            const int skip = (int)jlimit((int64)0, (int64)blockSize, latency - position);
+
+            if (skip < blockSize)
+            {
+                const int right = jmin(1, buffer.getNumChannels() - 1);
+                const float* channels[] = { buffer.getReadPointer(0, skip), buffer.getReadPointer(right, skip) };
+
+                while (!output.write(channels, blockSize - skip))
+                    Thread::sleep(1);
+            }
+        }
+
+        result.audioSeconds = (double)numSamples / options.sampleRate;
+    }
+
+    result.renderSeconds = (Time::getMillisecondCounterHiRes() - startTime) / 1000.0;
+    return result;
+}
+
+void BatchRenderer::report(const Result& result)
+{
+    const ScopedLock sl(resultLock);
+    results.add(result);
+
+    if (result.error.isNotEmpty())
+    {
+        print(result.midiFile.getFileName() + ": failed, " + result.error);
+        return;
+    }
+
+    print(result.midiFile.getFileName() + " -> " + result.outputFile.getFileName() + ": "
+          + String(result.audioSeconds, 1) + " s in " + String(result.renderSeconds, 2) + " s, "
+          + String(result.audioSeconds / jmax(result.renderSeconds, 0.001), 1) + "x real time");
+}
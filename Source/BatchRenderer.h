@@ -0,0 +1,92 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+using namespace juce;
+
+class HandySynthAudioProcessor;
+
+// Renders a list of MIDI files to audio without a window or an audio device,
+// for the standalone app's --render mode.
+// Every worker thread renders files one after another with its own
+// HandySynthAudioProcessor, faster than real time. The processors share one
+// copy of the soundfont's samples through SoundfontCache, and the audio is
+// encoded on separate threads while the workers carry on rendering.
+class BatchRenderer
+{
+public:
+    struct Options
+    {
+        Array<File> midiFiles;
+        File soundfont;
+
+        // Plugin state as getStateInformation() writes it, empty for the defaults.
+        MemoryBlock state;
+
+        // Empty to write each file next to its MIDI file.
+        File outputFolder;
+        bool flac = false;
+        double sampleRate = 44100.0;
+        int bitsPerSample = 24;
+        int blockSize = 512;
+        int numJobs = 0;
+        double tailSeconds = 2.0;
+    };
+
+    struct Result
+    {
+        File midiFile, outputFile;
+        double audioSeconds = 0.0;
+        double renderSeconds = 0.0;
+        String error;
+    };
+
+    struct TimedEvent
+    {
+        double time;
+        int port;
+        MidiMessage message;
+    };
+
+    // All tracks of a MIDI file merged in time order. A port prefix only
+    // applies to the track it is in, so each event carries the port it is
+    // meant for. Returns false if the file can't be read.
+    static bool readMidiFile(const File& file, std::vector<TimedEvent>& events, double& length);
+
+    // The MIDI port prefix meta event, which the processor takes as a port select.
+    static MidiMessage makePortPrefix(int port);
+
+    // Whether the command line asks for a batch render.
+    static bool isRenderCommand(const ArgumentList& args);
+
+    // Returns an error message, or an empty string if the options are usable.
+    static String parseCommandLine(const ArgumentList& args, Options& options);
+
+    static String getUsage();
+
+    explicit BatchRenderer(const Options& options);
+
+    // Renders every file, printing a line for each as it finishes and then
+    // the totals. Blocks until done. The processors need the message thread
+    // for their asynchronous updates, so this must not be called on it.
+    // Returns the number of files that failed.
+    int run();
+
+private:
+    class RenderJob;
+
+    // Returns nullptr if the soundfont could not be loaded.
+    std::unique_ptr<HandySynthAudioProcessor> createProcessor();
+    static void deleteProcessor(std::unique_ptr<HandySynthAudioProcessor>& processor);
+    Result render(HandySynthAudioProcessor& processor, const File& midiFile, TimeSliceThread& encoder);
+    MemoryBlock getRenderState(HandySynthAudioProcessor& processor) const;
+    void report(const Result& result);
+
+    Options options;
+    std::atomic<int> nextFile { 0 };
+
+    CriticalSection resultLock;
+    Array<Result> results;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(BatchRenderer)
+};
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+using namespace juce;
+
+struct ControlCommand
+{
+    enum Type
+    {
+        setGain,
+        setPolyphony,
+        setChorusOn,
+        setReverbOn
+    };
+
+    Type type;
+    float value;
+};
+
+// Preallocated FIFO carrying control changes to the audio thread.
+// The audio thread is the only reader and never blocks. Writers are serialised
+// with a spin lock because hosts may automate from more than one thread.
+class ControlQueue
+{
+public:
+    ControlQueue()
+        : fifo(capacity)
+        , overflowed(false)
+    {
+    }
+
+    void push(const ControlCommand& command)
+    {
+        const SpinLock::ScopedLockType lock(writeLock);
+
+        if (fifo.getFreeSpace() == 0)
+        {
+            // The reader will re-read every parameter instead.
+            overflowed = true;
+            return;
+        }
+
+        fifo.write(1).forEach([this, &command](int index) { commands[index] = command; });
+    }
+
+    // Asks the reader to re-read every parameter on its next drain.
+    void requestResync()
+    {
+        overflowed = true;
+    }
+
+    // Called on the audio thread. Returns true if the queue has overflowed
+    // since the last call, meaning some commands were lost.
+    template <typename Callback>
+    bool drain(Callback&& callback)
+    {
+        fifo.read(fifo.getNumReady()).forEach([this, &callback](int index) { callback(commands[index]); });
+
+        return overflowed.exchange(false);
+    }
+
+private:
+    static constexpr int capacity = 256;
+
+    AbstractFifo fifo;
+    ControlCommand commands[capacity];
+    SpinLock writeLock;
+    std::atomic<bool> overflowed;
+
+    JUCE_DECLARE_NON_COPYABLE(ControlQueue)
+};
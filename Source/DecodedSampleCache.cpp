@@ -0,0 +1,547 @@
+#include "DecodedSampleCache.h"
+
+namespace
+{
+    using Sample = SharedSoundfont::Sample;
+
+    const char fileMagic[4] = { 'H', 'S', 'D', 'C' };
+    const int fileVersion = 1;
+
+    // Magic, version, content hash, smpl chunk size, sample count, pool size
+    // and data offset, then four positions for each sample.
+    const int64 fixedHeaderBytes = 4 + 4 + 8 + 8 + 4 + 8 + 8;
+    const int64 sampleHeaderBytes = 16;
+    const int64 dataAlignment = 4096;
+
+    // Zero points after each sample, as SF2 requires, for interpolating past its end.
+    const int samplePadding = 46;
+
+    const int decodeChunkFrames = 8192;
+
+    // Share of the progress bar taken by finding the decoded lengths.
+    const double measureProgress = 0.05;
+
+    // Least recently used files are deleted once the folder grows past this.
+    const int64 maxCacheBytes = (int64)4 << 30;
+
+    struct Counters
+    {
+        // Held while files are written or deleted.
+        CriticalSection lock;
+
+        std::atomic<int> hits { 0 };
+        std::atomic<int> decodes { 0 };
+        std::atomic<double> lastDecodeSeconds { 0.0 };
+        std::atomic<int> lastDecodeThreads { 0 };
+
+        // -1 until the folder is first looked at.
+        std::atomic<int> numFiles { -1 };
+        std::atomic<int64> diskBytes { -1 };
+    };
+
+    Counters& getCounters()
+    {
+        static Counters counters;
+        return counters;
+    }
+
+    // FNV-1a, a word at a time over the bulk of the data.
+    uint64 hashBytes(const void* data, size_t size, uint64 hash = 14695981039346656037ull)
+    {
+        const uint64 prime = 1099511628211ull;
+        auto* bytes = static_cast<const uint8*>(data);
+        size_t i = 0;
+
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64 word;
+            memcpy(&word, bytes + i, 8);
+            hash = (hash ^ word) * prime;
+        }
+
+        for (; i < size; ++i)
+            hash = (hash ^ bytes[i]) * prime;
+
+        return hash;
+    }
+
+    uint64 hashSampleTable(const Array<Sample>& samples, int64 chunkBytes)
+    {
+        MemoryOutputStream table;
+        table.writeInt(fileVersion);
+        table.writeInt64(chunkBytes);
+
+        for (auto& sample : samples)
+        {
+            table.writeInt((int)sample.start);
+            table.writeInt((int)sample.end);
+            table.writeInt((int)sample.loopStart);
+            table.writeInt((int)sample.loopEnd);
+            table.writeBool(sample.compressed);
+            table.writeBool(sample.rom);
+        }
+
+        return hashBytes(table.getData(), table.getDataSize());
+    }
+
+    String toHex(uint64 hash)
+    {
+        return String::toHexString((int64)hash).paddedLeft('0', 16);
+    }
+
+    // Hashing the sample data means reading all of it, so the hash found for
+    // a file with a given path, size and date is kept in a small file of its own.
+    File getRefFile(const File& folder, const File& file)
+    {
+        const String identity = file.getFullPathName() + "|" + String(file.getSize()) + "|"
+                              + String(file.getLastModificationTime().toMilliseconds());
+
+        return folder.getChildFile(toHex(hashBytes(identity.toRawUTF8(), identity.getNumBytesAsUTF8())) + ".ref");
+    }
+
+    void updateFolderStats(const File& folder)
+    {
+        auto& counters = getCounters();
+        auto files = folder.findChildFiles(File::findFiles, false, "*.pcm");
+        int64 bytes = 0;
+
+        for (auto& file : files)
+            bytes += file.getSize();
+
+        counters.numFiles = files.size();
+        counters.diskBytes = bytes;
+    }
+
+    // Deletes the least recently used files until the folder fits maxCacheBytes.
+    // Files still mapped elsewhere may refuse to go, on Windows.
+    void prune(const File& folder, const File& keep)
+    {
+        auto files = folder.findChildFiles(File::findFiles, false, "*.pcm");
+        int64 total = 0;
+
+        for (auto& file : files)
+            total += file.getSize();
+
+        std::sort(files.begin(), files.end(), [](const File& a, const File& b) {
+            return a.getLastModificationTime() < b.getLastModificationTime();
+        });
+
+        for (auto& file : files)
+        {
+            if (total <= maxCacheBytes)
+                break;
+
+            const int64 size = file.getSize();
+
+            if (file != keep && file.deleteFile())
+                total -= size;
+        }
+
+        updateFolderStats(folder);
+    }
+
+    // Maps a cache file and moves the samples to their places in it. Fails
+    // without touching the samples if the file is missing or doesn't match.
+    bool openCacheFile(const File& cacheFile, uint64 contentHash, int64 chunkBytes,
+                       Array<Sample>& samples, DecodedSampleCache::Pool& pool)
+    {
+        if (!cacheFile.existsAsFile())
+            return false;
+
+        auto mapped = std::make_unique<MemoryMappedFile>(cacheFile, MemoryMappedFile::readOnly);
+        auto* base = static_cast<const char*>(mapped->getData());
+        const int64 fileBytes = (int64)mapped->getSize();
+
+        if (base == nullptr || fileBytes < fixedHeaderBytes + sampleHeaderBytes * samples.size())
+            return false;
+
+        MemoryInputStream in(base, (size_t)fileBytes, false);
+        char magic[4];
+        in.read(magic, 4);
+
+        if (memcmp(magic, fileMagic, 4) != 0 || in.readInt() != fileVersion
+            || (uint64)in.readInt64() != contentHash || in.readInt64() != chunkBytes
+            || in.readInt() != samples.size())
+            return false;
+
+        const int64 numPoints = in.readInt64();
+        const int64 dataOffset = in.readInt64();
+
+        if (numPoints < 0 || dataOffset < fixedHeaderBytes || fileBytes < dataOffset + numPoints * 2)
+            return false;
+
+        Array<Sample> placed(samples);
+
+        for (auto& sample : placed)
+        {
+            sample.start = (uint32)in.readInt();
+            sample.end = (uint32)in.readInt();
+            sample.loopStart = (uint32)in.readInt();
+            sample.loopEnd = (uint32)in.readInt();
+            sample.compressed = false;
+
+            if (sample.start > sample.end || (int64)sample.end > numPoints)
+                return false;
+        }
+
+        samples = placed;
+        pool.data = reinterpret_cast<const short*>(base + dataOffset);
+        pool.numPoints = (size_t)numPoints;
+        pool.mappedFile = std::move(mapped);
+        pool.heapData.free();
+
+        return true;
+    }
+
+    // Written to a temporary file first, so that a partly written file never
+    // has the cache file's name.
+    bool writeCacheFile(const File& cacheFile, uint64 contentHash, int64 chunkBytes,
+                        const Array<Sample>& placed, const short* data, size_t numPoints)
+    {
+        TemporaryFile temp(cacheFile);
+
+        {
+            FileOutputStream out(temp.getFile());
+
+            if (out.failedToOpen())
+                return false;
+
+            const int64 headerBytes = fixedHeaderBytes + sampleHeaderBytes * placed.size();
+            const int64 dataOffset = (headerBytes + dataAlignment - 1) / dataAlignment * dataAlignment;
+
+            out.write(fileMagic, 4);
+            out.writeInt(fileVersion);
+            out.writeInt64((int64)contentHash);
+            out.writeInt64(chunkBytes);
+            out.writeInt(placed.size());
+            out.writeInt64((int64)numPoints);
+            out.writeInt64(dataOffset);
+
+            for (auto& sample : placed)
+            {
+                out.writeInt((int)sample.start);
+                out.writeInt((int)sample.end);
+                out.writeInt((int)sample.loopStart);
+                out.writeInt((int)sample.loopEnd);
+            }
+
+            out.writeRepeatedByte(0, (size_t)(dataOffset - headerBytes));
+
+            // Little endian, like SF2 sample data and every platform we build for.
+            if (!out.write(data, numPoints * 2))
+                return false;
+
+            out.flush();
+
+            if (out.getStatus().failed())
+                return false;
+        }
+
+        return temp.overwriteTargetFileWithTemporary();
+    }
+
+    struct DecodeState
+    {
+        const char* chunk;
+        int64 chunkBytes;
+        const Array<Sample>& samples;
+        SoundfontStream::LoadProgress* progress;
+
+        // Decoded length of each sample, then where it goes in the pool.
+        Array<int64> frames;
+        Array<int64> offsets;
+        short* pool = nullptr;
+
+        bool measuring = true;
+        std::atomic<int> next { 0 };
+        std::atomic<int> done { 0 };
+        std::atomic<bool> failed { false };
+
+        bool isCancelled() const
+        {
+            return failed || (progress != nullptr && progress->cancelled);
+        }
+    };
+
+    // Each job takes the next sample not yet taken until none are left.
+    class DecodeJob : public ThreadPoolJob
+    {
+    public:
+        explicit DecodeJob(DecodeState& state)
+            : ThreadPoolJob("SF3 decoder")
+            , state(state)
+        {
+        }
+
+        JobStatus runJob() override
+        {
+            for (int index = state.next++; index < state.samples.size() && !shouldExit() && !state.isCancelled();
+                 index = state.next++)
+            {
+                if (!(state.measuring ? measure(index) : decode(index)))
+                    state.failed = true;
+
+                ++state.done;
+            }
+
+            return jobHasFinished;
+        }
+
+    private:
+        std::unique_ptr<AudioFormatReader> openCompressed(const Sample& sample) const
+        {
+            // The end may point at the sample's last byte or just past it. A
+            // stray byte after the last Ogg page is ignored.
+            const int64 end = jmin(state.chunkBytes, (int64)sample.end + 1);
+
+            if ((int64)sample.start >= end)
+                return nullptr;
+
+            OggVorbisAudioFormat format;
+            return std::unique_ptr<AudioFormatReader>(format.createReaderFor(
+                new MemoryInputStream(state.chunk + sample.start, (size_t)(end - sample.start), false), true));
+        }
+
+        bool measure(int index)
+        {
+            auto& sample = state.samples.getReference(index);
+
+            if (sample.rom || sample.end <= sample.start)
+            {
+                state.frames.set(index, 0);
+                return true;
+            }
+
+            if (!sample.compressed)
+            {
+                state.frames.set(index, jmin((int64)sample.end, state.chunkBytes / 2) - (int64)sample.start);
+                return true;
+            }
+
+            auto reader = openCompressed(sample);
+
+            if (reader == nullptr)
+                return false;
+
+            state.frames.set(index, reader->lengthInSamples);
+            return true;
+        }
+
+        bool decode(int index)
+        {
+            auto& sample = state.samples.getReference(index);
+            const int64 numFrames = state.frames[index];
+            short* dest = state.pool + state.offsets[index];
+
+            if (numFrames <= 0)
+                return true;
+
+            if (!sample.compressed)
+            {
+                memcpy(dest, state.chunk + (int64)sample.start * 2, (size_t)numFrames * 2);
+                return true;
+            }
+
+            auto reader = openCompressed(sample);
+
+            if (reader == nullptr)
+                return false;
+
+            AudioBuffer<float> buffer(1, decodeChunkFrames);
+
+            for (int64 pos = 0; pos < numFrames; pos += decodeChunkFrames)
+            {
+                if (shouldExit() || state.isCancelled())
+                    return false;
+
+                const int count = (int)jmin((int64)decodeChunkFrames, numFrames - pos);
+                reader->read(&buffer, 0, count, pos, true, false);
+
+                const float* source = buffer.getReadPointer(0);
+
+                for (int i = 0; i < count; ++i)
+                    dest[pos + i] = (short)jlimit(-32768, 32767, roundToInt(source[i] * 32768.0f));
+            }
+
+            return true;
+        }
+
+        DecodeState& state;
+    };
+
+    bool runPass(DecodeState& state, bool measuring, int numThreads, double progressStart, double progressEnd)
+    {
+        state.measuring = measuring;
+        state.next = 0;
+        state.done = 0;
+
+        ThreadPool pool(numThreads);
+        OwnedArray<DecodeJob> jobs;
+
+        for (int i = 0; i < numThreads; ++i)
+            pool.addJob(jobs.add(new DecodeJob(state)), false);
+
+        for (auto* job : jobs)
+        {
+            while (!pool.waitForJobToFinish(job, 50))
+            {
+                if (state.progress != nullptr)
+                    state.progress->progress = progressStart + (progressEnd - progressStart)
+                                                               * state.done / jmax(1, state.samples.size());
+            }
+        }
+
+        return !state.isCancelled();
+    }
+}
+
+DecodedSampleCache::Stats DecodedSampleCache::getStats()
+{
+    auto& counters = getCounters();
+
+    if (counters.numFiles < 0)
+    {
+        const ScopedLock sl(counters.lock);
+
+        if (counters.numFiles < 0)
+            updateFolderStats(getCacheFolder());
+    }
+
+    return { counters.hits, counters.decodes, counters.lastDecodeSeconds, counters.lastDecodeThreads,
+             counters.numFiles, counters.diskBytes };
+}
+
+bool DecodedSampleCache::load(const File& file, const char* sampleChunk, int64 sampleChunkBytes,
+                              Array<SharedSoundfont::Sample>& samples, Pool& pool,
+                              SoundfontStream::LoadProgress* progress)
+{
+    auto& counters = getCounters();
+    const auto folder = getCacheFolder();
+
+    const auto refFile = getRefFile(folder, file);
+    const String ref = refFile.loadFileAsString().trim();
+
+    if (ref.length() == 16)
+    {
+        const auto cacheFile = folder.getChildFile(ref + ".pcm");
+
+        if (openCacheFile(cacheFile, (uint64)ref.getHexValue64(), sampleChunkBytes, samples, pool))
+        {
+            ++counters.hits;
+            cacheFile.setLastModificationTime(Time::getCurrentTime());
+            return true;
+        }
+    }
+
+    const uint64 contentHash = hashBytes(sampleChunk, (size_t)sampleChunkBytes, hashSampleTable(samples, sampleChunkBytes));
+    const auto cacheFile = folder.getChildFile(toHex(contentHash) + ".pcm");
+
+    if (openCacheFile(cacheFile, contentHash, sampleChunkBytes, samples, pool))
+    {
+        ++counters.hits;
+        cacheFile.setLastModificationTime(Time::getCurrentTime());
+        refFile.replaceWithText(toHex(contentHash));
+        return true;
+    }
+
+    const double startTime = Time::getMillisecondCounterHiRes();
+    const int numThreads = jlimit(1, jmax(1, samples.size()), SystemStats::getNumCpus());
+
+    DecodeState state { sampleChunk, sampleChunkBytes, samples, progress };
+    state.frames.insertMultiple(0, 0, samples.size());
+
+    if (!runPass(state, true, numThreads, 0.0, measureProgress))
+        return false;
+
+    int64 numPoints = 0;
+
+    for (auto numFrames : state.frames)
+    {
+        state.offsets.add(numPoints);
+        numPoints += numFrames + samplePadding;
+    }
+
+    // Sample positions are 32 bit.
+    if (numPoints > (int64)std::numeric_limits<uint32>::max())
+        return false;
+
+    pool.heapData.calloc((size_t)numPoints);
+
+    if (pool.heapData == nullptr)
+        return false;
+
+    state.pool = pool.heapData;
+
+    if (!runPass(state, false, numThreads, measureProgress, 1.0))
+        return false;
+
+    Array<Sample> placed(samples);
+
+    for (int i = 0; i < placed.size(); ++i)
+    {
+        auto& sample = placed.getReference(i);
+        const int64 offset = state.offsets[i];
+        const int64 numFrames = state.frames[i];
+
+        // Compressed samples have their loop relative to their own start.
+        const int64 base = sample.compressed ? 0 : (int64)sample.start;
+
+        sample.loopStart = (uint32)(offset + jlimit((int64)0, numFrames, (int64)sample.loopStart - base));
+        sample.loopEnd = (uint32)(offset + jlimit((int64)0, numFrames, (int64)sample.loopEnd - base));
+        sample.start = (uint32)offset;
+        sample.end = (uint32)(offset + numFrames);
+        sample.compressed = false;
+    }
+
+    ++counters.decodes;
+    counters.lastDecodeSeconds = (Time::getMillisecondCounterHiRes() - startTime) / 1000.0;
+    counters.lastDecodeThreads = numThreads;
+
+    samples = placed;
+    pool.data = pool.heapData;
+    pool.numPoints = (size_t)numPoints;
+
+    // Once written, the decoded data is played from a mapping of the file
+    // like an SF2's, and the heap copy goes. If it can't be written the heap
+    // copy stays.
+    const ScopedLock sl(counters.lock);
+
+    if (folder.createDirectory() && writeCacheFile(cacheFile, contentHash, sampleChunkBytes, placed, pool.data, pool.numPoints))
+    {
+        refFile.replaceWithText(toHex(contentHash));
+        openCacheFile(cacheFile, contentHash, sampleChunkBytes, samples, pool);
+        prune(folder, cacheFile);
+    }
+
+    return true;
+}
+
+bool DecodedSampleCache::remove(const File& file)
+{
+    auto& counters = getCounters();
+    const auto folder = getCacheFolder();
+    const auto refFile = getRefFile(folder, file);
+    const String ref = refFile.loadFileAsString().trim();
+
+    if (ref.length() != 16)
+        return false;
+
+    const ScopedLock sl(counters.lock);
+    const bool removed = folder.getChildFile(ref + ".pcm").deleteFile() && refFile.deleteFile();
+    updateFolderStats(folder);
+
+    return removed;
+}
+
+File DecodedSampleCache::getCacheFolder()
+{
+#if JUCE_MAC
+    const String parent = "Application Support/";
+#else
+    const String parent;
+#endif
+
+    return File::getSpecialLocation(File::userApplicationDataDirectory)
+        .getChildFile(parent + JucePlugin_Name)
+        .getChildFile("Decoded samples");
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include "SharedSoundfont.h"
+#include "SoundfontStream.h"
+
+using namespace juce;
+
+// Decodes the Ogg Vorbis samples of SF3 files on a pool of worker threads,
+// and keeps the decoded 16 bit PCM in a folder on disk. Files are named after
+// a hash of the soundfont's sample data and headers, so copies of the same
+// soundfont share one, and later loads only map the decoded data.
+class DecodedSampleCache
+{
+public:
+    struct Stats
+    {
+        int hits;
+        int decodes;
+
+        // Of the last decode in this process.
+        double lastDecodeSeconds;
+        int lastDecodeThreads;
+
+        int numFiles;
+        int64 diskBytes;
+    };
+
+    static Stats getStats();
+
+    // Decoded sample data laid out like an SF2 sample pool, either mapped
+    // from a cache file or on the heap if it couldn't be written.
+    struct Pool
+    {
+        std::unique_ptr<MemoryMappedFile> mappedFile;
+        HeapBlock<short> heapData;
+        const short* data = nullptr;
+        size_t numPoints = 0;
+    };
+
+    // Decodes or looks up the samples of an SF3 file, given its smpl chunk
+    // data. Compressed samples are decoded, plain ones copied, and each is
+    // moved to its place in the pool. Returns false if a sample can't be
+    // decoded or the load is cancelled through the progress object.
+    static bool load(const File& file, const char* sampleChunk, int64 sampleChunkBytes,
+                     Array<SharedSoundfont::Sample>& samples, Pool& pool, SoundfontStream::LoadProgress* progress);
+
+    // Deletes the decoded samples of an SF3 file, so that its next load
+    // decodes it again. Returns false if there were none, or they are still
+    // mapped and can't be deleted.
+    static bool remove(const File& file);
+
+    static File getCacheFolder();
+};
@@ -0,0 +1,110 @@
+#include "PartitionWorker.h"
+
+PartitionWorker::PartitionWorker(fluid_synth_t* synth, int maxChannels)
+    : Thread("Synth partition")
+    , synth(synth)
+    , buffer(maxChannels, maxBlockSize)
+    , numSamples(0)
+    , numChannels(0)
+    , state(idle)
+    , collecting(false)
+{
+    // Scheduled like the host's audio thread, where the OS allows it.
+    if (!startRealtimeThread(RealtimeOptions{}.withPriority(10)))
+        startThread(Priority::highest);
+}
+
+PartitionWorker::~PartitionWorker()
+{
+    signalThreadShouldExit();
+    requestSemaphore.signal();
+    stopThread(5000);
+}
+
+void PartitionWorker::startRender(int samples, int channels) noexcept
+{
+    // A render finishRender() gave up on is thrown away once it is done.
+    // While it is still under way it owns the buffer, and this block goes
+    // without the partition.
+    int expected = done;
+    state.compare_exchange_strong(expected, idle);
+    collecting = state.load() == idle;
+
+    if (!collecting)
+        return;
+
+    numSamples = jmin(samples, maxBlockSize);
+    numChannels = jmin(channels, buffer.getNumChannels());
+    state.store(requested, std::memory_order_release);
+    requestSemaphore.signal();
+}
+
+void PartitionWorker::finishRender(float** out, double timeoutMs) noexcept
+{
+    if (!collecting)
+        return;
+
+    collecting = false;
+    int expected = requested;
+
+    // Not picked up yet: waiting for the worker to be scheduled could take
+    // any time, rendering here takes as long as the render itself.
+    if (state.compare_exchange_strong(expected, rendering))
+        render();
+    else if (!waitUntilDone(timeoutMs))
+        return;
+
+    state.store(idle);
+
+    for (int channel = 0; channel < numChannels; ++channel)
+        FloatVectorOperations::add(out[channel], buffer.getReadPointer(channel), numSamples);
+}
+
+bool PartitionWorker::waitUntilDone(double timeoutMs) noexcept
+{
+    const double deadline = Time::getMillisecondCounterHiRes() + timeoutMs;
+
+    // The semaphore may still count a render the audio thread didn't wait
+    // for, so the state decides.
+    while (state.load(std::memory_order_acquire) != done)
+    {
+        const double remaining = deadline - Time::getMillisecondCounterHiRes();
+
+        if (remaining <= 0.0 || !doneSemaphore.wait(remaining))
+            return state.load(std::memory_order_acquire) == done;
+    }
+
+    return true;
+}
+
+void PartitionWorker::render() noexcept
+{
+    const int samples = numSamples;
+
+    // fluid_synth_process() mixes into what is already there, and takes
+    // float** where JUCE hands out float* const*. It only writes the samples.
+    buffer.clear(0, samples);
+    fluid_synth_process(synth, samples, 0, nullptr, numChannels, const_cast<float**>(buffer.getArrayOfWritePointers()));
+
+    state.store(done, std::memory_order_release);
+}
+
+void PartitionWorker::run()
+{
+    const ScopedNoDenormals noDenormals;
+
+    while (!threadShouldExit())
+    {
+        requestSemaphore.wait();
+
+        // The request may already have been taken back by the audio thread,
+        // which then renders it itself.
+        int expected = requested;
+
+        if (state.compare_exchange_strong(expected, rendering))
+        {
+            render();
+            doneSemaphore.signal();
+        }
+    }
+}
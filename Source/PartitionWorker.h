@@ -0,0 +1,56 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "Semaphore.h"
+
+using namespace juce;
+
+// Renders one of an engine's extra synths on its own realtime thread, see
+// EngineOptions::partitions. The audio thread starts a render, renders its
+// own synth meanwhile, then collects this one and mixes it in. Each side
+// signals the other through a semaphore. A render the worker hasn't picked
+// up by the time the audio thread collects it is done on the audio thread
+// instead, so it only ever waits for one that is already under way, and
+// for no longer than a timeout.
+class PartitionWorker : private Thread
+{
+public:
+    PartitionWorker(fluid_synth_t* synth, int maxChannels);
+    ~PartitionWorker() override;
+
+    // Called on the audio thread, numSamples is at most maxBlockSize. A
+    // render still under way after timeoutMs is left out of the block, and
+    // so are the blocks started before it is done.
+    void startRender(int numSamples, int numChannels) noexcept;
+    void finishRender(float** out, double timeoutMs) noexcept;
+
+    static constexpr int maxBlockSize = 4096;
+
+private:
+    enum State
+    {
+        idle,
+        requested,
+        rendering,
+        done
+    };
+
+    void run() override;
+    void render() noexcept;
+    bool waitUntilDone(double timeoutMs) noexcept;
+
+    fluid_synth_t* synth;
+    AudioBuffer<float> buffer;
+    std::atomic<int> numSamples, numChannels;
+
+    std::atomic<int> state;
+    Semaphore requestSemaphore, doneSemaphore;
+
+    // Whether this block's render was started, audio thread only.
+    bool collecting;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PartitionWorker)
+};
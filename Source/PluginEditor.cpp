@@ -10,6 +10,8 @@
 #include "PluginEditor.h"
 #include "Utils.h"
 #include "PresetViewItem.h"
+#include "SoundfontCache.h"
+#include "DecodedSampleCache.h"
 
 //==============================================================================
 HandySynthAudioProcessorEditor::HandySynthAudioProcessorEditor (HandySynthAudioProcessor& p, AudioProcessorValueTreeState& params)
@@ -20,11 +22,19 @@ HandySynthAudioProcessorEditor::HandySynthAudioProcessorEditor (HandySynthAudioP
         "File", File(), false, false, false, 
         "*.sf2;*.SF2;*.sf3;*.SF3;*.sfz;*.SFZ", 
         String(), "Choose a Soundfont file..")
+    , loadProgress(0.0)
+    , loadProgressBar(loadProgress)
+    , cancelLoadBtn("Cancel")
+    , presetsVersion(-1)
     , treeView()
+    , statusLabel()
     , treeGroup()
+    , statsGroup()
     , gainGroup()
     , polyGroup()
     , fxGroup()
+    , engineGroup()
+    , profileGroup()
     , gainSlider(
         Slider::SliderStyle::RotaryHorizontalVerticalDrag, 
         Slider::TextEntryBoxPosition::TextBoxBelow)
@@ -34,24 +44,49 @@ HandySynthAudioProcessorEditor::HandySynthAudioProcessorEditor (HandySynthAudioP
     )
     , chorusBtn("Enable chorus")
     , reverbBtn("Enable reverb")
+    , strictTimingBtn("Strict timing")
+    , dynamicLoadingBtn("Load samples on demand")
+    , pinThreadsBtn("Pin render threads to cores")
+    , adaptiveQualityBtn("Adaptive quality")
+    , deterministicBtn("Deterministic rendering")
+    , programPolicyBox()
+    , renderThreadsBox()
+    , partitionsBox()
+    , renderRateBox()
+    , midiPortsBox()
+    , profileBox()
+    , interpolationBox()
+    , maxPolyphonyBox()
+    , effectQualityBox()
     , laf(nullptr)
 {
     // Make sure that before the constructor has finished, you've set the
     // editor's size to whatever you need it to be.
-    setSize (500, 400);
+    setSize (640, 764);
 
     laf = new CustomLookAndFeel();
     juce::LookAndFeel::setDefaultLookAndFeel(laf);
 
     addAndMakeVisible(sfChooser);
+    addChildComponent(loadProgressBar);
+    addChildComponent(cancelLoadBtn);
     addAndMakeVisible(treeGroup);
+    addAndMakeVisible(statsGroup);
     addAndMakeVisible(gainGroup);
     addAndMakeVisible(polyGroup);
     addAndMakeVisible(fxGroup);
+    addAndMakeVisible(engineGroup);
+    addAndMakeVisible(profileGroup);
 
     treeGroup.setText("Presets list");
     treeGroup.addAndMakeVisible(treeView);
 
+    // One line per group of counters, see updateStatus().
+    statsGroup.setText("Statistics");
+    statsGroup.addAndMakeVisible(statusLabel);
+    statusLabel.setJustificationType(Justification::topLeft);
+    statusLabel.setMinimumHorizontalScale(1.0f);
+
     gainGroup.setText("Gain");
     gainGroup.addAndMakeVisible(gainSlider);
 
@@ -62,6 +97,28 @@ HandySynthAudioProcessorEditor::HandySynthAudioProcessorEditor (HandySynthAudioP
     fxGroup.addAndMakeVisible(chorusBtn);
     fxGroup.addAndMakeVisible(reverbBtn);
 
+    engineGroup.setText("Engine");
+    engineGroup.addAndMakeVisible(strictTimingBtn);
+    engineGroup.addAndMakeVisible(adaptiveQualityBtn);
+    engineGroup.addAndMakeVisible(dynamicLoadingBtn);
+    engineGroup.addAndMakeVisible(programPolicyBox);
+    engineGroup.addAndMakeVisible(partitionsBox);
+    engineGroup.addAndMakeVisible(renderRateBox);
+    engineGroup.addAndMakeVisible(deterministicBtn);
+    engineGroup.addAndMakeVisible(midiPortsBox);
+
+    profileGroup.setText("Quality profiles");
+    profileGroup.addAndMakeVisible(profileBox);
+    profileGroup.addAndMakeVisible(interpolationBox);
+    profileGroup.addAndMakeVisible(maxPolyphonyBox);
+    profileGroup.addAndMakeVisible(renderThreadsBox);
+    profileGroup.addAndMakeVisible(effectQualityBox);
+
+    // Thread affinity is only implemented for Linux and Windows.
+#if JUCE_LINUX || JUCE_WINDOWS
+    engineGroup.addAndMakeVisible(pinThreadsBtn);
+#endif
+
     auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
     String path = v.getProperty("path").toString();
 
@@ -76,15 +133,87 @@ HandySynthAudioProcessorEditor::HandySynthAudioProcessorEditor (HandySynthAudioP
     polySlider.setNumDecimalPlacesToDisplay(0);
     polySlider.addListener(this);
 
+    cancelLoadBtn.addListener(this);
     chorusBtn.addListener(this);
     reverbBtn.addListener(this);
+    strictTimingBtn.addListener(this);
+    adaptiveQualityBtn.addListener(this);
+    dynamicLoadingBtn.addListener(this);
+    pinThreadsBtn.addListener(this);
+    pinThreadsBtn.setTooltip("Off by default. Pins FluidSynth's render threads to a core each, taking the last "
+                             "cores this process may use. Only threads the OS reports by FluidSynth's names "
+                             "are pinned: on Linux, and on Windows 10 1607 or later, elsewhere nothing is. "
+                             "The host's audio thread may still share a core with one of them.");
+    deterministicBtn.addListener(this);
+
+    programPolicyBox.addItemList(parameters.getParameter("programChangePolicy")->getAllValueStrings(), 1);
+    programPolicyBox.addListener(this);
+
+    for (int threads = 1; threads <= SynthEngine::maxRenderThreads; ++threads)
+        renderThreadsBox.addItem(String(threads) + (threads == 1 ? " render thread" : " render threads"), threads);
+
+    renderThreadsBox.addListener(this);
+
+    profileBox.addItem("Real-time", realtimeProfileId);
+    profileBox.addItem("Offline", offlineProfileId);
+    profileBox.setSelectedId(realtimeProfileId, juce::dontSendNotification);
+    profileBox.addListener(this);
+
+    // Item ids are the FluidSynth interpolation method plus one.
+    interpolationBox.addItem("No interpolation", FLUID_INTERP_NONE + 1);
+    interpolationBox.addItem("Linear interpolation", FLUID_INTERP_LINEAR + 1);
+    interpolationBox.addItem("4th order interpolation", FLUID_INTERP_4THORDER + 1);
+    interpolationBox.addItem("7th order interpolation", FLUID_INTERP_7THORDER + 1);
+    interpolationBox.addListener(this);
+
+    for (int voices = 64; voices <= SynthEngine::maxPolyphony; voices *= 2)
+        maxPolyphonyBox.addItem("Up to " + String(voices) + " voices", voices);
+
+    maxPolyphonyBox.addListener(this);
+
+    effectQualityBox.addItem("Effects off", QualityProfile::effectsOff + 1);
+    effectQualityBox.addItem("Standard effects", QualityProfile::standardEffects + 1);
+    effectQualityBox.addItem("High quality effects", QualityProfile::highEffects + 1);
+    effectQualityBox.addListener(this);
+
+    // Item ids are the number of synths, plus partitionByNoteId for splitting by note.
+    partitionsBox.addItem("Single synth", 1);
+
+    for (int synths = 2; synths <= SynthEngine::maxPartitions; synths *= 2)
+        partitionsBox.addItem(String(synths) + " synths, split by channel", synths);
+
+    for (int synths = 2; synths <= SynthEngine::maxPartitions; synths *= 2)
+        partitionsBox.addItem(String(synths) + " synths, notes in turn except drums and mono", partitionByNoteId + synths);
+
+    partitionsBox.addListener(this);
+    partitionsBox.setTooltip("Each synth gets an equal share of the polyphony limit. Split by channel, the "
+                             "channels on one synth can only play its share, 32 voices with 4 synths and a "
+                             "limit of 128.");
+
+    // Item ids are the render rate in Hz.
+    renderRateBox.addItem("Render at host rate", hostRateId);
+
+    for (int rate : { 22050, 32000, 44100, 48000, 96000 })
+        renderRateBox.addItem("Render at " + String(rate / 1000.0, 2).trimCharactersAtEnd("0").trimCharactersAtEnd(".") + " kHz", rate);
+
+    renderRateBox.addListener(this);
+
+    // Item ids are the number of ports.
+    for (int ports = 1; ports <= SynthEngine::maxMidiPorts; ports *= 2)
+        midiPortsBox.addItem(String(ports * 16) + " MIDI channels" + (ports > 1 ? " (" + String(ports) + " ports)" : String()), ports);
+
+    midiPortsBox.addListener(this);
 
     initUiParameters();
     setupTreeView();
+    updateStatus();
+
+    startTimerHz(10);
 }
 
 HandySynthAudioProcessorEditor::~HandySynthAudioProcessorEditor()
 {
+    stopTimer();
     treeView.deleteRootItem();
 
     juce::LookAndFeel::setDefaultLookAndFeel(nullptr);
@@ -105,9 +234,12 @@ void HandySynthAudioProcessorEditor::resized()
 
     const int padding = 8;
     const int fileChooserHeight = 28;
-    const int bottomHeight = 120;
+    const int bottomHeight = 286;
+    const int profileHeight = 64;
+    const int statsHeight = 130;
 
     auto bounds = getLocalBounds().reduced(padding);
+    auto profileBounds = bounds.removeFromBottom(profileHeight);
     auto bottomBounds = bounds.removeFromBottom(bottomHeight);
 
     //sfChooser.setBounds(bounds.removeFromTop(fileChooserHeight + padding).reduced(padding, 0).withTrimmedTop(padding));
@@ -124,13 +256,28 @@ void HandySynthAudioProcessorEditor::resized()
     margin.bottom = 2;
 
     rootFlex.items.add(FlexItem(treeGroup).withFlex(1.0).withMargin(margin));
+    rootFlex.items.add(FlexItem(statsGroup).withHeight(statsHeight).withMargin(margin));
 
     rootFlex.performLayout(bounds);
 
+    if (loadProgressBar.isVisible())
+    {
+        auto row = sfChooser.getBounds();
+        cancelLoadBtn.setBounds(row.removeFromRight(70));
+        row.removeFromRight(padding);
+        loadProgressBar.setBounds(row.removeFromRight(140));
+        row.removeFromRight(padding);
+        sfChooser.setBounds(row);
+    }
+
     bounds = treeGroup.getLocalBounds().reduced(padding);
     bounds.removeFromTop(10);
     treeView.setBounds(bounds);
 
+    bounds = statsGroup.getLocalBounds().reduced(padding);
+    bounds.removeFromTop(10);
+    statusLabel.setBounds(bounds);
+
 
     // Bottom ---------------------------------------
 
@@ -141,6 +288,7 @@ void HandySynthAudioProcessorEditor::resized()
     bottomFlex.items.add(FlexItem(gainGroup).withFlex(1));
     bottomFlex.items.add(FlexItem(polyGroup).withFlex(1));
     bottomFlex.items.add(FlexItem(fxGroup).withFlex(1));
+    bottomFlex.items.add(FlexItem(engineGroup).withFlex(1));
 
     bottomFlex.performLayout(bottomBounds);
 
@@ -153,17 +301,90 @@ void HandySynthAudioProcessorEditor::resized()
     chorusBtn.setBounds(bounds);
     bounds.setY(50);
     reverbBtn.setBounds(bounds);
+
+    bounds = engineGroup.getLocalBounds();
+    bounds = bounds.withTrimmedLeft(16).withTrimmedRight(8).withHeight(28);
+    bounds.setY(16);
+    strictTimingBtn.setBounds(bounds);
+    bounds.setY(44);
+    dynamicLoadingBtn.setBounds(bounds);
+    bounds.setY(76);
+    programPolicyBox.setBounds(bounds.withHeight(24));
+    bounds.setY(104);
+    partitionsBox.setBounds(bounds.withHeight(24));
+    bounds.setY(132);
+    adaptiveQualityBtn.setBounds(bounds);
+    bounds.setY(160);
+    pinThreadsBtn.setBounds(bounds);
+    bounds.setY(190);
+    renderRateBox.setBounds(bounds.withHeight(24));
+    bounds.setY(216);
+    deterministicBtn.setBounds(bounds);
+    bounds.setY(246);
+    midiPortsBox.setBounds(bounds.withHeight(24));
+
+    profileGroup.setBounds(profileBounds);
+
+    FlexBox profileFlex;
+    profileFlex.flexDirection = FlexBox::Direction::row;
+
+    FlexItem::Margin comboMargin;
+    comboMargin.right = padding;
+
+    for (auto* box : { &profileBox, &interpolationBox, &maxPolyphonyBox, &renderThreadsBox, &effectQualityBox })
+        profileFlex.items.add(FlexItem(*box).withFlex(1).withHeight(24).withMargin(comboMargin));
+
+    profileFlex.performLayout(profileGroup.getLocalBounds().withTrimmedLeft(16).withTrimmedRight(8).withTrimmedTop(24).withHeight(24));
 }
 
 void HandySynthAudioProcessorEditor::initUiParameters()
 {
-    auto synth = audioProcessor.getFluidSynth();
-
-    gainSlider.setValue(fluid_synth_get_gain(synth), juce::dontSendNotification);
-    polySlider.setValue(fluid_synth_get_polyphony(synth), juce::dontSendNotification);
+    gainSlider.setValue(*parameters.getRawParameterValue("gain"), juce::dontSendNotification);
+    polySlider.setValue(*parameters.getRawParameterValue("polyphony"), juce::dontSendNotification);
     chorusBtn.setToggleState(audioProcessor.getChorusOn(), juce::dontSendNotification);
     reverbBtn.setToggleState(audioProcessor.getReverbOn(), juce::dontSendNotification);
+    strictTimingBtn.setToggleState(*parameters.getRawParameterValue("strictTiming") >= 0.5f, juce::dontSendNotification);
+    adaptiveQualityBtn.setToggleState(*parameters.getRawParameterValue("adaptiveQuality") >= 0.5f, juce::dontSendNotification);
 
+    auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+    dynamicLoadingBtn.setToggleState(v.getProperty("dynamicSampleLoading", false), juce::dontSendNotification);
+    pinThreadsBtn.setToggleState(v.getProperty("pinRenderThreads", false), juce::dontSendNotification);
+    deterministicBtn.setToggleState(v.getProperty("deterministicRendering", false), juce::dontSendNotification);
+
+    int renderRate = v.getProperty("renderSampleRate", 0);
+    renderRateBox.setSelectedId(renderRate > 0 ? renderRate : hostRateId, juce::dontSendNotification);
+
+    midiPortsBox.setSelectedId(v.getProperty("midiPorts", 1), juce::dontSendNotification);
+
+    int partitions = v.getProperty("partitions", 1);
+    bool byNote = v.getProperty("partitionMode").toString() == "note";
+    partitionsBox.setSelectedId(partitions > 1 && byNote ? partitionByNoteId + partitions : partitions, juce::dontSendNotification);
+
+    auto policy = (AudioParameterChoice*)parameters.getParameter("programChangePolicy");
+    programPolicyBox.setSelectedItemIndex(policy->getIndex(), juce::dontSendNotification);
+
+    showProfile();
+}
+
+ValueTree HandySynthAudioProcessorEditor::getSelectedProfile()
+{
+    auto profiles = parameters.state.getOrCreateChildWithName("PROFILES", nullptr);
+    return profiles.getOrCreateChildWithName(profileBox.getSelectedId() == offlineProfileId ? "OFFLINE" : "REALTIME", nullptr);
+}
+
+void HandySynthAudioProcessorEditor::showProfile()
+{
+    QualityProfile profile;
+    profile.readFrom(getSelectedProfile());
+
+    // The processor fills in render threads a session saved before profiles existed.
+    if (profileBox.getSelectedId() == realtimeProfileId && !getSelectedProfile().hasProperty("renderThreads"))
+        profile.renderThreads = (int)parameters.state.getChildWithName("SOUNDFONT").getProperty("renderThreads", 1);
+
+    interpolationBox.setSelectedId(profile.interpolation + 1, juce::dontSendNotification);
+    maxPolyphonyBox.setSelectedId(profile.maxPolyphony, juce::dontSendNotification);
+    renderThreadsBox.setSelectedId(profile.renderThreads, juce::dontSendNotification);
+    effectQualityBox.setSelectedId(profile.effectQuality + 1, juce::dontSendNotification);
 }
 
 void HandySynthAudioProcessorEditor::sliderValueChanged(Slider* slider)
@@ -182,6 +403,10 @@ void HandySynthAudioProcessorEditor::sliderValueChanged(Slider* slider)
 
 void HandySynthAudioProcessorEditor::buttonClicked(Button* button)
 {
+    if (button == &cancelLoadBtn) {
+        audioProcessor.cancelSoundfontLoad();
+    }
+
     if (button == &chorusBtn) {
         auto param = parameters.getParameter("chorus");
         param->setValueNotifyingHost(button->getToggleState());
@@ -191,6 +416,77 @@ void HandySynthAudioProcessorEditor::buttonClicked(Button* button)
         auto param = parameters.getParameter("reverb");
         param->setValueNotifyingHost(button->getToggleState());
     }
+
+    if (button == &strictTimingBtn) {
+        auto param = parameters.getParameter("strictTiming");
+        param->setValueNotifyingHost(button->getToggleState());
+    }
+
+    if (button == &adaptiveQualityBtn) {
+        auto param = parameters.getParameter("adaptiveQuality");
+        param->setValueNotifyingHost(button->getToggleState());
+    }
+
+    if (button == &dynamicLoadingBtn) {
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("dynamicSampleLoading", button->getToggleState(), nullptr);
+    }
+
+    if (button == &pinThreadsBtn) {
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("pinRenderThreads", button->getToggleState(), nullptr);
+    }
+
+    if (button == &deterministicBtn) {
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("deterministicRendering", button->getToggleState(), nullptr);
+    }
+}
+
+void HandySynthAudioProcessorEditor::comboBoxChanged(ComboBox* comboBox)
+{
+    if (comboBox == &programPolicyBox) {
+        auto policy = (AudioParameterChoice*)parameters.getParameter("programChangePolicy");
+        *policy = comboBox->getSelectedItemIndex();
+    }
+
+    if (comboBox == &profileBox) {
+        showProfile();
+    }
+
+    if (comboBox == &interpolationBox) {
+        getSelectedProfile().setProperty("interpolation", comboBox->getSelectedId() - 1, nullptr);
+    }
+
+    if (comboBox == &maxPolyphonyBox) {
+        getSelectedProfile().setProperty("maxPolyphony", comboBox->getSelectedId(), nullptr);
+    }
+
+    if (comboBox == &renderThreadsBox) {
+        getSelectedProfile().setProperty("renderThreads", comboBox->getSelectedId(), nullptr);
+    }
+
+    if (comboBox == &effectQualityBox) {
+        getSelectedProfile().setProperty("effectQuality", comboBox->getSelectedId() - 1, nullptr);
+    }
+
+    if (comboBox == &renderRateBox) {
+        int id = comboBox->getSelectedId();
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("renderSampleRate", id == hostRateId ? 0 : id, nullptr);
+    }
+
+    if (comboBox == &midiPortsBox) {
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("midiPorts", comboBox->getSelectedId(), nullptr);
+    }
+
+    if (comboBox == &partitionsBox) {
+        int id = comboBox->getSelectedId();
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        v.setProperty("partitionMode", id > partitionByNoteId ? "note" : "channel", nullptr);
+        v.setProperty("partitions", id % partitionByNoteId, nullptr);
+    }
 }
 
 void HandySynthAudioProcessorEditor::filenameComponentChanged(FilenameComponent* fileComponentThatHasChanged)
@@ -198,17 +494,44 @@ void HandySynthAudioProcessorEditor::filenameComponentChanged(FilenameComponent*
     auto path = fileComponentThatHasChanged->getCurrentFile().getFullPathName();
     auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
     v.setProperty("path", path, nullptr);
+}
 
-    setupTreeView();
+void HandySynthAudioProcessorEditor::timerCallback()
+{
+    bool loading = audioProcessor.isLoadingSoundfont();
+    loadProgress = audioProcessor.getSoundfontLoadProgress();
+
+    if (loading != loadProgressBar.isVisible())
+    {
+        loadProgressBar.setVisible(loading);
+        cancelLoadBtn.setVisible(loading);
+        resized();
+    }
+
+    if (presetsVersion != audioProcessor.getPresetsVersion())
+        setupTreeView();
+
+    updateStatus();
+
+    if (!loading)
+    {
+        // A cancelled load puts the previous path back into the state.
+        auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+        String path = v.getProperty("path").toString();
+
+        if (sfChooser.getCurrentFile().getFullPathName() != path)
+            sfChooser.setCurrentFile(File(path), false, juce::dontSendNotification);
+    }
 }
 
 void HandySynthAudioProcessorEditor::setupTreeView()
 {
-    fluid_sfont_t* sfont = audioProcessor.getFluidSoundfont();
+    presetsVersion = audioProcessor.getPresetsVersion();
+    Array<PresetInfo> presets = audioProcessor.getPresets();
 
     treeView.deleteRootItem();
 
-    if (sfont == nullptr)
+    if (presets.isEmpty())
         return;
 
 
@@ -217,32 +540,82 @@ void HandySynthAudioProcessorEditor::setupTreeView()
     treeView.setRootItem(rootItem);
     treeView.setRootItemVisible(false);
 
-    HashMap<int, Array<fluid_preset_t*>> map;
+    HashMap<int, Array<PresetInfo>> map;
 
-    fluid_sfont_iteration_start(sfont);
-    while (auto preset = fluid_sfont_iteration_next(sfont))
+    for (auto& preset : presets)
     {
-        int bank = fluid_preset_get_banknum(preset);
-        auto list = map.getReference(bank);
+        auto list = map.getReference(preset.bank);
         list.add(preset);
-        map.set(bank, list);
+        map.set(preset.bank, list);
     }
 
-    for (HashMap<int, Array<fluid_preset_t*>>::Iterator bank(map); bank.next();)
+    for (HashMap<int, Array<PresetInfo>>::Iterator bank(map); bank.next();)
     {
         String bankText = "Bank # " + String(bank.getKey());
         PresetViewItem* bankItem = new PresetViewItem(bankText, true);
         bankItem->setOpen(true);
         rootItem->addSubItem(bankItem);
 
-        Array<fluid_preset_t*> bankList = bank.getValue();
+        Array<PresetInfo> bankList = bank.getValue();
 
         for (int i=0; i<bankList.size(); i++)
         {
-            int num = fluid_preset_get_num(bankList[i]);
-            String name = String(CharPointer_ASCII(fluid_preset_get_name(bankList[i])));
-            String text = String(num) + "   " + name;
+            String text = String(bankList[i].program) + "   " + bankList[i].name;
             bankItem->addSubItem(new PresetViewItem(text, false));
         }
     }
 }
+
+void HandySynthAudioProcessorEditor::updateStatus()
+{
+    auto cache = SoundfontCache::getStats();
+
+    StringArray lines;
+    auto loadError = audioProcessor.getSoundfontLoadError();
+
+    if (loadError.isNotEmpty())
+        lines.add("Load failed: " + loadError);
+
+    String line;
+    line << "Shared soundfonts: " << cache.numSoundfonts
+         << " (" << String(cache.residentBytes / (1024.0 * 1024.0), 1) << " MB in memory, "
+         << String(cache.mappedBytes / (1024.0 * 1024.0), 1) << " MB mapped)"
+         << ", cache hits " << cache.hits << ", misses " << cache.misses;
+    lines.add(line);
+
+    auto decoded = DecodedSampleCache::getStats();
+
+    if (decoded.hits + decoded.decodes > 0)
+    {
+        line.clear();
+        line << "SF3 cache: " << decoded.hits << " hits, " << decoded.decodes << " decodes";
+
+        if (decoded.decodes > 0)
+            line << " (last " << String(decoded.lastDecodeSeconds, 1) << " s on " << decoded.lastDecodeThreads << " threads)";
+
+        line << ", " << String(decoded.diskBytes / (1024.0 * 1024.0), 1) << " MB in " << decoded.numFiles << " files";
+        lines.add(line);
+    }
+
+    int64 totalBytes;
+
+    if (audioProcessor.getOnDemandSampleBytes(totalBytes))
+    {
+        line.clear();
+        line << "On demand: " << String(cache.presetLockedBytes / (1024.0 * 1024.0), 1)
+             << " of " << String(totalBytes / (1024.0 * 1024.0), 1) << " MB of samples locked, "
+             << cache.presetLockFailures << " lock failures";
+        lines.add(line);
+    }
+
+    line.clear();
+    line << QualityGovernor::getLevelName(audioProcessor.getQualityLevel())
+         << ", idle: " << roundToInt(audioProcessor.getSkippedBlockFraction() * 100.0) << "% of blocks skipped"
+         << ", coalesced: " << String(audioProcessor.getCoalescedEventsPerBlock(), 1) << " events/block";
+    lines.add(line);
+
+    auto text = lines.joinIntoString("\n");
+
+    if (statusLabel.getText() != text)
+        statusLabel.setText(text, juce::dontSendNotification);
+}
@@ -23,7 +23,9 @@ class HandySynthAudioProcessorEditor  :
     public juce::AudioProcessorEditor,
     private juce::FilenameComponentListener, 
     private Slider::Listener, 
-    private Button::Listener
+    private Button::Listener,
+    private ComboBox::Listener,
+    private Timer
 {
 public:
     HandySynthAudioProcessorEditor (HandySynthAudioProcessor&, AudioProcessorValueTreeState&);
@@ -37,8 +39,13 @@ private:
     void initUiParameters();
     void sliderValueChanged(Slider* slider);
     void buttonClicked(Button* button);
+    void comboBoxChanged(ComboBox* comboBox) override;
     void filenameComponentChanged(FilenameComponent* fileComponentThatHasChanged) override;
+    void timerCallback() override;
     void setupTreeView();
+    void updateStatus();
+    void showProfile();
+    ValueTree getSelectedProfile();
 
     // This reference is provided as a quick way for your editor to
     // access the processor object that created it.
@@ -47,12 +54,26 @@ private:
     AudioProcessorValueTreeState& parameters;
 
     FilenameComponent sfChooser;
+    double loadProgress;
+    ProgressBar loadProgressBar;
+    TextButton cancelLoadBtn;
+    int presetsVersion;
     TreeView treeView;
-    GroupBox treeGroup, gainGroup, polyGroup, fxGroup;
+    Label statusLabel;
+    GroupBox treeGroup, statsGroup, gainGroup, polyGroup, fxGroup, engineGroup, profileGroup;
     Slider gainSlider, polySlider;
-    ToggleButton chorusBtn, reverbBtn;
+    ToggleButton chorusBtn, reverbBtn, strictTimingBtn, dynamicLoadingBtn, pinThreadsBtn, adaptiveQualityBtn;
+    ToggleButton deterministicBtn;
+    ComboBox programPolicyBox, renderThreadsBox, partitionsBox, renderRateBox, midiPortsBox;
+    ComboBox profileBox, interpolationBox, maxPolyphonyBox, effectQualityBox;
+    TooltipWindow tooltipWindow { this };
 
     CustomLookAndFeel* laf;
 
+    static constexpr int partitionByNoteId = 100;
+    static constexpr int realtimeProfileId = 1;
+    static constexpr int offlineProfileId = 2;
+    static constexpr int hostRateId = 1;
+
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HandySynthAudioProcessorEditor)
 };
@@ -9,41 +9,92 @@
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
 
+namespace
+{
+    // A stereo bus for each further audio group, off until the host enables them.
+    juce::AudioProcessor::BusesProperties withChannelOutputs(juce::AudioProcessor::BusesProperties buses)
+    {
+        for (int bus = 2; bus <= SynthEngine::maxAudioGroups; ++bus)
+            buses = buses.withOutput("Channel " + String(bus), juce::AudioChannelSet::stereo(), false);
+
+        return buses;
+    }
+}
+
 //==============================================================================
 HandySynthAudioProcessor::HandySynthAudioProcessor()
 #ifndef JucePlugin_PreferredChannelConfigurations
-     : AudioProcessor (BusesProperties()
+     : AudioProcessor (withChannelOutputs (BusesProperties()
                      #if ! JucePlugin_IsMidiEffect
                       #if ! JucePlugin_IsSynth
                        .withInput  ("Input",  juce::AudioChannelSet::stereo(), true)
                       #endif
                        .withOutput ("Output", juce::AudioChannelSet::stereo(), true)
                      #endif
-                       )
+                       ))
     
 #endif
     , parameters(*this, nullptr, "PARAMETERS", createParameterLayout())
-    , settings(nullptr)
-    , synth(nullptr)
-    , sfId(-1)
+    , engine(std::make_unique<SynthEngine>(44100.0, EngineOptions()))
+    , loader(engine, getCallbackLock())
+    , currentSampleRate(44100.0)
+    , maxBlockSize(512)
+    , renderSampleRate(44100.0)
+    , resampling(false)
+    , deterministic(false)
+    , streamPosition(0)
+    , quantumRead(renderQuantum)
+    , numDeferredEvents(0)
+    , numDeferredBytes(0)
+    , numDroppedEvents(0)
+    , releasingEvents(false)
+    , midiPort(0)
+    , masterVolume(1.0f)
+    , pendingResetSize(0)
+    , resetProgress(-1)
+    , resetStepBlock(-1)
+    , coalesceBlock(0)
+    , numCoalescedEvents(0)
+    , numOutputBuses(1)
+    , engineGeneration(-1)
+    , gainValue(nullptr)
+    , polyphonyValue(nullptr)
+    , chorusValue(nullptr)
+    , reverbValue(nullptr)
+    , strictTiming(nullptr)
+    , renderPhase(0)
     , chorusOn(false)
     , reverbOn(false)
+    , idle(false)
+    , silentSamples(0)
+    , numBlocks(0)
+    , numSkippedBlocks(0)
+    , effectsSuspended(false)
+    , voicelessSamples(0)
+    , adaptiveQuality(nullptr)
+    , offlineActive(false)
+    , silenceWhilePaging(nullptr)
 {
-    settings = new_fluid_settings();
-    synth = new_fluid_synth(settings);
+    gainValue = parameters.getRawParameterValue("gain");
+    polyphonyValue = parameters.getRawParameterValue("polyphony");
+    chorusValue = parameters.getRawParameterValue("chorus");
+    reverbValue = parameters.getRawParameterValue("reverb");
+    strictTiming = parameters.getRawParameterValue("strictTiming");
+    silenceWhilePaging = parameters.getRawParameterValue("programChangePolicy");
+    adaptiveQuality = parameters.getRawParameterValue("adaptiveQuality");
 
-#if JUCE_DEBUG
-    fluid_settings_setint(settings, "synth.verbose", 1);
-#endif
+    for (auto& pending : pendingPrograms)
+        pending = { 0, -1, false };
 
-    fluid_synth_set_gain(synth, 0.6f);
-    fluid_synth_set_polyphony(synth, 128);
+    for (auto& slot : controllerSlots)
+        slot = { -1, 0, 0, 0 };
 
-    fluid_settings_setint(settings, "synth.chorus.active", 0);
-    fluid_settings_setint(settings, "synth.reverb.active", 0);
+    for (auto& epoch : channelEpochs)
+        epoch = 0;
 
-    fluid_synth_set_interp_method(synth, -1, FLUID_INTERP_HIGHEST);
+    forgetControllerValues(-1);
 
+    readProfiles();
     parameters.state.addListener(this);
 
     parameters.addParameterListener("gain", this);
@@ -54,9 +105,7 @@ HandySynthAudioProcessor::HandySynthAudioProcessor()
 
 HandySynthAudioProcessor::~HandySynthAudioProcessor()
 {
-    fluid_synth_sfunload(synth, sfId, 1);
-    delete_fluid_synth(synth);
-    delete_fluid_settings(settings);
+    cancelPendingUpdate();
 }
 
 //==============================================================================
@@ -94,7 +143,9 @@ bool HandySynthAudioProcessor::isMidiEffect() const
 
 double HandySynthAudioProcessor::getTailLengthSeconds() const
 {
-    return 0.0;
+    auto tails = loader.getTailLengths();
+
+    return tails.release + jmax(reverbOn ? tails.reverb : 0.0, chorusOn ? tails.chorus : 0.0);
 }
 
 int HandySynthAudioProcessor::getNumPrograms()
@@ -127,7 +178,24 @@ void HandySynthAudioProcessor::prepareToPlay (double sampleRate, int samplesPerB
     // Use this method as the place to do any pre-playback
     // initialisation that you need..
 
-    fluid_synth_set_sample_rate(synth, sampleRate);
+    currentSampleRate = sampleRate;
+    maxBlockSize = samplesPerBlock;
+
+    updateRenderPipeline();
+
+    // The host may have enabled or disabled output buses, which takes an
+    // engine with a different number of audio groups.
+    int enabledBuses = 1;
+
+    for (int bus = 0; bus < getBusCount(false); ++bus)
+        if (getBus(false, bus)->isEnabled())
+            enabledBuses = bus + 1;
+
+    if (enabledBuses != numOutputBuses)
+    {
+        numOutputBuses = enabledBuses;
+        setSoundfont(parameters.state.getChildWithName("SOUNDFONT"));
+    }
 }
 
 void HandySynthAudioProcessor::releaseResources()
@@ -151,6 +219,21 @@ bool HandySynthAudioProcessor::isBusesLayoutSupported (const BusesLayout& layout
      && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
         return false;
 
+    // Further outputs are stereo pairs, one per audio group, enabled in
+    // order so that the channels of the buffer line up with the groups.
+    for (int bus = 1; bus < layouts.outputBuses.size(); ++bus)
+    {
+        auto set = layouts.outputBuses[bus];
+
+        if (set.isDisabled())
+            continue;
+
+        if (set != juce::AudioChannelSet::stereo()
+         || layouts.outputBuses[bus - 1].isDisabled()
+         || layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+            return false;
+    }
+
     // This checks if the input layout matches the output layout
    #if ! JucePlugin_IsSynth
     if (layouts.getMainOutputChannelSet() != layouts.getMainInputChannelSet())
@@ -165,6 +248,62 @@ bool HandySynthAudioProcessor::isBusesLayoutSupported (const BusesLayout& layout
 void HandySynthAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
+
+    const auto startTicks = Time::getHighResolutionTicks();
+
+    loader.swapEngine();
+
+    if (loader.getEngineGeneration() != engineGeneration)
+    {
+        // A freshly loaded engine starts with FluidSynth's defaults.
+        engineGeneration = loader.getEngineGeneration();
+        renderPhase = 0;
+        resetRenderTimeline();
+
+        for (auto& pending : pendingPrograms)
+            pending.program = -1;
+
+        effectsSuspended = false;
+        voicelessSamples = 0;
+        masterVolume = 1.0f;
+        pendingResetSize = 0;
+        resetProgress = -1;
+        forgetControllerValues(-1);
+        tuningWorker.resetChannels();
+
+        controlQueue.requestResync();
+    }
+
+    // For a freshly loaded engine, or after updateRenderPipeline() picked
+    // another render rate.
+    if (engine->getSampleRate() != renderSampleRate)
+        engine->setSampleRate(renderSampleRate);
+
+    bool controlsChanged = false;
+
+    if (controlQueue.drain([this, &controlsChanged](const ControlCommand& command) {
+            applyControlCommand(command);
+            controlsChanged = true;
+        }))
+    {
+        resyncControls();
+        controlsChanged = true;
+    }
+
+    applyPendingPrograms();
+
+    // Tunings prepared since the last block, before the events held behind
+    // them.
+    tuningWorker.install(*engine);
+
+    // FluidSynth only applies some changes while rendering, so anything that
+    // reaches the synth wakes it up.
+    if (controlsChanged || !midiMessages.isEmpty() || numDeferredEvents > 0 || isResetInProgress())
+    {
+        idle = false;
+        silentSamples = 0;
+    }
+
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
@@ -177,74 +316,765 @@ void HandySynthAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, j
     for (auto i = totalNumInputChannels; i < totalNumOutputChannels; ++i)
         buffer.clear (i, 0, buffer.getNumSamples());
 
-    // This is the place where you'd normally do the guts of your plugin's
-    // audio processing...
-    // Make sure to reset the state if your inner loop is processing
-    // the samples and the outer loop is handling the channels.
-    // Alternatively, you can process the samples with the channels
-    // interleaved by keeping the same state.
-    for (int channel = 0; channel < totalNumInputChannels; ++channel)
+    ++numBlocks;
+
+    if (idle)
     {
-        auto* channelData = buffer.getWritePointer (channel);
+        ++numSkippedBlocks;
+        return;
+    }
+
+    const int numSamples = buffer.getNumSamples();
+    const bool strict = strictTiming->load() >= 0.5f;
+    const int startPhase = renderPhase;
+    int rendered = 0;
+
+    // A reset spread over several blocks goes on with its next synth.
+    continueReset();
+
+    // Events held over from the last block all start on the first quantum
+    // boundary of this one, or on its first sample when they were held
+    // behind a reset or a tuning. Another one among them holds the rest
+    // again.
+    if (numDeferredEvents > 0 && !isResetInProgress() && tuningWorker.getNumPending() == 0)
+    {
+        const int boundary = deterministic ? getQuantumBoundary(0) : 0;
+
+        if (boundary < numSamples)
+        {
+            renderSynth(buffer, 0, boundary);
+            rendered = boundary;
 
-        // ..do something to the data...
+            int dispatched = 0;
+
+            for (; dispatched < numDeferredEvents; ++dispatched)
+            {
+                auto* data = deferredBytes + deferredEvents[dispatched].start;
+
+                if (tuningWorker.getNumPending() > 0 || isHeldByReset(data, deferredEvents[dispatched].numBytes))
+                    break;
+
+                dispatchMidiEvent(data, deferredEvents[dispatched].numBytes);
+            }
+
+            removeDeferredEvents(dispatched);
+        }
     }
 
-    int time;
-    juce::MidiMessage m;
+    // After the held over events, which may have selected another port.
+    markRedundantEvents(midiMessages, numSamples, strict, startPhase);
+    int eventIndex = 0;
 
-    for (juce::MidiBuffer::Iterator i{ midiMessages }; i.getNextEvent(m, time);)
+    // Render up to each event before dispatching it, so that it starts where
+    // it was scheduled instead of at the top of the host block.
+    for (const auto metadata : midiMessages)
     {
-        juce::uint8 status = m.getRawData()[0];
-        int channel = m.getChannel() - 1;
+        const int time = metadata.samplePosition;
+        const bool redundant = eventIndex < maxCoalescedEvents && redundantEvents[eventIndex];
+        ++eventIndex;
 
-        switch (status & 0xF0)
+        if (redundant)
         {
-        case 0x80:
-            fluid_synth_noteoff(synth, channel, m.getNoteNumber());
-            break;
-        case 0x90:
-            fluid_synth_noteon(synth, channel, m.getNoteNumber(), m.getVelocity());
-            break;
-        case 0xA0:
-            fluid_synth_key_pressure(synth, channel, m.getNoteNumber(), m.getAfterTouchValue());
-            break;
-        case 0xB0:
-            fluid_synth_cc(synth, channel, m.getControllerNumber(), m.getControllerValue());
-            break;
-        case 0xC0:
-            fluid_synth_program_change(synth, channel, m.getProgramChangeNumber());
-            break;
-        case 0xD0:
-            fluid_synth_channel_pressure(synth, channel, m.getChannelPressureValue());
-            break;
-        case 0xE0:
-            fluid_synth_pitch_bend(synth, channel, m.getPitchWheelValue());
-            break;
-        case 0xF0:
-            switch (status)
+            ++numCoalescedEvents;
+            continue;
+        }
+
+        bool release = false;
+
+        if (deterministic)
+        {
+            const int boundary = getQuantumBoundary(time);
+
+            if (boundary >= numSamples || numDeferredEvents > 0)
             {
-            case 0xF7: // SysEx
-                break;
-            case 0xFF: // Meta
-                break;
-            default:
-                break;
+                if (deferEvent(metadata.data, metadata.numBytes))
+                    continue;
+
+                // No room to hold it. The held events and this one all start
+                // on its boundary, or at the end of the block when that lies
+                // past it, rather than being dropped.
+                release = true;
             }
+        }
+        else if (numDeferredEvents > 0 || tuningWorker.getNumPending() > 0 || isHeldByReset(metadata.data, metadata.numBytes))
+        {
+            if (deferEvent(metadata.data, metadata.numBytes))
+                continue;
+
+            // No room to hold it, so the held events go out here, ahead of it.
+            release = true;
+        }
+
+        int splitAt = jlimit(rendered, numSamples, getSplitPosition(time, numSamples, strict, startPhase));
+
+        renderSynth(buffer, rendered, splitAt - rendered);
+        rendered = splitAt;
+
+        if (release)
+            releaseDeferredEvents();
+
+        if (!dispatchMidiEvent(metadata.data, metadata.numBytes))
+            ++numCoalescedEvents;
+    }
+
+    renderSynth(buffer, rendered, numSamples - rendered);
+    streamPosition += numSamples;
+
+    // Any tuning posted above is prepared while the host is between blocks.
+    tuningWorker.wake();
+
+    updateIdleState(buffer);
+
+    bool qualityChanged;
+
+    // Offline there is no deadline to keep, and changing quality by timing
+    // would make deterministic renders differ.
+    if (adaptiveQuality->load() >= 0.5f && !isNonRealtime() && !deterministic)
+        qualityChanged = governor.update(Time::highResolutionTicksToSeconds(Time::getHighResolutionTicks() - startTicks),
+                                         numSamples / currentSampleRate,
+                                         fluid_synth_get_cpu_load(engine->getSynth()));
+    else
+        qualityChanged = governor.reset();
+
+    if (qualityChanged)
+        resyncControls();
+}
+
+void HandySynthAudioProcessor::updateIdleState(const juce::AudioBuffer<float>& buffer)
+{
+    // Where these kick in depends on the host's block size.
+    if (deterministic)
+        return;
+
+    // Checking the voices first keeps the level scan off busy blocks.
+    if (engine->getActiveVoiceCount() > 0)
+    {
+        silentSamples = 0;
+        voicelessSamples = 0;
+        return;
+    }
+
+    voicelessSamples += buffer.getNumSamples();
+
+    if (!effectsSuspended)
+    {
+        auto& tails = engine->getTailLengths();
+
+        if (voicelessSamples >= currentSampleRate * jmax(tails.reverb, tails.chorus))
+            setEffectsSuspended(true);
+    }
+
+    for (int channel = 0; channel < buffer.getNumChannels(); ++channel)
+    {
+        if (buffer.getMagnitude(channel, 0, buffer.getNumSamples()) >= silenceLevel)
+        {
+            silentSamples = 0;
+            return;
+        }
+    }
+
+    silentSamples += buffer.getNumSamples();
+    idle = silentSamples >= currentSampleRate * silenceHoldSeconds;
+}
+
+// Indexed by the high nibble of the status byte, less 8.
+const HandySynthAudioProcessor::ChannelMessageHandler HandySynthAudioProcessor::channelMessageHandlers[8] =
+{
+    { &HandySynthAudioProcessor::handleNoteOff, 2 },
+    { &HandySynthAudioProcessor::handleNoteOn, 2 },
+    { &HandySynthAudioProcessor::handleKeyPressure, 2 },
+    { &HandySynthAudioProcessor::handleControlChange, 2 },
+    { &HandySynthAudioProcessor::handleProgramChange, 1 },
+    { &HandySynthAudioProcessor::handleChannelPressure, 1 },
+    { &HandySynthAudioProcessor::handlePitchBend, 2 },
+    { nullptr, 0 } // System messages
+};
+
+void HandySynthAudioProcessor::handleMidiMessage(const juce::uint8* data, int numBytes)
+{
+    // MidiBuffer never holds running status, so a message starts with its status byte.
+    if (numBytes < 1 || data[0] < 0x80)
+        return;
+
+    if (data[0] == 0xF0)
+    {
+        handleSysEx(data, numBytes);
+        return;
+    }
+
+    const int port = getPortSelection(data, numBytes);
+
+    if (port >= 0)
+    {
+        midiPort = port;
+        return;
+    }
+
+    applyPendingReset();
+
+    auto& handler = channelMessageHandlers[(data[0] >> 4) - 8];
+    const int channel = midiPort * 16 + (data[0] & 0x0F);
+
+    // Ports past the engine's last one are not played.
+    if (handler.handle != nullptr && numBytes > handler.numDataBytes && channel < engine->getNumMidiChannels())
+        (this->*handler.handle)(channel, data + 1);
+}
+
+int HandySynthAudioProcessor::getPortSelection(const juce::uint8* data, int numBytes)
+{
+    // The F5 port select some multi-port interfaces send, and the MIDI
+    // port prefix meta event (FF 21 01 pp) of standard MIDI files.
+    if (numBytes >= 2 && data[0] == 0xF5)
+        return data[1] & 0x7F;
+
+    if (numBytes >= 4 && data[0] == 0xFF && data[1] == 0x21 && data[2] == 0x01)
+        return data[3] & 0x7F;
+
+    return -1;
+}
+
+int HandySynthAudioProcessor::getControllerKey(const juce::uint8* data, int numBytes, int& value)
+{
+    if (numBytes < 2)
+        return -1;
+
+    switch (data[0] & 0xF0)
+    {
+    case 0xB0:
+        // Parameter number and data entry controllers act in sequence, and
+        // channel mode messages are commands rather than state.
+        if (numBytes < 3 || data[1] == 6 || data[1] == 38 || (data[1] >= 96 && data[1] <= 101) || data[1] >= 120)
+            return -1;
+
+        value = data[2];
+        return data[1];
+    case 0xD0:
+        value = data[1];
+        return channelPressureKey;
+    case 0xE0:
+        if (numBytes < 3)
+            return -1;
+
+        value = data[1] | (data[2] << 7);
+        return pitchBendKey;
+    default:
+        return -1;
+    }
+}
+
+void HandySynthAudioProcessor::markRedundantEvents(const juce::MidiBuffer& midi, int numSamples, bool strict, int startPhase)
+{
+    // A controller update is redundant when the same controller on the same
+    // channel is set again at the same split position, since FluidSynth
+    // renders nothing between the two. Note, program and other events on the
+    // channel keep the updates around them, through the channel's epoch.
+    ++coalesceBlock;
+    int index = 0;
+    int port = midiPort;
+
+    for (const auto metadata : midi)
+    {
+        if (index >= maxCoalescedEvents)
             break;
-        default:
-            break;
+
+        redundantEvents[index] = false;
+
+        const auto* data = metadata.data;
+        const int channel = port * 16 + (data[0] & 0x0F);
+        const int selectedPort = getPortSelection(data, metadata.numBytes);
+
+        if (selectedPort >= 0)
+            port = selectedPort;
+
+        if (data[0] >= 0xF0)
+        {
+            for (auto& epoch : channelEpochs)
+                ++epoch;
+        }
+        else if (channel < maxMidiChannels)
+        {
+            int value;
+            const int key = getControllerKey(data, metadata.numBytes, value);
+
+            if (key < 0)
+            {
+                ++channelEpochs[channel];
+            }
+            else
+            {
+                const int split = jlimit(0, numSamples, getSplitPosition(metadata.samplePosition, numSamples, strict, startPhase));
+                auto& slot = controllerSlots[channel * numControllerKeys + key];
+
+                if (slot.block == coalesceBlock && slot.epoch == channelEpochs[channel] && slot.split == split)
+                    redundantEvents[slot.event] = true;
+
+                slot = { coalesceBlock, channelEpochs[channel], split, index };
+            }
+        }
+
+        ++index;
+    }
+}
+
+bool HandySynthAudioProcessor::dispatchMidiEvent(const juce::uint8* data, int numBytes)
+{
+    int value;
+    const int channel = midiPort * 16 + (data[0] & 0x0F);
+    const int key = data[0] < 0xF0 && channel < maxMidiChannels ? getControllerKey(data, numBytes, value) : -1;
+
+    if (key >= 0)
+    {
+        auto& cached = controllerValues[channel * numControllerKeys + key];
+
+        // FluidSynth would recompute every voice's modulators for nothing.
+        if (cached == value)
+            return false;
+
+        cached = value;
+    }
+
+    handleMidiMessage(data, numBytes);
+    return true;
+}
+
+void HandySynthAudioProcessor::forgetControllerValues(int channel)
+{
+    for (int c = 0; c < maxMidiChannels; ++c)
+        if (channel < 0 || c == channel)
+            for (int key = 0; key < numControllerKeys; ++key)
+                controllerValues[c * numControllerKeys + key] = -1;
+}
+
+double HandySynthAudioProcessor::getCoalescedEventsPerBlock() const
+{
+    const int64 blocks = numBlocks;
+    return blocks > 0 ? (double)numCoalescedEvents / (double)blocks : 0.0;
+}
+
+int64 HandySynthAudioProcessor::getNumDroppedEvents() const
+{
+    return numDroppedEvents;
+}
+
+void HandySynthAudioProcessor::handleSysEx(const juce::uint8* data, int numBytes)
+{
+    // FluidSynth takes the message without its F0 and F7.
+    auto* body = data + 1;
+    int size = numBytes - (data[numBytes - 1] == 0xF7 ? 2 : 1);
+
+    if (size <= 0)
+        return;
+
+    // Files tend to send GM, GS and XG resets back to back. Nothing can
+    // happen between them, so only the last one of a run is applied, right
+    // before the next event or render. Controllers are back on their defaults
+    // from here on, which the events in between are compared against.
+    if (isSystemReset(body, size) && size <= maxResetBytes)
+    {
+        std::memcpy(pendingReset, body, (size_t)size);
+        pendingResetSize = size;
+        resetProgress = -1;
+        forgetControllerValues(-1);
+        return;
+    }
+
+    applyPendingReset();
+
+    // Universal real-time master volume, which FluidSynth leaves alone.
+    if (size == 6 && body[0] == 0x7F && body[2] == 0x04 && body[3] == 0x01)
+    {
+        masterVolume = (float)(body[4] | (body[5] << 7)) / 16383.0f;
+        applyControlCommand({ ControlCommand::setGain, gainValue->load() });
+        return;
+    }
+
+    // Live, MIDI Tuning Standard messages are parsed by the tuning worker,
+    // and the events after them are held until it is done. Offline, and in
+    // deterministic mode, where that would depend on the worker's timing,
+    // they are applied in place. FluidSynth never sees them.
+    if (TuningWorker::isTuningMessage(body, size))
+    {
+        if ((isNonRealtime() || deterministic) && tuningWorker.applyNow(body, size, midiPort, *engine))
+            return;
+
+        if (!tuningWorker.post(body, size, midiPort))
+            ++numDroppedEvents;
+
+        return;
+    }
+
+    // Drum part assignment and the like.
+    applySysEx(body, size);
+    engine->updateSoundfontRoute(-1);
+    forgetControllerValues(-1);
+}
+
+void HandySynthAudioProcessor::applySysEx(const juce::uint8* body, int size)
+{
+    // No response buffer, the plugin has no MIDI output to answer dump
+    // requests on.
+    engine->forEachSynth([body, size](fluid_synth_t* synth) {
+        fluid_synth_sysex(synth, reinterpret_cast<const char*>(body), size, nullptr, nullptr, nullptr, 0);
+    });
+}
+
+bool HandySynthAudioProcessor::isResetInProgress() const noexcept
+{
+    return pendingResetSize > 0 && resetProgress >= 0;
+}
+
+bool HandySynthAudioProcessor::isHeldByReset(const juce::uint8* data, int numBytes)
+{
+    if (pendingResetSize == 0)
+        return false;
+
+    // Further resets and port selections don't end a run of resets.
+    const int sysExSize = data[0] == 0xF0 ? numBytes - (data[numBytes - 1] == 0xF7 ? 2 : 1) : 0;
+
+    if (getPortSelection(data, numBytes) < 0 && !(sysExSize > 0 && isSystemReset(data + 1, sysExSize)))
+        applyPendingReset();
+
+    return isResetInProgress();
+}
+
+bool HandySynthAudioProcessor::isSystemReset(const juce::uint8* body, int size)
+{
+    // GM1 on, GM off and GM2 on: 7E <device> 09 01|02|03
+    if (size == 4 && body[0] == 0x7E && body[2] == 0x09 && body[3] >= 0x01 && body[3] <= 0x03)
+        return true;
+
+    // GS reset: 41 <device> 42 12 40 00 7F 00 41
+    static const juce::uint8 gsReset[] = { 0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41 };
+
+    if (size == 9 && body[0] == 0x41 && std::memcmp(body + 2, gsReset, sizeof(gsReset)) == 0)
+        return true;
+
+    // XG system on: 43 1<device> 4C 00 00 7E 00
+    static const juce::uint8 xgReset[] = { 0x4C, 0x00, 0x00, 0x7E, 0x00 };
+
+    return size == 7 && body[0] == 0x43 && (body[1] & 0xF0) == 0x10 && std::memcmp(body + 2, xgReset, sizeof(xgReset)) == 0;
+}
+
+void HandySynthAudioProcessor::applyPendingReset()
+{
+    // The run of resets ends here.
+    if (pendingResetSize > 0 && resetProgress < 0)
+        resetProgress = 0;
+
+    continueReset();
+}
+
+void HandySynthAudioProcessor::continueReset()
+{
+    if (!isResetInProgress())
+        return;
+
+    // Offline and in deterministic mode every synth is reset at once, as
+    // the output there mustn't depend on where the blocks start, and so it
+    // is when held events are released before the reset is done.
+    const bool atOnce = deterministic || isNonRealtime() || releasingEvents;
+    const int64 block = numBlocks;
+
+    while (resetProgress < engine->getNumSynths() && (atOnce || resetStepBlock != block))
+    {
+        fluid_synth_sysex(engine->getSynth(resetProgress++), reinterpret_cast<const char*>(pendingReset), pendingResetSize,
+                          nullptr, nullptr, nullptr, 0);
+        resetStepBlock = block;
+    }
+
+    if (resetProgress < engine->getNumSynths())
+        return;
+
+    pendingResetSize = 0;
+    resetProgress = -1;
+
+    // Programs are back on their defaults, and so are FluidSynth's channel
+    // settings, the interpolation among them.
+    for (auto& pending : pendingPrograms)
+        pending.program = -1;
+
+    // Controller values were forgotten when the reset was queued, and those
+    // cached since belong to events that come after it.
+    masterVolume = 1.0f;
+    tuningWorker.resetChannels();
+    engine->updateSoundfontRoute(-1);
+    resyncControls();
+}
+
+void HandySynthAudioProcessor::handleNoteOff(int channel, const juce::uint8* data)
+{
+    engine->noteOff(channel, data[0]);
+}
+
+void HandySynthAudioProcessor::handleNoteOn(int channel, const juce::uint8* data)
+{
+    if (effectsSuspended && data[1] > 0)
+        setEffectsSuspended(false);
+
+    engine->noteOn(channel, data[0], data[1]);
+
+    if (data[1] > 0)
+        tuningWorker.tuneNote(*engine, channel, data[0]);
+}
+
+void HandySynthAudioProcessor::handleKeyPressure(int channel, const juce::uint8* data)
+{
+    fluid_synth_key_pressure(engine->getNoteSynth(channel, data[0]), channel, data[0], data[1]);
+}
+
+void HandySynthAudioProcessor::handleControlChange(int channel, const juce::uint8* data)
+{
+    // Reset all controllers puts the channel's controllers back on defaults.
+    if (data[0] == 121)
+        forgetControllerValues(channel);
+
+    // Tuning program and bank selects.
+    if (tuningWorker.handleControlChange(*engine, channel, data[0], data[1]))
+        return;
+
+    engine->forEachSynth([&](fluid_synth_t* synth) { fluid_synth_cc(synth, channel, data[0], data[1]); });
+
+    // Legato, and mono and poly mode, which may change a whole basic channel group.
+    if (data[0] == 68)
+        engine->updateSoundfontRoute(channel);
+    else if (data[0] == 126 || data[0] == 127)
+        engine->updateSoundfontRoute(-1);
+}
+
+void HandySynthAudioProcessor::handleProgramChange(int channel, const juce::uint8* data)
+{
+    changeProgram(channel, data[0]);
+}
+
+void HandySynthAudioProcessor::handleChannelPressure(int channel, const juce::uint8* data)
+{
+    engine->forEachSynth([&](fluid_synth_t* synth) { fluid_synth_channel_pressure(synth, channel, data[0]); });
+}
+
+void HandySynthAudioProcessor::handlePitchBend(int channel, const juce::uint8* data)
+{
+    const int value = data[0] | (data[1] << 7);
+    engine->forEachSynth([&](fluid_synth_t* synth) { fluid_synth_pitch_bend(synth, channel, value); });
+}
+
+void HandySynthAudioProcessor::changeProgram(int channel, int program)
+{
+    int sfId, bank, currentProgram;
+
+    if (channel < 0 || channel >= engine->getNumMidiChannels()
+        || fluid_synth_get_program(engine->getSynth(), channel, &sfId, &bank, &currentProgram) != FLUID_OK)
+        return;
+
+    programUsage.add(bank, program);
+
+    auto& pending = pendingPrograms[channel];
+
+    if (engine->isPresetResident(bank, program))
+    {
+        pending.program = -1;
+        engine->forEachSynth([&](fluid_synth_t* synth) { fluid_synth_program_change(synth, channel, program); });
+        engine->updateSoundfontRoute(channel);
+        return;
+    }
+
+    // Selecting the preset now would page its samples in on this thread.
+    // Ask for them in the background and switch once they are resident.
+    pending = { bank, program, engine->requestPreset(bank, program) };
+
+    if (silenceWhilePaging->load() >= 0.5f)
+        engine->forEachSynth([&](fluid_synth_t* synth) { fluid_synth_unset_program(synth, channel); });
+}
+
+void HandySynthAudioProcessor::applyPendingPrograms()
+{
+    for (int channel = 0; channel < engine->getNumMidiChannels(); ++channel)
+    {
+        auto& pending = pendingPrograms[channel];
+
+        if (pending.program < 0)
+            continue;
+
+        if (!pending.requested)
+        {
+            pending.requested = engine->requestPreset(pending.bank, pending.program);
+        }
+        else if (engine->isPresetResident(pending.bank, pending.program))
+        {
+            engine->forEachSynth([&](fluid_synth_t* synth) {
+                fluid_synth_bank_select(synth, channel, pending.bank);
+                fluid_synth_program_change(synth, channel, pending.program);
+            });
+            engine->updateSoundfontRoute(channel);
+            pending.program = -1;
         }
     }
+}
 
-   fluid_synth_process(
-        synth,
-        buffer.getNumSamples(),
-        0,
-        nullptr,
-        buffer.getNumChannels(),
-        const_cast<float**>(buffer.getArrayOfWritePointers()) 
-    );
+int HandySynthAudioProcessor::getQuantumBoundary(int sampleOffset) const
+{
+    // Boundaries are counted from the start of the render timeline, so an
+    // event lands on the same one however the host splits its blocks.
+    const int64 position = streamPosition + sampleOffset;
+    const int64 boundary = (position + renderQuantum - 1) / renderQuantum * renderQuantum;
+
+    return (int)(boundary - streamPosition);
+}
+
+bool HandySynthAudioProcessor::deferEvent(const juce::uint8* data, int numBytes)
+{
+    if (numDeferredEvents == maxDeferredEvents || numBytes > maxDeferredBytes - numDeferredBytes)
+        return false;
+
+    memcpy(deferredBytes + numDeferredBytes, data, (size_t)numBytes);
+    deferredEvents[numDeferredEvents++] = { numDeferredBytes, numBytes };
+    numDeferredBytes += numBytes;
+
+    return true;
+}
+
+void HandySynthAudioProcessor::releaseDeferredEvents()
+{
+    // Rather than drop events once the storage is full, the held ones are
+    // dispatched now, in order, live or in deterministic mode. A reset they
+    // wait for is finished on every synth at once, a tuning still being
+    // prepared is left behind.
+    releasingEvents = true;
+    applyPendingReset();
+
+    for (int i = 0; i < numDeferredEvents; ++i)
+        dispatchMidiEvent(deferredBytes + deferredEvents[i].start, deferredEvents[i].numBytes);
+
+    applyPendingReset();
+    releasingEvents = false;
+
+    removeDeferredEvents(numDeferredEvents);
+}
+
+void HandySynthAudioProcessor::removeDeferredEvents(int count)
+{
+    if (count >= numDeferredEvents)
+    {
+        numDeferredEvents = 0;
+        numDeferredBytes = 0;
+        return;
+    }
+
+    const int firstByte = deferredEvents[count].start;
+
+    std::memmove(deferredBytes, deferredBytes + firstByte, (size_t)(numDeferredBytes - firstByte));
+    numDeferredBytes -= firstByte;
+
+    for (int i = count; i < numDeferredEvents; ++i)
+        deferredEvents[i - count] = { deferredEvents[i].start - firstByte, deferredEvents[i].numBytes };
+
+    numDeferredEvents -= count;
+}
+
+void HandySynthAudioProcessor::resetRenderTimeline()
+{
+    streamPosition = 0;
+    quantumRead = renderQuantum;
+    resampler.reset();
+}
+
+int HandySynthAudioProcessor::getSplitPosition(int sampleOffset, int numSamples, bool strict, int startPhase) const
+{
+    if (deterministic)
+        return getQuantumBoundary(sampleOffset);
+
+    return snapToFluidTick(sampleOffset, numSamples, strict, startPhase);
+}
+
+int HandySynthAudioProcessor::snapToFluidTick(int sampleOffset, int numSamples, bool strict, int startPhase) const
+{
+    // The phase counts engine samples, which don't line up with host ones.
+    if (resampling)
+        return sampleOffset;
+
+    // FluidSynth only applies events when it starts an internal block, so
+    // split points snap to the nearest block boundary, counted from the
+    // phase at the start of the host block. Strict timing takes the first
+    // boundary at or after the event, where FluidSynth would apply it anyway,
+    // so that nothing sounds early.
+    const int firstTick = (fluidBlockSize - startPhase) % fluidBlockSize;
+    const int rounding = strict ? fluidBlockSize - 1 : fluidBlockSize / 2;
+    const int ticks = (sampleOffset - firstTick + fluidBlockSize * 2 + rounding) / fluidBlockSize - 2;
+
+    return jlimit(0, numSamples, firstTick + ticks * fluidBlockSize);
+}
+
+void HandySynthAudioProcessor::renderSynth(juce::AudioBuffer<float>& buffer, int startSample, int numSamples)
+{
+    applyPendingReset();
+
+    if (numSamples <= 0)
+        return;
+
+    if (!resampling)
+    {
+        renderAtEngineRate(buffer, startSample, numSamples);
+        return;
+    }
+
+    // Hosts may send more than they announced in prepareToPlay.
+    for (int done = 0; done < numSamples; done += maxBlockSize)
+    {
+        const int chunkSize = jmin(numSamples - done, maxBlockSize);
+        const int numInput = resampler.getInputNeeded(chunkSize);
+
+        renderBuffer.clear(0, numInput);
+        renderAtEngineRate(renderBuffer, 0, numInput);
+
+        resampler.process(renderBuffer.getArrayOfReadPointers(), buffer.getArrayOfWritePointers(), startSample + done, chunkSize);
+    }
+}
+
+void HandySynthAudioProcessor::renderAtEngineRate(juce::AudioBuffer<float>& buffer, int startSample, int numSamples)
+{
+    if (!deterministic)
+    {
+        renderEngine(buffer, startSample, numSamples);
+        return;
+    }
+
+    // The engine only ever renders whole quanta, whatever the host asks for.
+    while (numSamples > 0)
+    {
+        if (quantumRead == renderQuantum)
+        {
+            quantumBuffer.clear();
+            renderEngine(quantumBuffer, 0, renderQuantum);
+            quantumRead = 0;
+        }
+
+        const int count = jmin(numSamples, renderQuantum - quantumRead);
+
+        for (int channel = 0; channel < jmin(buffer.getNumChannels(), quantumBuffer.getNumChannels()); ++channel)
+            buffer.addFrom(channel, startSample, quantumBuffer, channel, quantumRead, count);
+
+        quantumRead += count;
+        startSample += count;
+        numSamples -= count;
+    }
+}
+
+void HandySynthAudioProcessor::renderEngine(juce::AudioBuffer<float>& buffer, int startSample, int numSamples)
+{
+    if (numSamples <= 0)
+        return;
+
+    // Enabled buses follow each other in the buffer, so this writes every
+    // audio group straight into its bus. MIDI channel n plays into the bus
+    // of the same number, modulo the number of enabled buses.
+    const int numChannels = jmin(buffer.getNumChannels(), engine->getOptions().audioGroups * 2);
+    float* out[SynthEngine::maxOutputChannels];
+
+    for (int channel = 0; channel < numChannels; ++channel)
+        out[channel] = buffer.getWritePointer(channel, startSample);
+
+    engine->process(numSamples, numChannels, out);
+
+    renderPhase = (renderPhase + numSamples) % fluidBlockSize;
 }
 
 //==============================================================================
@@ -266,6 +1096,22 @@ void HandySynthAudioProcessor::getStateInformation (juce::MemoryBlock& destData)
     // as intermediaries to make it easy to save and load complex data.
 
     auto state = parameters.copyState();
+
+    auto soundfont = state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+    soundfont.removeChild(soundfont.getChildWithName("USED_PROGRAMS"), nullptr);
+
+    ValueTree usedPrograms("USED_PROGRAMS");
+
+    for (auto& selection : programUsage.getAll())
+    {
+        ValueTree program("PROGRAM");
+        program.setProperty("bank", selection.bank, nullptr);
+        program.setProperty("program", selection.program, nullptr);
+        usedPrograms.appendChild(program, nullptr);
+    }
+
+    soundfont.appendChild(usedPrograms, nullptr);
+
     std::unique_ptr<juce::XmlElement> xml(state.createXml());
     copyXmlToBinary(*xml, destData);
 }
@@ -281,30 +1127,206 @@ void HandySynthAudioProcessor::setStateInformation (const void* data, int sizeIn
         if (xmlState->hasTagName(parameters.state.getType()))
             parameters.replaceState(juce::ValueTree::fromXml(*xmlState));
 
+    Array<ProgramSelection> usedPrograms;
+
+    for (auto program : parameters.state.getChildWithName("SOUNDFONT").getChildWithName("USED_PROGRAMS"))
+        usedPrograms.add({ (int)program.getProperty("bank"), (int)program.getProperty("program") });
+
+    programUsage.set(usedPrograms);
+
+    readProfiles();
+    updateRenderPipeline();
     setSoundfont(parameters.state.getChildWithName("SOUNDFONT"));
 
-    auto gain = (AudioParameterFloat*)parameters.getParameter("gain");
-    auto polyphony = (AudioParameterInt*)(parameters.getParameter("polyphony"));
     auto chorus = (AudioParameterBool*)parameters.getParameter("chorus");
     auto reverb = (AudioParameterBool*)parameters.getParameter("reverb");
 
-    fluid_synth_set_gain(synth, gain->get());
-    fluid_synth_set_polyphony(synth, polyphony->get());
-    fluid_settings_setint(settings, "synth.chorus.active", chorus->get());
-    fluid_settings_setint(settings, "synth.reverb.active", reverb->get());
+    chorusOn = chorus->get();
+    reverbOn = reverb->get();
+
+    controlQueue.requestResync();
 }
 
-fluid_synth_t* HandySynthAudioProcessor::getFluidSynth()
+Array<PresetInfo> HandySynthAudioProcessor::getPresets() const
 {
-    return synth;
+    return loader.getPresets();
 }
 
-fluid_sfont_t* HandySynthAudioProcessor::getFluidSoundfont()
+int HandySynthAudioProcessor::getPresetsVersion() const
 {
-    if (sfId == -1)
-        return nullptr;
-    else
-        return fluid_synth_get_sfont_by_id(synth, sfId);
+    return loader.getPresetsVersion();
+}
+
+bool HandySynthAudioProcessor::isLoadingSoundfont() const
+{
+    return loader.isLoading();
+}
+
+double HandySynthAudioProcessor::getSoundfontLoadProgress() const
+{
+    return loader.getProgress();
+}
+
+String HandySynthAudioProcessor::getSoundfontLoadError() const
+{
+    return loader.getLastError();
+}
+
+void HandySynthAudioProcessor::cancelSoundfontLoad()
+{
+    loader.cancel();
+
+    // Keep the state pointing at the soundfont that is still playing.
+    auto v = parameters.state.getOrCreateChildWithName("SOUNDFONT", nullptr);
+    v.setProperty("path", loader.getLoadedPath(), nullptr);
+}
+
+bool HandySynthAudioProcessor::getOnDemandSampleBytes(int64& totalBytes) const
+{
+    auto index = loader.getSampleIndex();
+
+    if (index == nullptr)
+        return false;
+
+    totalBytes = index->getSampleDataBytes();
+
+    return true;
+}
+
+void HandySynthAudioProcessor::applyInterpolation()
+{
+    const auto level = governor.getLevel();
+    const int profileInterpolation = getActiveProfile().interpolation;
+
+    engine->forEachSynth([level, profileInterpolation](fluid_synth_t* synth) {
+        for (int channel = 0; channel < fluid_synth_count_midi_channels(synth); ++channel)
+        {
+            int sfId, bank, program;
+            const bool percussion = fluid_synth_get_program(synth, channel, &sfId, &bank, &program) == FLUID_OK
+                                    && bank == 128;
+
+            // Interpolation methods are numbered by their order.
+            fluid_synth_set_interp_method(synth, channel,
+                                          jmin(profileInterpolation, (int)QualityGovernor::getInterpolation(level, percussion)));
+        }
+    });
+}
+
+const QualityProfile& HandySynthAudioProcessor::getActiveProfile() const
+{
+    return offlineActive ? offlineProfile : realtimeProfile;
+}
+
+void HandySynthAudioProcessor::readProfiles()
+{
+    // Created here so that the editor only has to set their properties.
+    auto profiles = parameters.state.getOrCreateChildWithName("PROFILES", nullptr);
+    auto realtime = profiles.getOrCreateChildWithName("REALTIME", nullptr);
+
+    realtimeProfile.readFrom(realtime);
+    offlineProfile.readFrom(profiles.getOrCreateChildWithName("OFFLINE", nullptr));
+
+    // Render threads used to be a soundfont setting.
+    if (!realtime.hasProperty("renderThreads"))
+        realtimeProfile.renderThreads = (int)parameters.state.getChildWithName("SOUNDFONT").getProperty("renderThreads", 1);
+}
+
+void HandySynthAudioProcessor::reloadForProfile()
+{
+    // Render threads are fixed when an engine is built.
+    const auto options = loader.isLoading() ? loader.getRequestedOptions() : loader.getLoadedOptions();
+
+    if (options.renderThreads != getRenderThreads())
+        setSoundfont(parameters.state.getChildWithName("SOUNDFONT"));
+}
+
+void HandySynthAudioProcessor::handleAsyncUpdate()
+{
+    reloadForProfile();
+}
+
+int HandySynthAudioProcessor::getRenderThreads() const
+{
+    // FluidSynth hands voices to its mixer threads as they become free, which
+    // changes the order they are summed in from one run to the next.
+    if (deterministic)
+        return 1;
+
+    return jlimit(1, SynthEngine::maxRenderThreads, getActiveProfile().renderThreads.load());
+}
+
+void HandySynthAudioProcessor::setNonRealtime(bool isNonRealtime) noexcept
+{
+    AudioProcessor::setNonRealtime(isNonRealtime);
+
+    if (isNonRealtime == offlineActive)
+        return;
+
+    offlineActive = isNonRealtime;
+    controlQueue.requestResync();
+
+    // Hosts may call this from any thread, even while processing. The
+    // profile's engine is built from the message thread, and blocks render
+    // on the current one until the loader swaps it in; only the number of
+    // render threads differs between the two.
+    triggerAsyncUpdate();
+}
+
+void HandySynthAudioProcessor::updateRenderPipeline()
+{
+    auto sfValueTree = parameters.state.getChildWithName("SOUNDFONT");
+    const double requested = sfValueTree.getProperty("renderSampleRate", 0.0);
+    const double rate = requested > 0.0 ? requested : currentSampleRate;
+    const int numChannels = getTotalNumOutputChannels();
+
+    {
+        const ScopedLock sl(getCallbackLock());
+
+        // The engine follows on the audio thread, see processBlock().
+        renderSampleRate = rate;
+        resampling = rate != currentSampleRate;
+
+        if (resampling)
+        {
+            resampler.prepare(rate, currentSampleRate, numChannels, maxBlockSize);
+            renderBuffer.setSize(numChannels, resampler.getMaxInputNeeded());
+        }
+
+        deterministic = sfValueTree.getProperty("deterministicRendering", false);
+        quantumBuffer.setSize(numChannels, renderQuantum);
+        resetRenderTimeline();
+
+        // Neither is left to the block size any more, see updateIdleState().
+        if (deterministic)
+        {
+            idle = false;
+            silentSamples = 0;
+
+            if (effectsSuspended)
+                setEffectsSuspended(false);
+        }
+    }
+
+    setLatencySamples(resampling ? resampler.getLatencySamples() : 0);
+}
+
+void HandySynthAudioProcessor::setEffectsSuspended(bool shouldBeSuspended)
+{
+    effectsSuspended = shouldBeSuspended;
+
+    applyControlCommand({ ControlCommand::setChorusOn, chorusValue->load() });
+    applyControlCommand({ ControlCommand::setReverbOn, reverbValue->load() });
+}
+
+QualityGovernor::Level HandySynthAudioProcessor::getQualityLevel() const
+{
+    return governor.getLevel();
+}
+
+double HandySynthAudioProcessor::getSkippedBlockFraction() const
+{
+    const int64 blocks = numBlocks;
+    return blocks > 0 ? (double)numSkippedBlocks / (double)blocks : 0.0;
 }
 
 bool HandySynthAudioProcessor::getChorusOn()
@@ -325,6 +1347,10 @@ AudioProcessorValueTreeState::ParameterLayout HandySynthAudioProcessor::createPa
     params.add(std::make_unique<AudioParameterInt>("polyphony", "Polyphony", 32, 1024, 128));
     params.add(std::make_unique<AudioParameterBool>("chorus", "Chorus", false));
     params.add(std::make_unique<AudioParameterBool>("reverb", "Reverb", false));
+    params.add(std::make_unique<AudioParameterBool>("strictTiming", "Strict timing", false));
+    params.add(std::make_unique<AudioParameterChoice>("programChangePolicy", "While a program loads",
+        StringArray{ "Keep previous program", "Silence channel" }, 0));
+    params.add(std::make_unique<AudioParameterBool>("adaptiveQuality", "Adaptive quality", false));
 
     return params;
 }
@@ -333,34 +1359,116 @@ void HandySynthAudioProcessor::parameterChanged(const String& parameterID, float
 {
     if (parameterID == "gain") 
     {
-        fluid_synth_set_gain(synth, newValue);
+        controlQueue.push({ ControlCommand::setGain, newValue });
     }
     else if (parameterID == "polyphony")
     {
-        fluid_synth_set_polyphony(synth, static_cast<int>(newValue));
+        controlQueue.push({ ControlCommand::setPolyphony, newValue });
     }
     else if (parameterID == "chorus")
     {
         auto value = (bool)newValue;
         chorusOn = value;
-        fluid_settings_setint(settings, "synth.chorus.active", value);
-        
+        controlQueue.push({ ControlCommand::setChorusOn, newValue });
     }
     else if (parameterID == "reverb")
     {
         auto value = (bool)newValue;
         reverbOn = value;
-        fluid_settings_setint(settings, "synth.reverb.active", value);
+        controlQueue.push({ ControlCommand::setReverbOn, newValue });
     }
     else 
     {}
 }
 
+void HandySynthAudioProcessor::applyControlCommand(const ControlCommand& command)
+{
+    // fluid_synth_reverb_on() and fluid_synth_chorus_on() stop the effect's
+    // processing altogether, not just its output.
+    auto& profile = getActiveProfile();
+    const bool internalEffects = !effectsSuspended
+                                 && profile.effectQuality != QualityProfile::effectsOff;
+    const int maxPolyphony = profile.maxPolyphony;
+    const int numSynths = engine->getNumSynths();
+    const auto level = governor.getLevel();
+    const float volume = masterVolume;
+
+    engine->forEachSynth([&command, internalEffects, maxPolyphony, numSynths, level, volume](fluid_synth_t* synth) {
+        switch (command.type)
+        {
+        case ControlCommand::setGain:
+            fluid_synth_set_gain(synth, command.value * volume);
+            break;
+        case ControlCommand::setPolyphony:
+        {
+            const int voices = static_cast<int>(jmin(command.value, (float)maxPolyphony) * QualityGovernor::getPolyphonyScale(level));
+            fluid_synth_set_polyphony(synth, SynthEngine::getPartitionPolyphony(voices, numSynths));
+            break;
+        }
+        case ControlCommand::setChorusOn:
+            fluid_synth_chorus_on(synth, -1, command.value >= 0.5f && internalEffects && QualityGovernor::allowsChorus(level));
+            break;
+        case ControlCommand::setReverbOn:
+            fluid_synth_reverb_on(synth, -1, command.value >= 0.5f && internalEffects && QualityGovernor::allowsReverb(level));
+            break;
+        default:
+            break;
+        }
+    });
+}
+
+void HandySynthAudioProcessor::resyncControls()
+{
+    applyInterpolation();
+
+    const int chorusVoices = getActiveProfile().effectQuality == QualityProfile::highEffects ? 6 : 3;
+    engine->forEachSynth([chorusVoices](fluid_synth_t* synth) { fluid_synth_set_chorus_group_nr(synth, -1, chorusVoices); });
+
+    applyControlCommand({ ControlCommand::setGain, gainValue->load() });
+    applyControlCommand({ ControlCommand::setPolyphony, polyphonyValue->load() });
+    applyControlCommand({ ControlCommand::setChorusOn, chorusValue->load() });
+    applyControlCommand({ ControlCommand::setReverbOn, reverbValue->load() });
+}
+
 void HandySynthAudioProcessor::valueTreePropertyChanged(ValueTree& treeWhosePropertyHasChanged, const Identifier& property)
 {
+    if (treeWhosePropertyHasChanged.getParent().getType() == StringRef("PROFILES"))
+    {
+        readProfiles();
+        reloadForProfile();
+        controlQueue.requestResync();
+        return;
+    }
+
     if (treeWhosePropertyHasChanged.getType() == StringRef("SOUNDFONT"))
+    {
         if (property == StringRef("path"))
+        {
+            // Programs used with another soundfont mean nothing to this one.
+            if (treeWhosePropertyHasChanged.getProperty("path").toString() != loader.getLoadedPath())
+                programUsage.clear();
+
             setSoundfont(treeWhosePropertyHasChanged);
+        }
+        else if (property == StringRef("renderSampleRate"))
+        {
+            updateRenderPipeline();
+        }
+        else if (property == StringRef("deterministicRendering"))
+        {
+            // Also takes a single render thread, see getRenderThreads().
+            updateRenderPipeline();
+            setSoundfont(treeWhosePropertyHasChanged);
+        }
+        else if (property == StringRef("dynamicSampleLoading")
+              || property == StringRef("pinRenderThreads")
+              || property == StringRef("partitions")
+              || property == StringRef("partitionMode")
+              || property == StringRef("midiPorts"))
+        {
+            setSoundfont(treeWhosePropertyHasChanged);
+        }
+    }
 }
 
 void HandySynthAudioProcessor::setSoundfont(const ValueTree& sfValueTree)
@@ -370,11 +1478,26 @@ void HandySynthAudioProcessor::setSoundfont(const ValueTree& sfValueTree)
 
     String path = sfValueTree.getProperty("path").toString();
 
+    EngineOptions options;
+    options.dynamicSampleLoading = sfValueTree.getProperty("dynamicSampleLoading", false);
+    options.renderThreads = getRenderThreads();
+    options.pinRenderThreads = sfValueTree.getProperty("pinRenderThreads", false);
+    options.partitions = jlimit(1, SynthEngine::maxPartitions, (int)sfValueTree.getProperty("partitions", 1));
+    options.partitionMode = sfValueTree.getProperty("partitionMode").toString() == "note"
+        ? EngineOptions::partitionByNote : EngineOptions::partitionByChannel;
+    options.audioGroups = numOutputBuses;
+    options.midiPorts = jlimit(1, SynthEngine::maxMidiPorts, (int)sfValueTree.getProperty("midiPorts", 1));
+
     if (path.isEmpty())
         return;
 
-    fluid_synth_sfunload(synth, sfId, 1);
-    sfId = fluid_synth_sfload(synth, path.toRawUTF8(), 1);
+    if (path == loader.getLoadedPath() && options == loader.getLoadedOptions())
+    {
+        loader.cancel();
+        return;
+    }
+
+    loader.load(path, renderSampleRate, options, programUsage.getAll());
 }
 
 //==============================================================================
@@ -12,6 +12,15 @@
 
 #include <fluidsynth.h>
 
+#include "ControlQueue.h"
+#include "SynthEngine.h"
+#include "SoundfontLoader.h"
+#include "ProgramUsage.h"
+#include "QualityGovernor.h"
+#include "QualityProfile.h"
+#include "Resampler.h"
+#include "TuningWorker.h"
+
 using namespace juce;
 
 //==============================================================================
@@ -20,7 +29,8 @@ using namespace juce;
 class HandySynthAudioProcessor  : 
     public juce::AudioProcessor, 
     private AudioProcessorValueTreeState::Listener, 
-    private ValueTree::Listener
+    private ValueTree::Listener,
+    private AsyncUpdater
 {
 public:
     //==============================================================================
@@ -36,6 +46,7 @@ public:
    #endif
 
     void processBlock (juce::AudioBuffer<float>&, juce::MidiBuffer&) override;
+    void setNonRealtime (bool isNonRealtime) noexcept override;
 
     //==============================================================================
     juce::AudioProcessorEditor* createEditor() override;
@@ -60,8 +71,36 @@ public:
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
-    fluid_synth_t* getFluidSynth();
-    fluid_sfont_t* getFluidSoundfont();
+    Array<PresetInfo> getPresets() const;
+    int getPresetsVersion() const;
+
+    bool isLoadingSoundfont() const;
+    double getSoundfontLoadProgress() const;
+    void cancelSoundfontLoad();
+
+    // Why the last soundfont load failed, empty if it didn't.
+    String getSoundfontLoadError() const;
+
+    // Sample data of the whole soundfont, with dynamic sample loading, for
+    // comparison with what SoundfontCache::Stats measures as locked. Returns
+    // false when not in that mode.
+    bool getOnDemandSampleBytes(int64& totalBytes) const;
+
+    // Fraction of all blocks processed so far in which the synth was idle and
+    // rendering was skipped.
+    double getSkippedBlockFraction() const;
+
+    // Controller, pitch bend and pressure events dropped as redundant, on
+    // average per block processed.
+    double getCoalescedEventsPerBlock() const;
+
+    // Tuning messages dropped because the TuningWorker's queue was full.
+    int64 getNumDroppedEvents() const;
+
+    QualityGovernor::Level getQualityLevel() const;
+
+    // The profile in use, picked by whether the host is rendering offline.
+    const QualityProfile& getActiveProfile() const;
 
     bool getChorusOn();
     bool getReverbOn();
@@ -73,13 +112,203 @@ private:
     void valueTreePropertyChanged(ValueTree& treeWhosePropertyHasChanged, const Identifier& property) override;
     void setSoundfont(const ValueTree& sfValueTree);
 
+    void applyControlCommand(const ControlCommand& command);
+    void resyncControls();
+
+    // Decodes raw MIDI bytes and hands channel messages to the handlers
+    // below through channelMessageHandlers.
+    void handleMidiMessage(const juce::uint8* data, int numBytes);
+    void markRedundantEvents(const juce::MidiBuffer& midi, int numSamples, bool strict, int startPhase);
+    bool dispatchMidiEvent(const juce::uint8* data, int numBytes);
+    static int getControllerKey(const juce::uint8* data, int numBytes, int& value);
+    void forgetControllerValues(int channel);
+    void handleSysEx(const juce::uint8* data, int numBytes);
+    static bool isSystemReset(const juce::uint8* body, int size);
+    static int getPortSelection(const juce::uint8* data, int numBytes);
+    void applyPendingReset();
+    void continueReset();
+    bool isResetInProgress() const noexcept;
+    bool isHeldByReset(const juce::uint8* data, int numBytes);
+    void applySysEx(const juce::uint8* body, int size);
+    void handleNoteOff(int channel, const juce::uint8* data);
+    void handleNoteOn(int channel, const juce::uint8* data);
+    void handleKeyPressure(int channel, const juce::uint8* data);
+    void handleControlChange(int channel, const juce::uint8* data);
+    void handleProgramChange(int channel, const juce::uint8* data);
+    void handleChannelPressure(int channel, const juce::uint8* data);
+    void handlePitchBend(int channel, const juce::uint8* data);
+
+    struct ChannelMessageHandler
+    {
+        void (HandySynthAudioProcessor::*handle)(int channel, const juce::uint8* data);
+        int numDataBytes;
+    };
+
+    static const ChannelMessageHandler channelMessageHandlers[8];
+    void changeProgram(int channel, int program);
+    void applyPendingPrograms();
+    int snapToFluidTick(int sampleOffset, int numSamples, bool strict, int startPhase) const;
+    int getSplitPosition(int sampleOffset, int numSamples, bool strict, int startPhase) const;
+    void renderSynth(juce::AudioBuffer<float>& buffer, int startSample, int numSamples);
+    void renderAtEngineRate(juce::AudioBuffer<float>& buffer, int startSample, int numSamples);
+    void renderEngine(juce::AudioBuffer<float>& buffer, int startSample, int numSamples);
+    int getQuantumBoundary(int sampleOffset) const;
+    void resetRenderTimeline();
+    bool deferEvent(const juce::uint8* data, int numBytes);
+    void releaseDeferredEvents();
+    void removeDeferredEvents(int count);
+    void updateIdleState(const juce::AudioBuffer<float>& buffer);
+    void setEffectsSuspended(bool shouldBeSuspended);
+    void applyInterpolation();
+    void readProfiles();
+    void reloadForProfile();
+    void handleAsyncUpdate() override;
+    void updateRenderPipeline();
+    int getRenderThreads() const;
+
+    // FluidSynth renders in fixed blocks of this many samples (FLUID_BUFSIZE).
+    static constexpr int fluidBlockSize = 64;
+    static constexpr int maxMidiChannels = SynthEngine::maxMidiChannels;
+
     AudioProcessorValueTreeState parameters;
 
-    fluid_settings_t* settings;
-    fluid_synth_t* synth;
-    int sfId;
+    // Owned by the audio thread once processing has started, see SoundfontLoader.
+    std::unique_ptr<SynthEngine> engine;
+    SoundfontLoader loader;
+    double currentSampleRate;
+    int maxBlockSize;
+
+    // The synth may run at a fixed rate of its own, renderBuffer then holds
+    // its output until the resampler brings it to the host rate.
+    double renderSampleRate;
+    bool resampling;
+    Resampler resampler;
+    juce::AudioBuffer<float> renderBuffer;
+
+    // In deterministic mode the engine renders fixed quanta into
+    // quantumBuffer and events start on quantum boundaries of a timeline
+    // counted from when rendering was last reset. Events whose boundary lies
+    // past the end of the block wait in deferredEvents. The output then only
+    // depends on the MIDI input, not on how the host splits it into blocks.
+    bool deterministic;
+    int64 streamPosition;
+    juce::AudioBuffer<float> quantumBuffer;
+    int quantumRead;
+
+    // Held over events are copied into fixed storage, as the audio thread
+    // must not allocate. Once it is full the held events are released early
+    // rather than dropped. releasingEvents is set while they go out.
+    struct DeferredEvent
+    {
+        int start;
+        int numBytes;
+    };
+
+    static constexpr int renderQuantum = fluidBlockSize;
+    static constexpr int maxDeferredEvents = 256;
+    static constexpr int maxDeferredBytes = 4096;
+
+    DeferredEvent deferredEvents[maxDeferredEvents];
+    juce::uint8 deferredBytes[maxDeferredBytes];
+    int numDeferredEvents, numDeferredBytes;
+    std::atomic<int64> numDroppedEvents;
+    bool releasingEvents;
+
+    // Port of the channel messages that follow, set by port select messages.
+    // Channel n of port p is the engine's channel 16p + n. Audio thread only.
+    int midiPort;
+
+    // Set by master volume SysEx, scales the gain parameter. Audio thread only.
+    float masterVolume;
+
+    // The last of a run of GM, GS or XG resets, applied once the run ends.
+    // Live, with several synths, it is applied to one of them per block so
+    // that a reset burst doesn't land in a single block, and events are held
+    // in deferredEvents until the last one has had it. resetProgress counts
+    // the synths reset so far, -1 while the run goes on.
+    static constexpr int maxResetBytes = 16;
+    juce::uint8 pendingReset[maxResetBytes];
+    int pendingResetSize;
+    int resetProgress;
+    int64 resetStepBlock;
+
+    // Controller coalescing, audio thread only. Keys are the 128 controllers,
+    // then channel pressure and pitch bend. controllerValues caches what each
+    // channel was last sent, -1 where unknown.
+    static constexpr int channelPressureKey = 128;
+    static constexpr int pitchBendKey = 129;
+    static constexpr int numControllerKeys = 130;
+    static constexpr int maxCoalescedEvents = 2048;
+
+    struct ControllerSlot
+    {
+        int block, epoch, split, event;
+    };
+
+    ControllerSlot controllerSlots[maxMidiChannels * numControllerKeys];
+    int controllerValues[maxMidiChannels * numControllerKeys];
+    int channelEpochs[maxMidiChannels];
+    bool redundantEvents[maxCoalescedEvents];
+    int coalesceBlock;
+    std::atomic<int64> numCoalescedEvents;
+
+    // Enabled output buses, each one gets an audio group of its own.
+    int numOutputBuses;
+    int engineGeneration;
+
+    // Cached so that the audio thread doesn't look parameters up by name.
+    std::atomic<float>* gainValue;
+    std::atomic<float>* polyphonyValue;
+    std::atomic<float>* chorusValue;
+    std::atomic<float>* reverbValue;
+    std::atomic<float>* strictTiming;
+    int renderPhase;
+
+    // Set by parameter callbacks, read by the editor and the host.
+    std::atomic<bool> chorusOn, reverbOn;
+
+    // Once no voice has played and the output has stayed below silenceLevel
+    // for silenceHoldSeconds, the effect tails have died out and blocks are
+    // left unrendered until the next MIDI event or control change.
+    bool idle;
+    int silentSamples;
+    std::atomic<int64> numBlocks, numSkippedBlocks;
+
+    // Reverb and chorus are switched off once no voice has played for longer
+    // than their tails, and back on with the next note.
+    bool effectsSuspended;
+    int voicelessSamples;
+
+    // Lowers interpolation, polyphony and effects when rendering runs out of time.
+    QualityGovernor governor;
+    std::atomic<float>* adaptiveQuality;
+
+    // Switched to as the host's non-realtime flag changes. Render threads
+    // need a new engine, which is loaded from the message thread afterwards;
+    // blocks keep rendering on the current one until it is swapped in.
+    QualityProfile realtimeProfile, offlineProfile;
+    std::atomic<bool> offlineActive;
+
+    static constexpr float silenceLevel = 1.0e-5f;
+    static constexpr double silenceHoldSeconds = 0.2;
+
+    ControlQueue controlQueue;
+    TuningWorker tuningWorker;
+
+    // Every program selected since the soundfont was loaded. Saved with the
+    // state and paged in on restore, before the engine starts playing.
+    ProgramUsage programUsage;
+
+    // Program changes waiting for their samples to be paged in, audio thread only.
+    struct PendingProgram
+    {
+        int bank;
+        int program;
+        bool requested;
+    };
 
-    bool chorusOn, reverbOn;
+    PendingProgram pendingPrograms[maxMidiChannels];
+    std::atomic<float>* silenceWhilePaging;
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR (HandySynthAudioProcessor)
 };
@@ -0,0 +1,86 @@
+#include "PresetPager.h"
+#include "SoundfontCache.h"
+
+PresetPager::PresetPager(const Array<fluid_sfont_t*>& sfonts)
+    : Thread("Preset pager")
+    , sfonts(sfonts)
+    , fifo(queueSize)
+    , residentBits(numResidentWords, true)
+{
+    startThread();
+}
+
+PresetPager::~PresetPager()
+{
+    signalThreadShouldExit();
+    notify();
+    stopThread(5000);
+
+    SoundfontCache::unlockPresets(sfonts.getFirst(), locked);
+}
+
+void PresetPager::pageIn(const Array<ProgramSelection>& programs)
+{
+    const ScopedLock sl(pageInLock);
+
+    // Each preset is locked once, and unlocked once when the pager goes.
+    Array<ProgramSelection> newPrograms;
+
+    for (auto& selection : programs)
+        if (!isResident(selection.bank, selection.program))
+            newPrograms.add(selection);
+
+    if (newPrograms.isEmpty())
+        return;
+
+    SoundfontCache::lockPresets(sfonts.getFirst(), newPrograms);
+    locked.addArray(newPrograms);
+
+    // No synth plays these presets yet. Samples they share with resident
+    // ones were scanned when those were paged in, and are left alone.
+    for (auto* sfont : sfonts)
+        SoundfontCache::optimizePresetSamples(sfont, newPrograms);
+
+    for (auto& selection : newPrograms)
+    {
+        const int bit = getResidentBit(selection.bank, selection.program);
+        residentBits[bit / 32].fetch_or(1u << (bit % 32));
+    }
+}
+
+bool PresetPager::request(int bank, int program) noexcept
+{
+    if (fifo.getFreeSpace() == 0)
+        return false;
+
+    fifo.write(1).forEach([&](int index) { requests[index] = { bank, program }; });
+
+    return true;
+}
+
+bool PresetPager::isResident(int bank, int program) const noexcept
+{
+    const int bit = getResidentBit(bank, program);
+    return (residentBits[bit / 32].load() & (1u << (bit % 32))) != 0;
+}
+
+int PresetPager::getResidentBit(int bank, int program) noexcept
+{
+    return jlimit(0, numBanks - 1, bank) * 128 + (program & 127);
+}
+
+void PresetPager::run()
+{
+    while (!threadShouldExit())
+    {
+        wait(pollIntervalMs);
+
+        while (fifo.getNumReady() > 0 && !threadShouldExit())
+        {
+            ProgramSelection selection;
+            fifo.read(1).forEach([&](int index) { selection = requests[index]; });
+
+            pageIn({ selection });
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "ProgramUsage.h"
+
+using namespace juce;
+
+// Pages in and locks the samples of presets on a background thread, for
+// dynamic sample loading. The audio thread asks with request() and only
+// switches a channel to a preset once isResident() is true. The thread polls
+// for requests, so asking never takes a lock. Every bank and program has a
+// resident flag, so no preset plays before its samples are locked, or paged
+// in where locking went past the process's limit, and their loops scanned.
+class PresetPager : private Thread
+{
+public:
+    // Takes each synth's copy of the soundfont, the first one locks.
+    explicit PresetPager(const Array<fluid_sfont_t*>& sfonts);
+    ~PresetPager() override;
+
+    // Pages the presets in and locks them on the calling thread, before the
+    // engine is handed to the audio thread.
+    void pageIn(const Array<ProgramSelection>& programs);
+
+    // Called on the audio thread. Returns false if the request queue is full.
+    bool request(int bank, int program) noexcept;
+    bool isResident(int bank, int program) const noexcept;
+
+private:
+    void run() override;
+    static int getResidentBit(int bank, int program) noexcept;
+
+    static constexpr int queueSize = 256;
+    static constexpr int pollIntervalMs = 5;
+
+    Array<fluid_sfont_t*> sfonts;
+
+    AbstractFifo fifo;
+    ProgramSelection requests[queueSize];
+
+    // One bit per bank and program, 14 bit banks as bank select sets them.
+    static constexpr int numBanks = 16384;
+    static constexpr int numResidentWords = numBanks * 128 / 32;
+
+    // Set under pageInLock, read by the audio thread without it.
+    CriticalSection pageInLock;
+    HeapBlock<std::atomic<uint32>> residentBits;
+    Array<ProgramSelection> locked;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(PresetPager)
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+using namespace juce;
+
+struct ProgramSelection
+{
+    int bank;
+    int program;
+};
+
+// The set of programs that have been selected on any channel, filled in by
+// the audio thread. Insertion is lock-free and never allocates, once the
+// table is full further programs are simply not recorded.
+class ProgramUsage
+{
+public:
+    static constexpr int capacity = 1024;
+
+    ProgramUsage()
+    {
+        clear();
+    }
+
+    // Returns false if the program isn't recorded because the table is full.
+    bool add(int bank, int program) noexcept
+    {
+        const int key = makeKey(bank, program);
+
+        for (int i = 0, slot = hash(key); i < capacity; ++i, slot = (slot + 1) & (capacity - 1))
+        {
+            int expected = 0;
+
+            if (slots[slot].compare_exchange_strong(expected, key) || expected == key)
+                return true;
+        }
+
+        return false;
+    }
+
+    bool contains(int bank, int program) const noexcept
+    {
+        const int key = makeKey(bank, program);
+
+        for (int i = 0, slot = hash(key); i < capacity; ++i, slot = (slot + 1) & (capacity - 1))
+        {
+            const int found = slots[slot].load();
+
+            if (found == key)
+                return true;
+
+            if (found == 0)
+                return false;
+        }
+
+        return false;
+    }
+
+    void set(const Array<ProgramSelection>& programs)
+    {
+        clear();
+
+        for (auto& selection : programs)
+            add(selection.bank, selection.program);
+    }
+
+    Array<ProgramSelection> getAll() const
+    {
+        Array<ProgramSelection> programs;
+
+        for (auto& slot : slots)
+        {
+            const int key = slot.load();
+
+            if (key != 0)
+                programs.add({ (key - 1) >> 7, (key - 1) & 127 });
+        }
+
+        return programs;
+    }
+
+    void clear()
+    {
+        for (auto& slot : slots)
+            slot = 0;
+    }
+
+private:
+    static int makeKey(int bank, int program) noexcept
+    {
+        return ((bank << 7) | (program & 127)) + 1;
+    }
+
+    static int hash(int key) noexcept
+    {
+        return (int)(((uint32)key * 2654435761u) >> 22) & (capacity - 1);
+    }
+
+    // Zero marks an empty slot.
+    std::atomic<int> slots[capacity];
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(ProgramUsage)
+};
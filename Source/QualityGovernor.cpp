@@ -0,0 +1,151 @@
+#include "QualityGovernor.h"
+
+namespace
+{
+    // Share of the block's time budget above which quality is lowered, and
+    // below which it is raised again.
+    constexpr double overloadThreshold = 0.75;
+    constexpr double underloadThreshold = 0.45;
+
+    // How long the load has to stay there first. A block that misses its
+    // deadline lowers quality straight away, as long as the last change had
+    // time to take effect.
+    constexpr double overloadSeconds = 0.05;
+    constexpr double underloadSeconds = 3.0;
+    constexpr double settleSeconds = 0.25;
+
+    constexpr QualityGovernor::Level lowestLevel = QualityGovernor::noReverb;
+}
+
+QualityGovernor::QualityGovernor()
+    : level(fullQuality)
+    , smoothedLoad(0.0)
+    , overloadedFor(0.0)
+    , underloadedFor(0.0)
+    , sinceChange(0.0)
+    , transitionFifo(maxTransitions)
+{
+    startTimer(500);
+}
+
+QualityGovernor::~QualityGovernor()
+{
+    stopTimer();
+}
+
+bool QualityGovernor::update(double renderSeconds, double blockSeconds, double synthCpuLoad) noexcept
+{
+    if (blockSeconds <= 0.0)
+        return false;
+
+    // FluidSynth reports its own load in percent of real time.
+    const double load = jmax(renderSeconds / blockSeconds, synthCpuLoad / 100.0);
+    smoothedLoad += (load - smoothedLoad) * 0.2;
+
+    sinceChange += blockSeconds;
+    overloadedFor = smoothedLoad > overloadThreshold ? overloadedFor + blockSeconds : 0.0;
+    underloadedFor = smoothedLoad < underloadThreshold ? underloadedFor + blockSeconds : 0.0;
+
+    const auto current = getLevel();
+
+    if (current < lowestLevel && sinceChange >= settleSeconds
+        && (load >= 1.0 || overloadedFor >= overloadSeconds))
+    {
+        setLevel((Level)(current + 1), smoothedLoad);
+        return true;
+    }
+
+    if (current > fullQuality && underloadedFor >= underloadSeconds)
+    {
+        setLevel((Level)(current - 1), smoothedLoad);
+        return true;
+    }
+
+    return false;
+}
+
+bool QualityGovernor::reset() noexcept
+{
+    smoothedLoad = 0.0;
+    overloadedFor = underloadedFor = 0.0;
+
+    if (getLevel() == fullQuality)
+        return false;
+
+    setLevel(fullQuality, 0.0);
+    return true;
+}
+
+QualityGovernor::Level QualityGovernor::getLevel() const noexcept
+{
+    return (Level)level.load();
+}
+
+fluid_interp QualityGovernor::getInterpolation(Level level, bool percussion) noexcept
+{
+    if (level >= linearInterpolation || (level >= cubicInterpolation && percussion))
+        return FLUID_INTERP_LINEAR;
+
+    if (level >= cubicInterpolation)
+        return FLUID_INTERP_4THORDER;
+
+    return FLUID_INTERP_HIGHEST;
+}
+
+float QualityGovernor::getPolyphonyScale(Level level) noexcept
+{
+    switch (level)
+    {
+    case linearInterpolation: return 0.75f;
+    case noChorus:            return 0.5f;
+    case noReverb:            return 0.25f;
+    default:                  return 1.0f;
+    }
+}
+
+bool QualityGovernor::allowsChorus(Level level) noexcept
+{
+    return level < noChorus;
+}
+
+bool QualityGovernor::allowsReverb(Level level) noexcept
+{
+    return level < noReverb;
+}
+
+String QualityGovernor::getLevelName(Level level)
+{
+    switch (level)
+    {
+    case fullQuality:         return "full quality";
+    case cubicInterpolation:  return "4th order interpolation";
+    case linearInterpolation: return "linear interpolation, 75% polyphony";
+    case noChorus:            return "linear interpolation, 50% polyphony, no chorus";
+    case noReverb:            return "linear interpolation, 25% polyphony, no effects";
+    default:                  return {};
+    }
+}
+
+void QualityGovernor::setLevel(Level newLevel, double load) noexcept
+{
+    const auto previous = getLevel();
+
+    level = newLevel;
+    sinceChange = 0.0;
+    overloadedFor = underloadedFor = 0.0;
+
+    // Dropped if the message thread has fallen that far behind.
+    if (transitionFifo.getFreeSpace() > 0)
+        transitionFifo.write(1).forEach([&](int index) { transitions[index] = { previous, newLevel, load }; });
+}
+
+void QualityGovernor::timerCallback()
+{
+    transitionFifo.read(transitionFifo.getNumReady()).forEach([this](int index) {
+        auto& transition = transitions[index];
+
+        Logger::writeToLog("HandySynth quality: " + getLevelName(transition.from) + " -> "
+                           + getLevelName(transition.to) + " at " + String(roundToInt(transition.load * 100.0))
+                           + "% load");
+    });
+}
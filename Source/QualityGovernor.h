@@ -0,0 +1,66 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+using namespace juce;
+
+// Watches how much of each block's time budget rendering uses, and lowers
+// the render quality a step at a time when it runs short: first the
+// interpolation, then the polyphony, then the effects. Quality comes back
+// a step at a time once the load has stayed low for a while.
+// Every change is logged from the message thread.
+class QualityGovernor : private Timer
+{
+public:
+    enum Level
+    {
+        fullQuality,
+        cubicInterpolation,
+        linearInterpolation,
+        noChorus,
+        noReverb
+    };
+
+    QualityGovernor();
+    ~QualityGovernor() override;
+
+    // Called on the audio thread after each rendered block, with the time it
+    // took and the time it had. Returns true if the level changed.
+    bool update(double renderSeconds, double blockSeconds, double synthCpuLoad) noexcept;
+
+    // Back to full quality, for when the governor is switched off.
+    bool reset() noexcept;
+
+    Level getLevel() const noexcept;
+
+    // Percussion mostly plays samples at their root key, where interpolation
+    // matters least, so it gives up quality first.
+    static fluid_interp getInterpolation(Level level, bool percussion) noexcept;
+    static float getPolyphonyScale(Level level) noexcept;
+    static bool allowsChorus(Level level) noexcept;
+    static bool allowsReverb(Level level) noexcept;
+    static String getLevelName(Level level);
+
+private:
+    void setLevel(Level newLevel, double load) noexcept;
+    void timerCallback() override;
+
+    std::atomic<int> level;
+    double smoothedLoad;
+    double overloadedFor, underloadedFor, sinceChange;
+
+    struct Transition
+    {
+        Level from, to;
+        double load;
+    };
+
+    static constexpr int maxTransitions = 64;
+
+    AbstractFifo transitionFifo;
+    Transition transitions[maxTransitions];
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(QualityGovernor)
+};
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+using namespace juce;
+
+// Render settings kept separately for live playing and for offline bounces.
+// Written on the message thread and read by the audio thread as it renders.
+struct QualityProfile
+{
+    enum EffectQuality
+    {
+        effectsOff,
+        standardEffects,
+
+        // FluidSynth's reverb has no quality setting, this doubles the chorus voices.
+        highEffects
+    };
+
+    std::atomic<int> interpolation { FLUID_INTERP_HIGHEST };
+    std::atomic<int> maxPolyphony { 1024 };
+    std::atomic<int> renderThreads { 1 };
+    std::atomic<int> effectQuality { standardEffects };
+
+    void readFrom(const ValueTree& tree)
+    {
+        interpolation = (int)tree.getProperty("interpolation", FLUID_INTERP_HIGHEST);
+        maxPolyphony = (int)tree.getProperty("maxPolyphony", 1024);
+        renderThreads = (int)tree.getProperty("renderThreads", 1);
+        effectQuality = (int)tree.getProperty("effectQuality", standardEffects);
+    }
+
+};
@@ -0,0 +1,169 @@
+#include "Resampler.h"
+
+namespace
+{
+    // Zeroth order modified Bessel function of the first kind.
+    double besselI0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+
+        for (int k = 1; k < 64 && term > sum * 1.0e-12; ++k)
+        {
+            term *= (x / (2.0 * k)) * (x / (2.0 * k));
+            sum += term;
+        }
+
+        return sum;
+    }
+}
+
+Resampler::Resampler()
+    : numTaps(baseTaps)
+    , numChannels(0)
+    , maxOutputSamples(0)
+    , step(1.0)
+    , numBuffered(0)
+    , numOutput(0)
+    , numDropped(0)
+{
+}
+
+void Resampler::prepare(double inputRate, double outputRate, int channels, int maxOutput)
+{
+    step = inputRate / outputRate;
+    numChannels = channels;
+    maxOutputSamples = maxOutput;
+
+    // Going down in rate the cutoff drops, and the filter has to span more
+    // input samples for the same transition band.
+    numTaps = 2 * (int)std::ceil(baseTaps / 2 * jmax(1.0, step));
+
+    const double cutoff = 0.5 * passband * jmin(1.0, 1.0 / step);
+    const double halfLength = numTaps / 2;
+    const double windowScale = 1.0 / besselI0(kaiserBeta);
+
+    table.allocate((size_t)((numPhases + 1) * numTaps), false);
+    coefficients.allocate((size_t)numTaps, false);
+
+    for (int phase = 0; phase <= numPhases; ++phase)
+    {
+        auto* row = table + phase * numTaps;
+        const double fraction = (double)phase / numPhases;
+        double sum = 0.0;
+
+        for (int tap = 0; tap < numTaps; ++tap)
+        {
+            const double t = fraction + halfLength - 1 - tap;
+            const double x = t / halfLength;
+            const double arg = 2.0 * cutoff * t;
+
+            const double sinc = std::abs(arg) < 1.0e-9 ? 1.0 : std::sin(MathConstants<double>::pi * arg) / (MathConstants<double>::pi * arg);
+            const double window = std::abs(x) >= 1.0 ? 0.0 : besselI0(kaiserBeta * std::sqrt(1.0 - x * x)) * windowScale;
+
+            row[tap] = (float)(2.0 * cutoff * sinc * window);
+            sum += row[tap];
+        }
+
+        // Unity gain at DC for every phase, so the phases can't beat.
+        for (int tap = 0; tap < numTaps; ++tap)
+            row[tap] = (float)(row[tap] / sum);
+    }
+
+    history.setSize(numChannels, numTaps + getMaxInputNeeded());
+
+    reset();
+}
+
+void Resampler::reset()
+{
+    history.clear();
+
+    // Starting on silence puts the first output sample on the first input
+    // sample, at the cost of reading half the filter ahead.
+    numBuffered = numTaps / 2 - 1;
+    numOutput = 0;
+    numDropped = 0;
+}
+
+double Resampler::getPosition(int64 outputIndex) const
+{
+    return (double)(numTaps / 2 - 1 - numDropped) + (double)outputIndex * step;
+}
+
+int Resampler::getInputNeeded(int numOutputSamples) const
+{
+    if (numOutputSamples <= 0)
+        return 0;
+
+    const double last = getPosition(numOutput + numOutputSamples - 1);
+    const int lastIndex = (int)std::floor(last) + numTaps / 2;
+
+    return jmax(0, lastIndex + 1 - numBuffered);
+}
+
+int Resampler::getMaxInputNeeded() const
+{
+    return (int)std::ceil(maxOutputSamples * step) + numTaps + 1;
+}
+
+void Resampler::process(const float* const* input, float* const* output, int outputOffset, int numOutputSamples)
+{
+    jassert(numOutputSamples <= maxOutputSamples);
+
+    const int numInput = getInputNeeded(numOutputSamples);
+
+    for (int channel = 0; channel < numChannels; ++channel)
+        history.copyFrom(channel, numBuffered, input[channel], numInput);
+
+    numBuffered += numInput;
+
+    for (int i = 0; i < numOutputSamples; ++i)
+    {
+        const double position = getPosition(numOutput + i);
+        const int index = (int)std::floor(position);
+        const double phase = (position - index) * numPhases;
+        const int row = jmin((int)phase, numPhases - 1);
+        const float weight = (float)(phase - row);
+
+        const float* lower = table + row * numTaps;
+        const float* upper = lower + numTaps;
+
+        for (int tap = 0; tap < numTaps; ++tap)
+            coefficients[tap] = lower[tap] + weight * (upper[tap] - lower[tap]);
+
+        const int first = index - numTaps / 2 + 1;
+
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            const float* source = history.getReadPointer(channel, first);
+            float sum = 0.0f;
+
+            for (int tap = 0; tap < numTaps; ++tap)
+                sum += source[tap] * coefficients[tap];
+
+            output[channel][outputOffset + i] += sum;
+        }
+    }
+
+    numOutput += numOutputSamples;
+
+    // Drop the input that no later output sample reaches back to.
+    const int consumed = jlimit(0, numBuffered, (int)std::floor(getPosition(numOutput)) - numTaps / 2 + 1);
+
+    if (consumed > 0)
+    {
+        for (int channel = 0; channel < numChannels; ++channel)
+        {
+            auto* data = history.getWritePointer(channel);
+            std::memmove(data, data + consumed, sizeof(float) * (size_t)(numBuffered - consumed));
+        }
+
+        numBuffered -= consumed;
+        numDropped += consumed;
+    }
+}
+
+int Resampler::getLatencySamples() const
+{
+    return roundToInt((numTaps / 2) / step);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+using namespace juce;
+
+// Converts multichannel audio between two fixed sample rates with a Kaiser
+// windowed sinc filter, stored as a table of polyphase branches that is
+// interpolated between neighbouring phases.
+// It pulls its input: ask getInputNeeded() how many input samples the next
+// output block takes, render exactly that many, then call process().
+class Resampler
+{
+public:
+    Resampler();
+
+    // Allocates, not for the audio thread. maxOutputSamples bounds the
+    // output of a single process() call.
+    void prepare(double inputRate, double outputRate, int numChannels, int maxOutputSamples);
+
+    void reset();
+
+    int getInputNeeded(int numOutputSamples) const;
+    int getMaxInputNeeded() const;
+
+    // Consumes getInputNeeded(numOutputSamples) input samples and adds the
+    // resampled signal into output, starting at outputOffset.
+    void process(const float* const* input, float* const* output, int outputOffset, int numOutputSamples);
+
+    // Delay the filter adds, in output samples.
+    int getLatencySamples() const;
+
+private:
+    static constexpr int numPhases = 256;
+    static constexpr int baseTaps = 32;
+    static constexpr double kaiserBeta = 8.6;
+    static constexpr double passband = 0.92;
+
+    int numTaps, numChannels, maxOutputSamples;
+    double step;
+
+    // Input samples already received, numTaps - 1 of history ahead of the
+    // new ones. Positions are worked out from whole sample counts rather than
+    // accumulated, so the output doesn't depend on how it was split into calls.
+    AudioBuffer<float> history;
+    int numBuffered;
+    int64 numOutput, numDropped;
+
+    double getPosition(int64 outputIndex) const;
+
+    // (numPhases + 1) rows of numTaps coefficients, one row per fraction of
+    // an input sample, plus the row for a whole sample to interpolate towards.
+    HeapBlock<float> table;
+    HeapBlock<float> coefficients;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Resampler)
+};
@@ -0,0 +1,92 @@
+#include "Semaphore.h"
+
+#if JUCE_WINDOWS
+ #include <windows.h>
+#elif JUCE_MAC || JUCE_IOS
+ #include <dispatch/dispatch.h>
+#else
+ #include <semaphore.h>
+ #include <time.h>
+#endif
+
+struct Semaphore::Handle
+{
+#if JUCE_WINDOWS
+    Handle() : semaphore(CreateSemaphore(nullptr, 0, LONG_MAX, nullptr)) {}
+    ~Handle() { CloseHandle(semaphore); }
+
+    HANDLE semaphore;
+#elif JUCE_MAC || JUCE_IOS
+    Handle() : semaphore(dispatch_semaphore_create(0)) {}
+    ~Handle() { dispatch_release(semaphore); }
+
+    dispatch_semaphore_t semaphore;
+#else
+    Handle() { sem_init(&semaphore, 0, 0); }
+    ~Handle() { sem_destroy(&semaphore); }
+
+    sem_t semaphore;
+#endif
+};
+
+Semaphore::Semaphore()
+    : handle(std::make_unique<Handle>())
+{
+}
+
+Semaphore::~Semaphore() = default;
+
+void Semaphore::signal() noexcept
+{
+#if JUCE_WINDOWS
+    ReleaseSemaphore(handle->semaphore, 1, nullptr);
+#elif JUCE_MAC || JUCE_IOS
+    dispatch_semaphore_signal(handle->semaphore);
+#else
+    sem_post(&handle->semaphore);
+#endif
+}
+
+void Semaphore::wait() noexcept
+{
+#if JUCE_WINDOWS
+    WaitForSingleObject(handle->semaphore, INFINITE);
+#elif JUCE_MAC || JUCE_IOS
+    dispatch_semaphore_wait(handle->semaphore, DISPATCH_TIME_FOREVER);
+#else
+    while (sem_wait(&handle->semaphore) != 0 && errno == EINTR)
+    {
+    }
+#endif
+}
+
+bool Semaphore::wait(double timeoutMs) noexcept
+{
+    const auto nanoseconds = (int64)(jmax(0.0, timeoutMs) * 1.0e6);
+
+#if JUCE_WINDOWS
+    return WaitForSingleObject(handle->semaphore, (DWORD)((nanoseconds + 999999) / 1000000)) == WAIT_OBJECT_0;
+#elif JUCE_MAC || JUCE_IOS
+    return dispatch_semaphore_wait(handle->semaphore, dispatch_time(DISPATCH_TIME_NOW, nanoseconds)) == 0;
+#else
+    // sem_timedwait() takes a deadline on the realtime clock.
+    timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += (time_t)(nanoseconds / 1000000000);
+    deadline.tv_nsec += (long)(nanoseconds % 1000000000);
+
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        ++deadline.tv_sec;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int result;
+
+    while ((result = sem_timedwait(&handle->semaphore, &deadline)) != 0 && errno == EINTR)
+    {
+    }
+
+    return result == 0;
+#endif
+}
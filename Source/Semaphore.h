@@ -0,0 +1,26 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+using namespace juce;
+
+// A counting semaphore for handing work between the audio thread and a
+// worker. Signalling takes no lock in user space, unlike WaitableEvent.
+class Semaphore
+{
+public:
+    Semaphore();
+    ~Semaphore();
+
+    void signal() noexcept;
+    void wait() noexcept;
+
+    // Returns false if it wasn't signalled within timeoutMs.
+    bool wait(double timeoutMs) noexcept;
+
+private:
+    struct Handle;
+    std::unique_ptr<Handle> handle;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(Semaphore)
+};
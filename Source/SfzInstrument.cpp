@@ -0,0 +1,733 @@
+#include "SfzInstrument.h"
+
+namespace
+{
+    // Libraries up to this size are decoded completely when loaded.
+    const int64 fullLoadBytes = (int64)256 << 20;
+
+    // Of larger ones, enough of each sample to cover reading the rest of it.
+    const double headSeconds = 0.5;
+
+    const int decodeChunkFrames = 1 << 16;
+
+    // Silence after the end of each sample, for the interpolation to read.
+    const int paddingFrames = 64;
+
+    const int maxIncludeDepth = 16;
+
+    // FluidSynth scales the attenuation generator by 0.4, as EMU hardware did.
+    const float attenuationScale = 0.4f;
+
+    // GEN_SAMPLEMODE values.
+    const int noLoop = 0;
+    const int loopContinuous = 1;
+    const int loopSustain = 3;
+
+    float toTimecents(double seconds)
+    {
+        return seconds <= 0.001 ? -12000.0f : (float)(1200.0 * std::log2(seconds));
+    }
+
+    // A MIDI note number, or a note name with middle C as c4. -1 if neither.
+    int parseKey(const String& text)
+    {
+        auto name = text.trim().toLowerCase();
+
+        if (name.isEmpty())
+            return -1;
+
+        if (name[0] == '-' || CharacterFunctions::isDigit(name[0]))
+            return name.getIntValue();
+
+        if (name[0] < 'a' || name[0] > 'g')
+            return -1;
+
+        static const int semitones[] = { 9, 11, 0, 2, 4, 5, 7 };
+        int key = semitones[name[0] - 'a'];
+        int pos = 1;
+
+        // A 'b' followed by the octave is a flat rather than the note B.
+        if (name[pos] == '#' || (name[pos] == 'b' && name.length() > pos + 1))
+        {
+            key += name[pos] == '#' ? 1 : -1;
+            ++pos;
+        }
+
+        return key + (name.substring(pos).getIntValue() + 1) * 12;
+    }
+
+    bool isOpcodeChar(char c)
+    {
+        return CharacterFunctions::isLetterOrDigit(c) || c == '_';
+    }
+
+    // Block and line comments turned into whitespace.
+    std::string stripComments(const std::string& text)
+    {
+        std::string result;
+        result.reserve(text.size());
+
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] == '/' && i + 1 < text.size() && text[i + 1] == '/')
+            {
+                i = jmin(text.find('\n', i), text.size());
+                result += '\n';
+            }
+            else if (text[i] == '/' && i + 1 < text.size() && text[i + 1] == '*')
+            {
+                const auto end = text.find("*/", i + 2);
+
+                if (end == std::string::npos)
+                    break;
+
+                i = end + 1;
+                result += ' ';
+            }
+            else
+            {
+                result += text[i];
+            }
+        }
+
+        return result;
+    }
+
+    void addOffset(Array<SfzInstrument::Generator>& generators, int fine, int coarse, int64 frames)
+    {
+        if (frames == 0)
+            return;
+
+        generators.add({ coarse, (float)(frames / 32768) });
+        generators.add({ fine, (float)(frames % 32768) });
+    }
+}
+
+//==============================================================================
+class SfzInstrument::Parser
+{
+public:
+    Parser(SfzInstrument& instrument, const File& file)
+        : instrument(instrument)
+        , folder(file.getParentDirectory())
+    {
+    }
+
+    bool parseFile(const File& file, int depth)
+    {
+        if (depth > maxIncludeDepth || !file.existsAsFile())
+            return false;
+
+        parseText(stripComments(file.loadFileAsString().toStdString()), depth);
+        return true;
+    }
+
+    void finish()
+    {
+        flushRegion();
+    }
+
+private:
+    enum Level
+    {
+        control,
+        global,
+        master,
+        group,
+        region,
+        ignored,
+        numLevels
+    };
+
+    void parseText(const std::string& text, int depth)
+    {
+        size_t pos = 0;
+
+        while (pos < text.size())
+        {
+            const char c = text[pos];
+
+            if (CharacterFunctions::isWhitespace(c))
+            {
+                ++pos;
+                continue;
+            }
+
+            const size_t lineEnd = jmin(text.find('\n', pos), text.size());
+
+            if (c == '<')
+            {
+                const auto close = text.find('>', pos);
+
+                if (close == std::string::npos)
+                    return;
+
+                beginHeader(String(text.substr(pos + 1, close - pos - 1)).trim().toLowerCase());
+                pos = close + 1;
+            }
+            else if (c == '#')
+            {
+                auto tokens = StringArray::fromTokens(String::fromUTF8(text.data() + pos, (int)(lineEnd - pos)), " \t", "\"");
+                tokens.removeEmptyStrings();
+
+                if (tokens[0] == "#define" && tokens.size() >= 3)
+                    defines.set(tokens[1], tokens[2]);
+                else if (tokens[0] == "#include" && tokens.size() >= 2)
+                    parseFile(folder.getChildFile(substitute(tokens[1].unquoted()).replaceCharacter('\\', '/')), depth + 1);
+
+                pos = lineEnd;
+            }
+            else
+            {
+                size_t nameEnd = pos;
+
+                while (nameEnd < lineEnd && isOpcodeChar(text[nameEnd]))
+                    ++nameEnd;
+
+                if (nameEnd == pos || nameEnd >= lineEnd || text[nameEnd] != '=')
+                {
+                    // Not an opcode, skip the word.
+                    while (pos < lineEnd && !CharacterFunctions::isWhitespace(text[pos]))
+                        ++pos;
+
+                    continue;
+                }
+
+                const auto name = String(text.substr(pos, nameEnd - pos));
+                const size_t valueEnd = findValueEnd(text, nameEnd + 1, lineEnd, name == "sample" || name == "default_path");
+
+                setOpcode(name, substitute(String::fromUTF8(text.data() + nameEnd + 1, (int)(valueEnd - nameEnd - 1)).trim()));
+                pos = valueEnd;
+            }
+        }
+    }
+
+    // File names may contain spaces, so they run up to the next opcode or header.
+    static size_t findValueEnd(const std::string& text, size_t start, size_t lineEnd, bool allowSpaces)
+    {
+        for (size_t pos = start; pos < lineEnd; ++pos)
+        {
+            if (text[pos] == '<')
+                return pos;
+
+            if (!CharacterFunctions::isWhitespace(text[pos]))
+                continue;
+
+            if (!allowSpaces)
+                return pos;
+
+            size_t next = pos;
+
+            while (next < lineEnd && CharacterFunctions::isWhitespace(text[next]))
+                ++next;
+
+            size_t nameEnd = next;
+
+            while (nameEnd < lineEnd && isOpcodeChar(text[nameEnd]))
+                ++nameEnd;
+
+            if (next >= lineEnd || text[next] == '<' || (nameEnd > next && nameEnd < lineEnd && text[nameEnd] == '='))
+                return pos;
+        }
+
+        return lineEnd;
+    }
+
+    String substitute(String value) const
+    {
+        if (value.containsChar('$'))
+            for (auto& key : defines.getAllKeys())
+                value = value.replace(key, defines[key]);
+
+        return value;
+    }
+
+    void beginHeader(const String& header)
+    {
+        flushRegion();
+
+        if (header == "control")
+        {
+            level = control;
+        }
+        else if (header == "global")
+        {
+            level = global;
+            clearFrom(global);
+        }
+        else if (header == "master")
+        {
+            level = master;
+            clearFrom(master);
+        }
+        else if (header == "group")
+        {
+            level = group;
+            clearFrom(group);
+        }
+        else if (header == "region")
+        {
+            level = region;
+            clearFrom(region);
+        }
+        else
+        {
+            // <curve>, <effect>, <midi> and the like.
+            level = ignored;
+        }
+    }
+
+    void clearFrom(Level first)
+    {
+        for (int i = first; i <= region; ++i)
+            opcodes[i].clear();
+    }
+
+    void setOpcode(const String& name, const String& value)
+    {
+        if (name == "default_path")
+            defaultPath = value.replaceCharacter('\\', '/');
+        else if (level != ignored)
+            opcodes[level].set(name, value);
+    }
+
+    void flushRegion()
+    {
+        if (level != region)
+            return;
+
+        level = ignored;
+
+        StringPairArray merged;
+
+        for (int i = global; i <= region; ++i)
+            merged.addArray(opcodes[i]);
+
+        addRegion(merged);
+    }
+
+    int getSampleIndex(const File& file)
+    {
+        auto it = sampleIndices.find(file.getFullPathName());
+
+        if (it != sampleIndices.end())
+            return it->second;
+
+        auto* sample = instrument.samples.add(new Sample());
+        sample->file = file;
+
+        return sampleIndices[file.getFullPathName()] = instrument.samples.size() - 1;
+    }
+
+    void addRegion(const StringPairArray& op)
+    {
+        auto samplePath = op["sample"];
+
+        // Release triggers and built-in oscillators are not supported.
+        if (samplePath.isEmpty() || samplePath.startsWithChar('*') || op.getValue("trigger", "attack") != "attack"
+            || instrument.regions.size() > std::numeric_limits<uint16>::max())
+            return;
+
+        auto has = [&op](const char* name) { return op.containsKey(name); };
+        auto number = [&op](const char* name) { return op[name].getDoubleValue(); };
+
+        Region r;
+        r.sample = getSampleIndex(folder.getChildFile((defaultPath + samplePath).replaceCharacter('\\', '/')));
+
+        const int key = has("key") ? parseKey(op["key"]) : -1;
+        r.keyLo = jlimit(0, 127, has("lokey") ? parseKey(op["lokey"]) : key >= 0 ? key : 0);
+        r.keyHi = jlimit(0, 127, has("hikey") ? parseKey(op["hikey"]) : key >= 0 ? key : 127);
+        r.velLo = jlimit(0, 127, has("lovel") ? (int)number("lovel") : 0);
+        r.velHi = jlimit(0, 127, has("hivel") ? (int)number("hivel") : 127);
+        r.randLo = has("lorand") ? (float)number("lorand") : 0.0f;
+        r.randHi = has("hirand") ? (float)number("hirand") : 1.0f;
+
+        if (r.keyLo > r.keyHi || r.velLo > r.velHi)
+            return;
+
+        const int keycenter = has("pitch_keycenter") ? parseKey(op["pitch_keycenter"]) : key >= 0 ? key : 60;
+        r.generators.add({ GEN_OVERRIDEROOTKEY, (float)jlimit(0, 127, keycenter) });
+
+        if (has("pitch_keytrack"))
+            r.generators.add({ GEN_SCALETUNE, (float)jlimit(0.0, 1200.0, number("pitch_keytrack")) });
+
+        if (has("transpose"))
+            r.generators.add({ GEN_COARSETUNE, (float)number("transpose") });
+
+        if (has("tune"))
+            r.generators.add({ GEN_FINETUNE, (float)number("tune") });
+
+        // FluidSynth can only attenuate, not boost.
+        if (has("volume"))
+            r.generators.add({ GEN_ATTENUATION, jlimit(0.0f, 1440.0f, (float)(-10.0 * number("volume")) / attenuationScale) });
+
+        if (has("pan"))
+            r.generators.add({ GEN_PAN, (float)jlimit(-500.0, 500.0, number("pan") * 5.0) });
+
+        const std::pair<const char*, int> envelope[] = {
+            { "ampeg_delay", GEN_VOLENVDELAY },
+            { "ampeg_attack", GEN_VOLENVATTACK },
+            { "ampeg_hold", GEN_VOLENVHOLD },
+            { "ampeg_decay", GEN_VOLENVDECAY },
+            { "ampeg_release", GEN_VOLENVRELEASE }
+        };
+
+        for (auto& stage : envelope)
+            if (has(stage.first))
+                r.generators.add({ stage.second, toTimecents(number(stage.first)) });
+
+        if (has("ampeg_sustain"))
+        {
+            const double percent = number("ampeg_sustain");
+            r.generators.add({ GEN_VOLENVSUSTAIN, percent <= 0.0 ? 1440.0f : jlimit(0.0f, 1440.0f, (float)(-200.0 * std::log10(percent / 100.0))) });
+        }
+
+        instrument.maxReleaseSeconds = jmax(instrument.maxReleaseSeconds, has("ampeg_release") ? number("ampeg_release") : 0.001);
+
+        if (has("cutoff"))
+            r.generators.add({ GEN_FILTERFC, jlimit(1500.0f, 13500.0f, (float)(1200.0 * std::log2(jmax(1.0, number("cutoff")) / 8.176))) });
+
+        if (has("resonance"))
+            r.generators.add({ GEN_FILTERQ, jlimit(0.0f, 960.0f, (float)(10.0 * number("resonance"))) });
+
+        // A group that stops itself, the usual open and closed hi-hat case,
+        // is what FluidSynth's exclusive classes do.
+        if (has("group") && op["off_by"] == op["group"])
+            r.generators.add({ GEN_EXCLUSIVECLASS, (float)jlimit(0, 127, (int)number("group")) });
+
+        r.offset = has("offset") ? (int64)number("offset") : 0;
+        r.end = has("end") ? (int64)number("end") : -1;
+        r.loopStart = has("loop_start") ? (int64)number("loop_start") : has("loopstart") ? (int64)number("loopstart") : -1;
+        r.loopEnd = has("loop_end") ? (int64)number("loop_end") : has("loopend") ? (int64)number("loopend") : -1;
+
+        const auto loopMode = has("loop_mode") ? op["loop_mode"] : op["loopmode"];
+
+        if (loopMode == "no_loop" || loopMode == "one_shot")
+            r.loopMode = noLoop;
+        else if (loopMode == "loop_continuous")
+            r.loopMode = loopContinuous;
+        else if (loopMode == "loop_sustain")
+            r.loopMode = loopSustain;
+
+        instrument.regions.add(r);
+    }
+
+    SfzInstrument& instrument;
+    const File folder;
+
+    Level level = ignored;
+    StringPairArray opcodes[numLevels];
+    StringPairArray defines;
+    String defaultPath;
+    std::map<String, int> sampleIndices;
+};
+
+//==============================================================================
+SfzInstrument::SfzInstrument()
+    : Thread("SFZ sample reader")
+    , maxReleaseSeconds(0.001)
+    , numRequests(0)
+{
+    zeromem(keyStart, sizeof(keyStart));
+    formatManager.registerBasicFormats();
+}
+
+SfzInstrument::~SfzInstrument()
+{
+    stopThread(5000);
+}
+
+std::unique_ptr<SfzInstrument> SfzInstrument::load(const File& file, SoundfontStream::LoadProgress* progress)
+{
+    std::unique_ptr<SfzInstrument> instrument(new SfzInstrument());
+    instrument->name = file.getFileNameWithoutExtension();
+
+    Parser parser(*instrument, file);
+
+    if (!parser.parseFile(file, 0))
+        return nullptr;
+
+    parser.finish();
+
+    if (!instrument->loadSamples(progress))
+        return nullptr;
+
+    // Regions of samples that could not be opened are dropped.
+    auto& regions = instrument->regions;
+
+    for (int i = regions.size(); --i >= 0;)
+    {
+        if (instrument->samples[regions.getReference(i).sample]->numFrames == 0)
+            regions.remove(i);
+        else
+            instrument->addSampleGenerators(regions.getReference(i));
+    }
+
+    if (regions.isEmpty())
+        return nullptr;
+
+    instrument->buildKeyTable();
+
+    for (auto* sample : instrument->samples)
+    {
+        if (!sample->resident)
+        {
+            instrument->startThread();
+            break;
+        }
+    }
+
+    return instrument;
+}
+
+bool SfzInstrument::loadSamples(SoundfontStream::LoadProgress* progress)
+{
+    int64 totalBytes = 0;
+
+    for (auto* sample : samples)
+    {
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(sample->file));
+
+        if (reader == nullptr || reader->lengthInSamples <= 0)
+            continue;
+
+        sample->numChannels = jlimit(1, 2, (int)reader->numChannels);
+        sample->numFrames = jmin(reader->lengthInSamples, (int64)std::numeric_limits<int>::max() - paddingFrames);
+        sample->sampleRate = roundToInt(reader->sampleRate);
+
+        // Loops a WAV file's smpl chunk defines. Their end is inclusive,
+        // FluidSynth's is the frame after the loop.
+        auto& metadata = reader->metadataValues;
+        sample->looped = metadata["NumSampleLoops"].getIntValue() > 0;
+        sample->loopStart = sample->looped ? jlimit((int64)0, sample->numFrames, metadata["Loop0Start"].getLargeIntValue()) : 0;
+        sample->loopEnd = sample->looped ? jlimit(sample->loopStart, sample->numFrames, metadata["Loop0End"].getLargeIntValue() + 1) : sample->numFrames;
+
+        const bool deep = reader->bitsPerSample > 16 || reader->usesFloatingPointData;
+
+        bool allocated = true;
+
+        for (int channel = 0; channel < sample->numChannels; ++channel)
+        {
+            // Zeroed, so the pages of a tail that is never read are never touched.
+            sample->data[channel].calloc((size_t)(sample->numFrames + paddingFrames));
+            allocated = allocated && sample->data[channel] != nullptr;
+
+            if (deep)
+            {
+                sample->data24[channel].calloc((size_t)(sample->numFrames + paddingFrames));
+                allocated = allocated && sample->data24[channel] != nullptr;
+            }
+        }
+
+        if (!allocated)
+        {
+            sample->numFrames = 0;
+            continue;
+        }
+
+        totalBytes += sample->numFrames * sample->numChannels * (deep ? 3 : 2);
+    }
+
+    const bool loadFully = totalBytes <= fullLoadBytes;
+    int64 totalFrames = 0, framesDone = 0;
+
+    for (auto* sample : samples)
+    {
+        if (sample->numFrames == 0)
+            continue;
+
+        sample->headFrames = loadFully ? sample->numFrames : jmin(sample->numFrames, (int64)(headSeconds * sample->sampleRate));
+        totalFrames += sample->headFrames;
+    }
+
+    for (auto* sample : samples)
+    {
+        if (sample->numFrames == 0)
+            continue;
+
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(sample->file));
+
+        if (reader == nullptr || !decode(*reader, *sample, 0, sample->headFrames, progress))
+        {
+            if (progress != nullptr && progress->cancelled)
+                return false;
+
+            sample->numFrames = 0;
+            continue;
+        }
+
+        sample->resident = sample->headFrames == sample->numFrames;
+        framesDone += sample->headFrames;
+
+        if (progress != nullptr)
+            progress->progress = (double)framesDone / (double)jmax((int64)1, totalFrames);
+    }
+
+    return true;
+}
+
+bool SfzInstrument::decode(AudioFormatReader& reader, Sample& sample, int64 start, int64 end,
+                           SoundfontStream::LoadProgress* progress)
+{
+    AudioBuffer<float> buffer(sample.numChannels, decodeChunkFrames);
+
+    for (int64 pos = start; pos < end; pos += decodeChunkFrames)
+    {
+        if ((progress != nullptr && progress->cancelled) || threadShouldExit())
+            return false;
+
+        const int numFrames = (int)jmin((int64)decodeChunkFrames, end - pos);
+        reader.read(&buffer, 0, numFrames, pos, true, sample.numChannels > 1);
+
+        for (int channel = 0; channel < sample.numChannels; ++channel)
+        {
+            const float* source = buffer.getReadPointer(channel);
+            short* dest = sample.data[channel] + pos;
+            char* dest24 = sample.data24[channel] != nullptr ? sample.data24[channel] + pos : nullptr;
+
+            // Past the head nothing reads these until the sample is resident.
+            for (int i = 0; i < numFrames; ++i)
+            {
+                const int value = jlimit(-8388608, 8388607, roundToInt(source[i] * 8388608.0f));
+                dest[i] = (short)(value >> 8);
+
+                if (dest24 != nullptr)
+                    dest24[i] = (char)(value & 0xFF);
+            }
+        }
+    }
+
+    return true;
+}
+
+void SfzInstrument::addSampleGenerators(Region& region) const
+{
+    auto& sample = *samples[region.sample];
+    auto& gens = region.generators;
+
+    addOffset(gens, GEN_STARTADDROFS, GEN_STARTADDRCOARSEOFS, jlimit((int64)0, sample.numFrames - 1, region.offset));
+
+    // SFZ ends are inclusive, and FluidSynth's sample end is its last frame.
+    if (region.end >= 0)
+        addOffset(gens, GEN_ENDADDROFS, GEN_ENDADDRCOARSEOFS, jmin(region.end, sample.numFrames - 1) - (sample.numFrames - 1));
+
+    if (region.loopStart >= 0)
+        addOffset(gens, GEN_STARTLOOPADDROFS, GEN_STARTLOOPADDRCOARSEOFS, jlimit((int64)0, sample.numFrames, region.loopStart) - sample.loopStart);
+
+    if (region.loopEnd >= 0)
+        addOffset(gens, GEN_ENDLOOPADDROFS, GEN_ENDLOOPADDRCOARSEOFS, jlimit((int64)0, sample.numFrames, region.loopEnd + 1) - sample.loopEnd);
+
+    // Without a loop mode, samples loop when there is a loop to play.
+    int mode = region.loopMode;
+
+    if (mode < 0)
+        mode = sample.looped || region.loopEnd >= 0 ? loopContinuous : noLoop;
+
+    if (mode != noLoop)
+        gens.add({ GEN_SAMPLEMODE, (float)mode });
+}
+
+void SfzInstrument::buildKeyTable()
+{
+    keyEntries.clearQuick();
+
+    for (int key = 0; key < 128; ++key)
+    {
+        keyStart[key] = keyEntries.size();
+
+        for (int i = 0; i < regions.size(); ++i)
+        {
+            auto& region = regions.getReference(i);
+
+            if (key >= region.keyLo && key <= region.keyHi)
+                keyEntries.add({ (uint8)region.velLo, (uint8)region.velHi, (uint16)i });
+        }
+    }
+
+    keyStart[128] = keyEntries.size();
+}
+
+const String& SfzInstrument::getName() const
+{
+    return name;
+}
+
+const Array<SfzInstrument::Region>& SfzInstrument::getRegions() const
+{
+    return regions;
+}
+
+const OwnedArray<SfzInstrument::Sample>& SfzInstrument::getSamples() const
+{
+    return samples;
+}
+
+const SfzInstrument::KeyEntry* SfzInstrument::getRegionsForKey(int key, int& numEntries) const noexcept
+{
+    key = jlimit(0, 127, key);
+    numEntries = keyStart[key + 1] - keyStart[key];
+
+    return keyEntries.begin() + keyStart[key];
+}
+
+void SfzInstrument::requestSample(int index) noexcept
+{
+    auto& sample = *samples.getUnchecked(index);
+
+    if (!sample.resident && !sample.requested.exchange(true))
+        numRequests.fetch_add(1, std::memory_order_release);
+}
+
+double SfzInstrument::getMaxReleaseSeconds() const
+{
+    // FluidSynth caps envelope stages at about 100 seconds.
+    return jmin(maxReleaseSeconds, 100.0);
+}
+
+void SfzInstrument::run()
+{
+    // Tails in the order the samples were declared, except for those whose
+    // regions have started playing.
+    int next = 0;
+    int requestsSeen = 0;
+
+    while (!threadShouldExit())
+    {
+        int index = -1;
+        const int requests = numRequests.load(std::memory_order_acquire);
+
+        if (requests != requestsSeen)
+        {
+            for (int i = 0; i < samples.size() && index < 0; ++i)
+                if (samples[i]->requested && !samples[i]->tailRead)
+                    index = i;
+
+            if (index < 0)
+                requestsSeen = requests;
+        }
+
+        if (index < 0)
+        {
+            while (next < samples.size() && (samples[next]->tailRead || samples[next]->resident || samples[next]->numFrames == 0))
+                ++next;
+
+            if (next == samples.size())
+                return;
+
+            index = next++;
+        }
+
+        auto& sample = *samples[index];
+        sample.tailRead = true;
+
+        if (sample.resident || sample.numFrames == 0)
+            continue;
+
+        std::unique_ptr<AudioFormatReader> reader(formatManager.createReaderFor(sample.file));
+
+        // Published only once the whole tail is written. A sample that can't
+        // be read keeps playing its head.
+        if (reader != nullptr && decode(*reader, sample, sample.headFrames, sample.numFrames, nullptr))
+            sample.resident = true;
+    }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "SoundfontStream.h"
+
+using namespace juce;
+
+// An SFZ instrument, its opcode text parsed once into regions that are
+// turned into FluidSynth generators up front, and a table of the regions
+// each key can play. Shared by every synth playing it.
+// Sample files are decoded to 16 bit, plus the low bytes of deeper ones.
+// Small libraries are decoded completely when loaded. Large ones only get
+// the head of every sample, and a background thread reads the rest of every
+// sample right after, taking samples whose regions start playing first.
+// Until a sample's tail is read its voices only play the head, which is
+// never written to again, see SfzLoader.
+class SfzInstrument : private Thread
+{
+public:
+    struct Generator
+    {
+        int type;
+        float value;
+    };
+
+    struct Region
+    {
+        int sample;
+        int keyLo, keyHi, velLo, velHi;
+
+        // Range of the random number drawn per note, for round robins.
+        float randLo, randHi;
+
+        Array<Generator> generators;
+
+        // Frames as the SFZ gives them, -1 where it doesn't. Turned into
+        // generators once the sample's length and loop are known.
+        int64 offset = 0, end = -1, loopStart = -1, loopEnd = -1;
+        int loopMode = -1;
+    };
+
+    struct Sample
+    {
+        File file;
+        int numChannels = 1;
+        int64 numFrames = 0;
+        int sampleRate = 44100;
+        int64 loopStart = 0, loopEnd = 0;
+        bool looped = false;
+
+        // Per channel, allocated for the whole sample up front. Frames past
+        // headFrames are written by the background thread, and only read once
+        // resident is set.
+        HeapBlock<short> data[2];
+        HeapBlock<char> data24[2];
+        int64 headFrames = 0;
+
+        std::atomic<bool> requested { false };
+        std::atomic<bool> resident { false };
+
+        // Background thread only, set once reading the tail was tried.
+        bool tailRead = false;
+    };
+
+    // A region and the velocities it plays, see getRegionsForKey().
+    struct KeyEntry
+    {
+        uint8 velLo, velHi;
+        uint16 region;
+    };
+
+    ~SfzInstrument() override;
+
+    // Returns nullptr if the file can't be parsed, has no playable regions,
+    // or the load is cancelled through the progress object.
+    static std::unique_ptr<SfzInstrument> load(const File& file, SoundfontStream::LoadProgress* progress);
+
+    const String& getName() const;
+    const Array<Region>& getRegions() const;
+    const OwnedArray<Sample>& getSamples() const;
+
+    // The regions a key can play, each with its velocity range.
+    const KeyEntry* getRegionsForKey(int key, int& numEntries) const noexcept;
+
+    // Called on the audio thread when a region of the sample plays. Moves
+    // the rest of the sample to the front of the background reading, the
+    // first time only. Takes no lock, any synth's audio thread may call it.
+    void requestSample(int index) noexcept;
+
+    // Longest amplitude envelope release of any region, in seconds.
+    double getMaxReleaseSeconds() const;
+
+private:
+    SfzInstrument();
+
+    class Parser;
+
+    bool loadSamples(SoundfontStream::LoadProgress* progress);
+    bool decode(AudioFormatReader& reader, Sample& sample, int64 start, int64 end, SoundfontStream::LoadProgress* progress);
+    void addSampleGenerators(Region& region) const;
+    void buildKeyTable();
+    void run() override;
+
+    String name;
+    Array<Region> regions;
+    OwnedArray<Sample> samples;
+    double maxReleaseSeconds;
+
+    // Regions by key, the entries for key k are keyEntries[keyStart[k]] up to
+    // keyEntries[keyStart[k + 1]].
+    int keyStart[129];
+    Array<KeyEntry> keyEntries;
+
+    AudioFormatManager formatManager;
+
+    // Counts the samples whose requested flag was raised. The background
+    // thread only looks for requested samples when it has changed.
+    std::atomic<int> numRequests;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SfzInstrument)
+};
@@ -0,0 +1,273 @@
+#include "SfzLoader.h"
+#include "SfzInstrument.h"
+#include "SoundfontStream.h"
+
+namespace
+{
+    struct Cache
+    {
+        // Held while a file is parsed, so that synths asking for the same
+        // file at the same time share one parse.
+        CriticalSection loadLock;
+        std::map<String, std::weak_ptr<SfzInstrument>> instruments;
+
+        CriticalSection lock;
+        Array<fluid_sfont_t*> instances;
+    };
+
+    Cache& getCache()
+    {
+        static Cache cache;
+        return cache;
+    }
+
+    String makeKey(const File& file)
+    {
+        return file.getFullPathName() + "|" + String(file.getSize()) + "|" + String(file.getLastModificationTime().toMilliseconds());
+    }
+
+    std::shared_ptr<SfzInstrument> acquire(const File& file, SoundfontStream::LoadProgress* progress)
+    {
+        auto& cache = getCache();
+        const ScopedLock sl(cache.loadLock);
+
+        auto& entry = cache.instruments[makeKey(file)];
+
+        if (auto instrument = entry.lock())
+            return instrument;
+
+        std::shared_ptr<SfzInstrument> instrument = SfzInstrument::load(file, progress);
+        entry = instrument;
+
+        return instrument;
+    }
+
+    // Each synth gets its own sfont, preset and samples over the shared
+    // instrument, as samples carry per-synth voice reference counts.
+    struct InstanceFont
+    {
+        std::shared_ptr<SfzInstrument> instrument;
+        String name;
+        fluid_sfont_t* sfont = nullptr;
+        fluid_preset_t* preset = nullptr;
+        bool iterated = false;
+
+        // Two for each of the instrument's samples, the second only for stereo
+        // ones. Until a sample is resident its voices play the head samples,
+        // which end where its decoded data does.
+        Array<fluid_sample_t*> samples;
+        Array<fluid_sample_t*> headSamples;
+
+        // Only used on the audio thread, for the regions' random ranges.
+        Random random;
+    };
+
+    InstanceFont& getFontData(fluid_sfont_t* sfont)
+    {
+        return *static_cast<InstanceFont*>(fluid_sfont_get_data(sfont));
+    }
+
+    InstanceFont& getPresetFont(fluid_preset_t* preset)
+    {
+        return *static_cast<InstanceFont*>(fluid_preset_get_data(preset));
+    }
+
+    const char* getPresetName(fluid_preset_t* preset)
+    {
+        return getPresetFont(preset).instrument->getName().toRawUTF8();
+    }
+
+    int getPresetBank(fluid_preset_t*)
+    {
+        return 0;
+    }
+
+    int getPresetNumber(fluid_preset_t*)
+    {
+        return 0;
+    }
+
+    // Called on the audio thread.
+    int presetNoteOn(fluid_preset_t* preset, fluid_synth_t* synth, int chan, int key, int vel)
+    {
+        auto& font = getPresetFont(preset);
+        auto& instrument = *font.instrument;
+        auto& regions = instrument.getRegions();
+        auto& samples = instrument.getSamples();
+
+        const float random = font.random.nextFloat();
+        int numEntries = 0;
+        auto* entries = instrument.getRegionsForKey(key, numEntries);
+
+        for (int i = 0; i < numEntries; ++i)
+        {
+            if (vel < entries[i].velLo || vel > entries[i].velHi)
+                continue;
+
+            auto& region = regions.getReference(entries[i].region);
+
+            if (random < region.randLo || random >= region.randHi)
+                continue;
+
+            instrument.requestSample(region.sample);
+
+            auto& info = *samples.getUnchecked(region.sample);
+            auto& played = info.resident ? font.samples : font.headSamples;
+
+            for (int channel = 0; channel < info.numChannels; ++channel)
+            {
+                auto* voice = fluid_synth_alloc_voice(synth, played[region.sample * 2 + channel], chan, key, vel);
+
+                if (voice == nullptr)
+                    return FLUID_FAILED;
+
+                for (auto& gen : region.generators)
+                    fluid_voice_gen_set(voice, gen.type, gen.value);
+
+                // Stereo samples play as two voices panned apart, like an SF2 stereo pair.
+                if (info.numChannels == 2)
+                    fluid_voice_gen_incr(voice, GEN_PAN, channel == 0 ? -500.0f : 500.0f);
+
+                fluid_synth_start_voice(synth, voice);
+            }
+        }
+
+        return FLUID_OK;
+    }
+
+    void freePreset(fluid_preset_t* preset)
+    {
+        delete_fluid_preset(preset);
+    }
+
+    const char* getFontName(fluid_sfont_t* sfont)
+    {
+        return getFontData(sfont).name.toRawUTF8();
+    }
+
+    // Every bank and program plays the instrument, drum channels included.
+    fluid_preset_t* getFontPreset(fluid_sfont_t* sfont, int, int)
+    {
+        return getFontData(sfont).preset;
+    }
+
+    void startFontIteration(fluid_sfont_t* sfont)
+    {
+        getFontData(sfont).iterated = false;
+    }
+
+    fluid_preset_t* nextFontPreset(fluid_sfont_t* sfont)
+    {
+        auto& font = getFontData(sfont);
+
+        if (font.iterated)
+            return nullptr;
+
+        font.iterated = true;
+        return font.preset;
+    }
+
+    int freeFont(fluid_sfont_t* sfont)
+    {
+        auto* font = &getFontData(sfont);
+
+        {
+            auto& cache = getCache();
+            const ScopedLock sl(cache.lock);
+            cache.instances.removeFirstMatchingValue(sfont);
+        }
+
+        freePreset(font->preset);
+
+        for (auto* sample : font->samples)
+            if (sample != nullptr)
+                delete_fluid_sample(sample);
+
+        for (auto* sample : font->headSamples)
+            if (sample != nullptr)
+                delete_fluid_sample(sample);
+
+        delete_fluid_sfont(sfont);
+        delete font;
+
+        return 0;
+    }
+
+    // The whole sample, or only its first numFrames.
+    fluid_sample_t* createSample(const SfzInstrument::Sample& info, int channel, int64 numFrames)
+    {
+        auto* sample = new_fluid_sample();
+        fluid_sample_set_name(sample, info.file.getFileNameWithoutExtension().toRawUTF8());
+        fluid_sample_set_sound_data(sample, info.data[channel].get(), info.data24[channel].get(),
+                                    (unsigned int)numFrames, (unsigned int)info.sampleRate, 0);
+        fluid_sample_set_loop(sample, (unsigned int)jmin(info.loopStart, numFrames), (unsigned int)jmin(info.loopEnd, numFrames));
+
+        // Regions set their own root key.
+        fluid_sample_set_pitch(sample, 60, 0);
+
+        // Reads the whole sample, which a head sample's tail may still be written to.
+        if (numFrames == info.numFrames && info.resident)
+            fluid_voice_optimize_sample(sample);
+
+        return sample;
+    }
+
+    void freeLoader(fluid_sfloader_t* loader)
+    {
+        delete_fluid_sfloader(loader);
+    }
+
+    fluid_sfont_t* loadFont(fluid_sfloader_t*, const char* filename)
+    {
+        File file(SoundfontStream::fromStreamPath(String(CharPointer_UTF8(filename))));
+
+        if (!file.hasFileExtension("sfz") || !file.existsAsFile())
+            return nullptr;
+
+        auto instrument = acquire(file, SoundfontStream::getCurrentLoadProgress());
+
+        if (instrument == nullptr)
+            return nullptr;
+
+        auto* font = new InstanceFont();
+        font->instrument = instrument;
+        font->name = String(CharPointer_UTF8(filename));
+
+        for (auto* info : instrument->getSamples())
+        {
+            for (int channel = 0; channel < 2; ++channel)
+            {
+                const bool used = info->numFrames > 0 && channel < info->numChannels;
+                font->samples.add(used ? createSample(*info, channel, info->numFrames) : nullptr);
+                font->headSamples.add(used && !info->resident ? createSample(*info, channel, info->headFrames) : nullptr);
+            }
+        }
+
+        font->sfont = new_fluid_sfont(getFontName, getFontPreset, startFontIteration, nextFontPreset, freeFont);
+        fluid_sfont_set_data(font->sfont, font);
+
+        font->preset = new_fluid_preset(font->sfont, getPresetName, getPresetBank, getPresetNumber, presetNoteOn, freePreset);
+        fluid_preset_set_data(font->preset, font);
+
+        {
+            auto& cache = getCache();
+            const ScopedLock sl(cache.lock);
+            cache.instances.add(font->sfont);
+        }
+
+        return font->sfont;
+    }
+}
+
+fluid_sfloader_t* SfzLoader::createLoader()
+{
+    return new_fluid_sfloader(loadFont, freeLoader);
+}
+
+const SfzInstrument* SfzLoader::getInstrument(fluid_sfont_t* sfont)
+{
+    auto& cache = getCache();
+    const ScopedLock sl(cache.lock);
+
+    return cache.instances.contains(sfont) ? getFontData(sfont).instrument.get() : nullptr;
+}
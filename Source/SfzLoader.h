@@ -0,0 +1,23 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+using namespace juce;
+
+class SfzInstrument;
+
+// Plays SFZ instruments through FluidSynth, each as a soundfont with a single
+// preset that answers every bank and program. Instruments are parsed once per
+// process and shared by every synth playing the same file.
+class SfzLoader
+{
+public:
+    // A loader for fluid_synth_add_sfloader() that takes .sfz files and
+    // leaves anything else to the next loader.
+    static fluid_sfloader_t* createLoader();
+
+    // The instrument behind a soundfont from this loader, nullptr for any other.
+    static const SfzInstrument* getInstrument(fluid_sfont_t* sfont);
+};
@@ -0,0 +1,1158 @@
+#include "SharedSoundfont.h"
+#include "DecodedSampleCache.h"
+
+#if JUCE_WINDOWS
+ #include <windows.h>
+ #include <psapi.h>
+#else
+ #include <sys/mman.h>
+ #include <unistd.h>
+#endif
+
+namespace
+{
+    const int readChunkSize = 1 << 20;
+    const int pageSize = 4096;
+    const uint32 residencyCheckIntervalMs = 1000;
+
+    const int phdrSize = 38;
+    const int bagSize = 4;
+    const int modSize = 10;
+    const int genSize = 4;
+    const int instSize = 22;
+    const int shdrSize = 46;
+
+    // Last generator defined by the SoundFont 2.04 specification.
+    const int lastSoundfontGenerator = GEN_OVERRIDEROOTKEY;
+
+    struct Chunk
+    {
+        char id[4];
+        uint32 size;
+        int64 position;
+
+        bool is(const char* name) const { return memcmp(id, name, 4) == 0; }
+        int64 getEnd() const { return position + size + (size & 1); }
+    };
+
+    bool readChunk(InputStream& in, Chunk& chunk)
+    {
+        if (in.read(chunk.id, 4) != 4)
+            return false;
+
+        chunk.size = (uint32)in.readInt();
+        chunk.position = in.getPosition();
+
+        return true;
+    }
+
+    // Reads in bounded chunks so that the load can report progress and be cancelled.
+    bool readSampleData(InputStream& in, void* buffer, int64 bytes, SoundfontStream::LoadProgress* progress)
+    {
+        auto* dest = static_cast<char*>(buffer);
+
+        while (bytes > 0)
+        {
+            if (progress != nullptr && progress->cancelled)
+                return false;
+
+            int chunk = (int)jmin<int64>(bytes, readChunkSize);
+
+            if (in.read(dest, chunk) != chunk)
+                return false;
+
+            dest += chunk;
+            bytes -= chunk;
+
+            if (progress != nullptr)
+                progress->progress = (double)in.getPosition() / (double)in.getTotalLength();
+        }
+
+        return true;
+    }
+
+    // Touches every page of a mapped range on the loading thread, so that the
+    // audio thread doesn't take the page faults when a note first plays.
+    // The pages stay in the OS file cache, shared with any other process that
+    // maps the same file, and can be evicted again under memory pressure.
+    bool prefault(const void* data, int64 bytes, SoundfontStream::LoadProgress* progress)
+    {
+        auto* bytesToTouch = static_cast<const volatile char*>(data);
+        char sum = 0;
+
+        for (int64 offset = 0; offset < bytes; offset += pageSize)
+        {
+            if (offset % readChunkSize == 0)
+            {
+                if (progress != nullptr && progress->cancelled)
+                    return false;
+
+                if (progress != nullptr)
+                    progress->progress = (double)offset / (double)bytes;
+            }
+
+            sum += bytesToTouch[offset];
+        }
+
+        if (bytes > 0)
+            sum += bytesToTouch[bytes - 1];
+
+        ignoreUnused(sum);
+        return true;
+    }
+
+    pointer_sized_uint getSystemPageSize()
+    {
+#if JUCE_WINDOWS
+        return pageSize;
+#else
+        static const pointer_sized_uint systemPageSize = (pointer_sized_uint)sysconf(_SC_PAGESIZE);
+        return systemPageSize;
+#endif
+    }
+
+    // The system pages a range touches, or only those wholly inside it.
+    void getPages(const void* data, int64 bytes, bool wholePagesOnly, pointer_sized_uint& begin, pointer_sized_uint& end)
+    {
+        const auto systemPageSize = getSystemPageSize();
+        const auto address = (pointer_sized_uint)data;
+        const auto rounding = wholePagesOnly ? systemPageSize - 1 : 0;
+
+        begin = (address + rounding) & ~(systemPageSize - 1);
+        end = (address + (pointer_sized_uint)bytes + systemPageSize - 1 - rounding) & ~(systemPageSize - 1);
+    }
+
+#if JUCE_WINDOWS
+    // Locked pages count against the process's minimum working set, which
+    // starts out at a few hundred KB. It is grown as locks need it and shrunk
+    // back by no more than it was grown.
+    bool growWorkingSet(int64 bytes)
+    {
+        static CriticalSection workingSetLock;
+        static int64 grownBy = 0;
+
+        const ScopedLock sl(workingSetLock);
+
+        if (bytes < 0)
+            bytes = -jmin(-bytes, grownBy);
+
+        SIZE_T minimum, maximum;
+        auto process = GetCurrentProcess();
+
+        if (bytes == 0 || !GetProcessWorkingSetSize(process, &minimum, &maximum))
+            return false;
+
+        const auto newMinimum = (SIZE_T)((int64)minimum + bytes);
+
+        if (!SetProcessWorkingSetSize(process, newMinimum, jmax(maximum, newMinimum + (SIZE_T)(pageSize * 16))))
+            return false;
+
+        grownBy += bytes;
+        return true;
+    }
+#endif
+
+    // Pages in a mapped range and keeps it in memory until unlocked, so that
+    // the OS can't evict it again under memory pressure. Past the process's
+    // lock limit the range is only paged in, and false is returned.
+    bool lock(const void* data, int64 bytes)
+    {
+        pointer_sized_uint begin, end;
+        getPages(data, bytes, false, begin, end);
+
+        if (end <= begin)
+            return true;
+
+#if JUCE_WINDOWS
+        if (VirtualLock((void*)begin, (SIZE_T)(end - begin)))
+            return true;
+
+        if (GetLastError() == ERROR_WORKING_SET_QUOTA && growWorkingSet((int64)(end - begin))
+            && VirtualLock((void*)begin, (SIZE_T)(end - begin)))
+            return true;
+#else
+        if (mlock((void*)begin, (size_t)(end - begin)) == 0)
+            return true;
+#endif
+
+        prefault(data, bytes, nullptr);
+        return false;
+    }
+
+    // Unlocks the whole pages inside a mapped range and drops them from the
+    // process's memory.
+    void unlockAndRelease(const void* data, int64 bytes)
+    {
+        pointer_sized_uint begin, end;
+        getPages(data, bytes, true, begin, end);
+
+        if (end <= begin)
+            return;
+
+#if JUCE_WINDOWS
+        // The first call unlocks the pages, the second takes them out of the
+        // working set, which unlocking pages that aren't locked does.
+        if (VirtualUnlock((void*)begin, (SIZE_T)(end - begin)))
+            growWorkingSet(-(int64)(end - begin));
+
+        VirtualUnlock((void*)begin, (SIZE_T)(end - begin));
+#else
+        munlock((void*)begin, (size_t)(end - begin));
+        madvise((void*)begin, (size_t)(end - begin), MADV_DONTNEED);
+#endif
+    }
+
+    // Bytes of the pages a mapped range touches that are in physical memory,
+    // asked of the OS a batch of pages at a time.
+    int64 countResidentBytes(const void* data, int64 bytes)
+    {
+        const int pagesPerQuery = 4096;
+        const auto systemPageSize = getSystemPageSize();
+
+        pointer_sized_uint begin, end;
+        getPages(data, bytes, false, begin, end);
+
+#if JUCE_WINDOWS
+        HeapBlock<PSAPI_WORKING_SET_EX_INFORMATION> pages(pagesPerQuery);
+#else
+        HeapBlock<unsigned char> pages(pagesPerQuery);
+#endif
+
+        int64 resident = 0;
+
+        for (auto address = begin; address < end; address += systemPageSize * pagesPerQuery)
+        {
+            const int count = (int)jmin<pointer_sized_uint>(pagesPerQuery, (end - address) / systemPageSize);
+
+#if JUCE_WINDOWS
+            for (int i = 0; i < count; ++i)
+                pages[i].VirtualAddress = (void*)(address + (pointer_sized_uint)i * systemPageSize);
+
+            if (!QueryWorkingSetEx(GetCurrentProcess(), pages.get(), (DWORD)(sizeof(PSAPI_WORKING_SET_EX_INFORMATION) * count)))
+                return 0;
+
+            for (int i = 0; i < count; ++i)
+                if (pages[i].VirtualAttributes.Valid)
+                    resident += (int64)systemPageSize;
+#else
+           #if JUCE_MAC || JUCE_IOS
+            if (mincore((void*)address, (size_t)count * systemPageSize, reinterpret_cast<char*>(pages.get())) != 0)
+           #else
+            if (mincore((void*)address, (size_t)count * systemPageSize, pages.get()) != 0)
+           #endif
+                return 0;
+
+            for (int i = 0; i < count; ++i)
+                if ((pages[i] & 1) != 0)
+                    resident += (int64)systemPageSize;
+#endif
+        }
+
+        return resident;
+    }
+
+    struct Records
+    {
+        const uint8* data = nullptr;
+        int count = 0;
+        int recordSize = 1;
+
+        const uint8* operator[](int index) const { return data + (size_t)index * recordSize; }
+    };
+
+    uint16 readWord(const uint8* p)
+    {
+        return ByteOrder::littleEndianShort(p);
+    }
+
+    uint32 readDWord(const uint8* p)
+    {
+        return ByteOrder::littleEndianInt(p);
+    }
+
+    String readName(const uint8* p)
+    {
+        char name[21] = {};
+
+        for (int i = 0; i < 20 && p[i] != 0; ++i)
+            name[i] = p[i] < 128 ? (char)p[i] : '?';
+
+        return String(name);
+    }
+
+    // Preset level generators that only make sense on instruments, the
+    // specification says to ignore them (SF 2.04, section 8.5).
+    bool isInstrumentOnlyGenerator(int gen)
+    {
+        switch (gen)
+        {
+        case GEN_STARTADDROFS:
+        case GEN_ENDADDROFS:
+        case GEN_STARTLOOPADDROFS:
+        case GEN_ENDLOOPADDROFS:
+        case GEN_STARTADDRCOARSEOFS:
+        case GEN_ENDADDRCOARSEOFS:
+        case GEN_STARTLOOPADDRCOARSEOFS:
+        case GEN_ENDLOOPADDRCOARSEOFS:
+        case GEN_KEYNUM:
+        case GEN_VELOCITY:
+        case GEN_SAMPLEMODE:
+        case GEN_EXCLUSIVECLASS:
+        case GEN_OVERRIDEROOTKEY:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Unused and reserved generators, which the specification says to
+    // ignore (SF 2.04, section 8.1.3). FluidSynth's own loader drops them
+    // too, and TuningWorker keeps each voice's tuning in one of them.
+    bool isUnusedGenerator(int gen)
+    {
+        switch (gen)
+        {
+        case GEN_UNUSED1:
+        case GEN_UNUSED2:
+        case GEN_UNUSED3:
+        case GEN_UNUSED4:
+        case GEN_RESERVED1:
+        case GEN_RESERVED2:
+        case GEN_RESERVED3:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Linked modulators, which feed other modulators instead of generators
+    // (SF 2.04, section 9.5.4), and transforms other than linear. Zones here
+    // can't express them.
+    bool hasUnsupportedModulators(const Records& mods)
+    {
+        // The last record is the terminal one.
+        for (int i = 0; i < mods.count - 1; ++i)
+        {
+            auto* rec = mods[i];
+            const bool linkedSource = (readWord(rec) & 0xFF) == 127 || (readWord(rec + 6) & 0xFF) == 127;
+
+            if (linkedSource || (readWord(rec + 2) & 0x8000) != 0 || readWord(rec + 8) != 0)
+                return true;
+        }
+
+        return false;
+    }
+
+    // Converts an SF2 modulator source operator into FluidSynth flags.
+    bool toModulatorSource(uint16 oper, int& index, int& flags)
+    {
+        index = oper & 127;
+        flags = (oper & (1 << 7)) ? FLUID_MOD_CC : FLUID_MOD_GC;
+
+        if (oper & (1 << 8))
+            flags |= FLUID_MOD_NEGATIVE;
+
+        if (oper & (1 << 9))
+            flags |= FLUID_MOD_BIPOLAR;
+
+        switch (oper >> 10)
+        {
+        case 0: flags |= FLUID_MOD_LINEAR; break;
+        case 1: flags |= FLUID_MOD_CONCAVE; break;
+        case 2: flags |= FLUID_MOD_CONVEX; break;
+        case 3: flags |= FLUID_MOD_SWITCH; break;
+        default: return false;
+        }
+
+        if (flags & FLUID_MOD_CC)
+            return !(index == 0 || index == 6 || (index >= 32 && index <= 63)
+                     || (index >= 98 && index <= 101) || index >= 120);
+
+        switch (index)
+        {
+        case FLUID_MOD_NONE:
+        case FLUID_MOD_VELOCITY:
+        case FLUID_MOD_KEY:
+        case FLUID_MOD_KEYPRESSURE:
+        case FLUID_MOD_CHANNELPRESSURE:
+        case FLUID_MOD_PITCHWHEEL:
+        case FLUID_MOD_PITCHWHEELSENS:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    struct RawZone
+    {
+        bool hasKeyRange = false, hasVelRange = false;
+        int keyLo = 0, keyHi = 127, velLo = 0, velHi = 127;
+        int index = -1;
+        bool isSet[lastSoundfontGenerator + 1] = {};
+        float values[lastSoundfontGenerator + 1] = {};
+        Array<fluid_mod_t*> modulators;
+    };
+
+    void readRawZone(RawZone& zone, int bag, const Records& bags, const Records& gens, const Records& mods,
+                     bool presetLevel, Array<fluid_mod_t*>& ownedModulators)
+    {
+        const int indexGen = presetLevel ? GEN_INSTRUMENT : GEN_SAMPLEID;
+
+        int genBegin = readWord(bags[bag]);
+        int genEnd = jmin((int)readWord(bags[bag + 1]), gens.count);
+        int modBegin = readWord(bags[bag] + 2);
+        int modEnd = jmin((int)readWord(bags[bag + 1] + 2), mods.count);
+
+        for (int i = genBegin; i < genEnd; ++i)
+        {
+            auto* rec = gens[i];
+            int oper = readWord(rec);
+
+            if (oper == GEN_KEYRANGE)
+            {
+                zone.hasKeyRange = true;
+                zone.keyLo = rec[2];
+                zone.keyHi = rec[3];
+            }
+            else if (oper == GEN_VELRANGE)
+            {
+                zone.hasVelRange = true;
+                zone.velLo = rec[2];
+                zone.velHi = rec[3];
+            }
+            else if (oper == indexGen)
+            {
+                // Always the last generator of a zone.
+                zone.index = readWord(rec + 2);
+                break;
+            }
+            else if (oper <= lastSoundfontGenerator && oper != GEN_INSTRUMENT && oper != GEN_SAMPLEID && !isUnusedGenerator(oper)
+                     && !(presetLevel && isInstrumentOnlyGenerator(oper)))
+            {
+                zone.isSet[oper] = true;
+                zone.values[oper] = (float)(int16)readWord(rec + 2);
+            }
+        }
+
+        for (int i = modBegin; i < modEnd; ++i)
+        {
+            auto* rec = mods[i];
+            uint16 dest = readWord(rec + 2);
+            int16 amount = (int16)readWord(rec + 4);
+            uint16 transform = readWord(rec + 8);
+
+            int src1, flags1, src2, flags2;
+
+            // Fonts with linked modulators or non-linear transforms never get
+            // here, see SharedSoundfont::load().
+            if ((dest & 0x8000) != 0 || dest > lastSoundfontGenerator || transform != 0)
+                continue;
+
+            if (!toModulatorSource(readWord(rec), src1, flags1)
+                || !toModulatorSource(readWord(rec + 6), src2, flags2)
+                || (src1 == FLUID_MOD_NONE && (flags1 & FLUID_MOD_CC) == 0))
+                continue;
+
+            auto* mod = new_fluid_mod();
+            fluid_mod_set_source1(mod, src1, flags1);
+            fluid_mod_set_source2(mod, src2, flags2);
+            fluid_mod_set_dest(mod, dest);
+            fluid_mod_set_amount(mod, amount);
+
+            bool duplicate = false;
+
+            for (auto* other : zone.modulators)
+                duplicate = duplicate || fluid_mod_test_identity(mod, other);
+
+            if (duplicate)
+            {
+                delete_fluid_mod(mod);
+                continue;
+            }
+
+            ownedModulators.add(mod);
+            zone.modulators.add(mod);
+        }
+    }
+
+    // Reads the zones in [firstBag, endBag) and merges the global zone, if
+    // there is one, into each of the others.
+    void readZones(Array<SharedSoundfont::Zone>& zones, int firstBag, int endBag, int indexLimit,
+                   const Records& bags, const Records& gens, const Records& mods,
+                   bool presetLevel, Array<fluid_mod_t*>& ownedModulators)
+    {
+        endBag = jmin(endBag, bags.count - 1);
+
+        RawZone global;
+        bool hasGlobal = false;
+
+        for (int bag = firstBag; bag < endBag; ++bag)
+        {
+            RawZone local;
+            readRawZone(local, bag, bags, gens, mods, presetLevel, ownedModulators);
+
+            if (local.index < 0)
+            {
+                if (bag == firstBag)
+                {
+                    global = local;
+                    hasGlobal = true;
+                }
+
+                continue;
+            }
+
+            if (local.index >= indexLimit)
+                continue;
+
+            SharedSoundfont::Zone zone;
+            zone.index = local.index;
+
+            const RawZone& keySource = (local.hasKeyRange || !hasGlobal) ? local : global;
+            zone.keyLo = keySource.keyLo;
+            zone.keyHi = keySource.keyHi;
+
+            const RawZone& velSource = (local.hasVelRange || !hasGlobal) ? local : global;
+            zone.velLo = velSource.velLo;
+            zone.velHi = velSource.velHi;
+
+            for (int gen = 0; gen <= lastSoundfontGenerator; ++gen)
+            {
+                if (local.isSet[gen])
+                    zone.generators.add({ gen, local.values[gen] });
+                else if (hasGlobal && global.isSet[gen])
+                    zone.generators.add({ gen, global.values[gen] });
+            }
+
+            // Local modulators override identical global ones.
+            zone.modulators = local.modulators;
+
+            for (auto* mod : global.modulators)
+            {
+                bool overridden = false;
+
+                for (auto* other : local.modulators)
+                    overridden = overridden || fluid_mod_test_identity(mod, other);
+
+                if (!overridden)
+                    zone.modulators.add(mod);
+            }
+
+            zones.add(zone);
+        }
+    }
+}
+
+SharedSoundfont::SharedSoundfont()
+    : sampleData(nullptr)
+    , sampleData24(nullptr)
+    , numSamplePoints(0)
+    , sampleChunkBytes(0)
+    , hasCompressedSamples(false)
+    , hasUnsupportedModulators(false)
+    , samplePosition(-1)
+    , samplePosition24(-1)
+    , lockedProgramBytes(0)
+    , programLockFailures(0)
+    , mappedResidentBytes(0)
+    , lastResidencyCheck(0)
+{
+}
+
+SharedSoundfont::~SharedSoundfont()
+{
+    for (auto* mod : modulators)
+        delete_fluid_mod(mod);
+}
+
+std::unique_ptr<SharedSoundfont> SharedSoundfont::loadHeaders(const File& file)
+{
+    FileInputStream in(file);
+
+    if (in.failedToOpen())
+        return nullptr;
+
+    Chunk riff;
+    char form[4];
+
+    if (!readChunk(in, riff) || !riff.is("RIFF") || in.read(form, 4) != 4 || memcmp(form, "sfbk", 4) != 0)
+        return nullptr;
+
+    const int64 riffEnd = jmin(riff.getEnd(), in.getTotalLength());
+
+    int versionMajor = 0, versionMinor = 0;
+    Chunk smpl {}, sm24 {};
+    bool hasSampleData = false, hasSampleData24 = false;
+    MemoryBlock pdta;
+
+    while (in.getPosition() + 12 <= riffEnd)
+    {
+        Chunk list;
+        char type[4];
+
+        if (!readChunk(in, list) || in.read(type, 4) != 4)
+            return nullptr;
+
+        const int64 listEnd = jmin(list.getEnd(), riffEnd);
+
+        if (list.is("LIST") && memcmp(type, "pdta", 4) == 0)
+        {
+            pdta.setSize((size_t)(listEnd - in.getPosition()));
+
+            if (in.read(pdta.getData(), (int)pdta.getSize()) != (int)pdta.getSize())
+                return nullptr;
+        }
+        else if (list.is("LIST"))
+        {
+            Chunk sub;
+
+            while (in.getPosition() + 8 <= listEnd && readChunk(in, sub))
+            {
+                if (memcmp(type, "INFO", 4) == 0 && sub.is("ifil") && sub.size >= 4)
+                {
+                    versionMajor = in.readShort();
+                    versionMinor = in.readShort();
+                }
+                else if (memcmp(type, "sdta", 4) == 0 && sub.is("smpl"))
+                {
+                    smpl = sub;
+                    hasSampleData = sub.getEnd() <= listEnd + 1;
+                }
+                else if (memcmp(type, "sdta", 4) == 0 && sub.is("sm24"))
+                {
+                    sm24 = sub;
+                    hasSampleData24 = sub.getEnd() <= listEnd + 1;
+                }
+
+                in.setPosition(sub.getEnd());
+            }
+        }
+
+        in.setPosition(listEnd);
+    }
+
+    // SF3 files are SF2 files with Ogg Vorbis compressed samples.
+    if ((versionMajor != 2 && versionMajor != 3) || !hasSampleData || pdta.isEmpty())
+        return nullptr;
+
+    std::unique_ptr<SharedSoundfont> font(new SharedSoundfont());
+    font->numSamplePoints = smpl.size / 2;
+    font->sampleChunkBytes = smpl.size;
+    font->samplePosition = smpl.position;
+
+    // The 24 bit extension is only defined from version 2.04 on.
+    if (hasSampleData24 && versionMinor >= 4 && sm24.size >= font->numSamplePoints)
+        font->samplePosition24 = sm24.position;
+
+    if (!font->parsePresetData(pdta))
+        return nullptr;
+
+    return font;
+}
+
+std::unique_ptr<SharedSoundfont> SharedSoundfont::load(const File& file, SoundfontStream::LoadProgress* progress)
+{
+    auto font = loadHeaders(file);
+
+    // FluidSynth's own loader plays fonts with modulators that can't be
+    // shared, rather than this one playing them differently.
+    if (font == nullptr || font->hasUnsupportedModulators)
+        return nullptr;
+
+    if (font->hasCompressedSamples)
+    {
+        if (!font->decodeSamples(file, progress))
+            return nullptr;
+
+        return font;
+    }
+
+    const int64 sampleBytes = (int64)font->numSamplePoints * 2;
+    const bool use24Bit = font->samplePosition24 >= 0;
+
+    // Play straight from a mapped view of the file where possible. The sample
+    // data is then paged in by the OS rather than copied, and the mapping is
+    // backed by the file instead of the page file.
+    font->mappedFile = std::make_unique<MemoryMappedFile>(file, MemoryMappedFile::readOnly);
+    auto* mapped = static_cast<const char*>(font->mappedFile->getData());
+
+    if (mapped != nullptr && (int64)font->mappedFile->getSize() >= font->samplePosition + sampleBytes
+        && (!use24Bit || (int64)font->mappedFile->getSize() >= font->samplePosition24 + (int64)font->numSamplePoints))
+    {
+        // SF2 sample data is little endian, the same as every platform we build for.
+        font->sampleData = reinterpret_cast<const short*>(mapped + font->samplePosition);
+        font->sampleData24 = use24Bit ? mapped + font->samplePosition24 : nullptr;
+
+        return font;
+    }
+
+    font->mappedFile.reset();
+
+    FileInputStream in(file);
+
+    if (in.failedToOpen())
+        return nullptr;
+
+    // Mapping a pool that doesn't fit the address space fails, and so does this.
+    auto doesNotFit = [&]() {
+        if (progress != nullptr)
+            progress->error << "The " << String((double)font->getSampleDataBytes() / (1024.0 * 1024.0), 0)
+                            << " MB of sample data don't fit into the memory of a "
+                            << (sizeof(void*) == 4 ? "32" : "64") << " bit host";
+
+        return nullptr;
+    };
+
+    font->heapSampleData.malloc(font->numSamplePoints);
+    font->sampleData = font->heapSampleData.get();
+
+    if (font->sampleData == nullptr)
+        return doesNotFit();
+
+    in.setPosition(font->samplePosition);
+
+    if (!readSampleData(in, font->heapSampleData.get(), sampleBytes, progress))
+        return nullptr;
+
+    if (use24Bit)
+    {
+        font->heapSampleData24.malloc(font->numSamplePoints);
+        font->sampleData24 = font->heapSampleData24.get();
+
+        if (font->sampleData24 == nullptr)
+            return doesNotFit();
+
+        in.setPosition(font->samplePosition24);
+
+        if (!readSampleData(in, font->heapSampleData24.get(), (int64)font->numSamplePoints, progress))
+            return nullptr;
+    }
+
+    return font;
+}
+
+bool SharedSoundfont::decodeSamples(const File& file, SoundfontStream::LoadProgress* progress)
+{
+    MemoryMappedFile source(file, MemoryMappedFile::readOnly);
+    auto* chunk = static_cast<const char*>(source.getData());
+    MemoryBlock chunkCopy;
+
+    if (chunk != nullptr && (int64)source.getSize() >= samplePosition + sampleChunkBytes)
+    {
+        chunk += samplePosition;
+    }
+    else
+    {
+        FileInputStream in(file);
+
+        if (in.failedToOpen())
+            return false;
+
+        chunkCopy.setSize((size_t)sampleChunkBytes);
+        in.setPosition(samplePosition);
+
+        if (!readSampleData(in, chunkCopy.getData(), sampleChunkBytes, progress))
+            return false;
+
+        chunk = static_cast<const char*>(chunkCopy.getData());
+    }
+
+    DecodedSampleCache::Pool pool;
+
+    if (!DecodedSampleCache::load(file, chunk, sampleChunkBytes, samples, pool, progress))
+        return false;
+
+    mappedFile = std::move(pool.mappedFile);
+    heapSampleData = std::move(pool.heapData);
+    sampleData = pool.data;
+    numSamplePoints = pool.numPoints;
+
+    // Decoded samples are 16 bit.
+    samplePosition24 = -1;
+
+    return true;
+}
+
+bool SharedSoundfont::parsePresetData(const MemoryBlock& pdta)
+{
+    Records phdr, pbag, pmod, pgen, inst, ibag, imod, igen, shdr;
+
+    struct { const char* id; Records* records; int recordSize; } subchunks[] = {
+        { "phdr", &phdr, phdrSize }, { "pbag", &pbag, bagSize }, { "pmod", &pmod, modSize },
+        { "pgen", &pgen, genSize }, { "inst", &inst, instSize }, { "ibag", &ibag, bagSize },
+        { "imod", &imod, modSize }, { "igen", &igen, genSize }, { "shdr", &shdr, shdrSize }
+    };
+
+    auto* data = static_cast<const uint8*>(pdta.getData());
+    const size_t size = pdta.getSize();
+    size_t pos = 0;
+
+    while (pos + 8 <= size)
+    {
+        uint32 length = readDWord(data + pos + 4);
+
+        if (pos + 8 + length > size)
+            return false;
+
+        for (auto& sub : subchunks)
+        {
+            if (memcmp(data + pos, sub.id, 4) == 0)
+            {
+                sub.records->data = data + pos + 8;
+                sub.records->count = (int)(length / (uint32)sub.recordSize);
+                sub.records->recordSize = sub.recordSize;
+            }
+        }
+
+        pos += 8 + length + (length & 1);
+    }
+
+    // Every list ends with a terminal record.
+    for (auto& sub : subchunks)
+        if (sub.records->count < 1)
+            return false;
+
+    hasUnsupportedModulators = ::hasUnsupportedModulators(pmod) || ::hasUnsupportedModulators(imod);
+
+    for (int i = 0; i < shdr.count - 1; ++i)
+    {
+        auto* rec = shdr[i];
+        int type = readWord(rec + 44);
+
+        Sample sample;
+        sample.name = readName(rec);
+        sample.compressed = (type & FLUID_SAMPLETYPE_OGG_VORBIS) != 0;
+        sample.start = readDWord(rec + 20);
+
+        // Compressed samples are byte ranges of the smpl chunk, see DecodedSampleCache.
+        sample.end = jmin(readDWord(rec + 24), sample.compressed ? (uint32)sampleChunkBytes : (uint32)numSamplePoints);
+        sample.loopStart = readDWord(rec + 28);
+        sample.loopEnd = readDWord(rec + 32);
+        sample.sampleRate = (int)readDWord(rec + 36);
+        sample.rootKey = rec[40] > 127 ? 60 : rec[40];
+        sample.fineTune = (int8)rec[41];
+        sample.rom = (type & FLUID_SAMPLETYPE_ROM) != 0;
+
+        hasCompressedSamples = hasCompressedSamples || sample.compressed;
+        samples.add(sample);
+    }
+
+    for (int i = 0; i < inst.count - 1; ++i)
+    {
+        Instrument instrument;
+        instrument.name = readName(inst[i]);
+
+        readZones(instrument.zones, readWord(inst[i] + 20), readWord(inst[i + 1] + 20), samples.size(),
+                  ibag, igen, imod, false, modulators);
+
+        instruments.add(instrument);
+    }
+
+    for (int i = 0; i < phdr.count - 1; ++i)
+    {
+        Preset preset;
+        preset.name = readName(phdr[i]);
+        preset.program = readWord(phdr[i] + 20);
+        preset.bank = readWord(phdr[i] + 22);
+
+        readZones(preset.zones, readWord(phdr[i] + 24), readWord(phdr[i + 1] + 24), instruments.size(),
+                  pbag, pgen, pmod, true, modulators);
+
+        presets.add(preset);
+    }
+
+    return true;
+}
+
+const Array<SharedSoundfont::Preset>& SharedSoundfont::getPresets() const
+{
+    return presets;
+}
+
+const Array<SharedSoundfont::Instrument>& SharedSoundfont::getInstruments() const
+{
+    return instruments;
+}
+
+const Array<SharedSoundfont::Sample>& SharedSoundfont::getSamples() const
+{
+    return samples;
+}
+
+const short* SharedSoundfont::getSampleData() const
+{
+    return sampleData;
+}
+
+const char* SharedSoundfont::getSampleData24() const
+{
+    return sampleData24;
+}
+
+size_t SharedSoundfont::getNumSamplePoints() const
+{
+    return numSamplePoints;
+}
+
+int64 SharedSoundfont::getResidentBytes() const
+{
+    if (mappedFile == nullptr)
+        return getSampleDataBytes();
+
+    const auto now = Time::getMillisecondCounter();
+
+    if (now - lastResidencyCheck.exchange(now) >= residencyCheckIntervalMs)
+    {
+        int64 bytes = countResidentBytes(sampleData, (int64)numSamplePoints * 2);
+
+        if (sampleData24 != nullptr)
+            bytes += countResidentBytes(sampleData24, (int64)numSamplePoints);
+
+        mappedResidentBytes = jmin(bytes, getSampleDataBytes());
+    }
+
+    return mappedResidentBytes;
+}
+
+int64 SharedSoundfont::getMappedBytes() const
+{
+    return mappedFile != nullptr ? getSampleDataBytes() : 0;
+}
+
+bool SharedSoundfont::isMapped() const
+{
+    return mappedFile != nullptr && sampleData != nullptr;
+}
+
+int64 SharedSoundfont::getSampleDataBytes() const
+{
+    int64 bytes = (int64)numSamplePoints * 2;
+
+    if (samplePosition24 >= 0)
+        bytes += (int64)numSamplePoints;
+
+    return bytes;
+}
+
+double SharedSoundfont::getMaxReleaseSeconds() const
+{
+    auto findGenerator = [](const Zone& zone, int type, float defaultValue) {
+        for (auto& gen : zone.generators)
+            if (gen.type == type)
+                return gen.value;
+
+        return defaultValue;
+    };
+
+    // Timecents, preset generators add to the instrument's.
+    float longest = -12000.0f;
+
+    for (auto& preset : presets)
+        for (auto& presetZone : preset.zones)
+            for (auto& instZone : instruments.getReference(presetZone.index).zones)
+                longest = jmax(longest, findGenerator(instZone, GEN_VOLENVRELEASE, -12000.0f)
+                                        + findGenerator(presetZone, GEN_VOLENVRELEASE, 0.0f));
+
+    // FluidSynth caps envelope stages at 8000 timecents, about 100 seconds.
+    return std::pow(2.0, jmin(longest, 8000.0f) / 1200.0);
+}
+
+void SharedSoundfont::prefaultPrograms(const Array<ProgramSelection>& programs) const
+{
+    if (mappedFile == nullptr || sampleData == nullptr)
+        return;
+
+    auto used = findUsedSamples(programs);
+
+    for (int i = 0; i < samples.size(); ++i)
+    {
+        auto& sample = samples.getReference(i);
+
+        if (!used[i] || sample.rom || sample.end <= sample.start)
+            continue;
+
+        prefault(sampleData + sample.start, (int64)(sample.end - sample.start) * 2, nullptr);
+
+        if (sampleData24 != nullptr)
+            prefault(sampleData24 + sample.start, (int64)(sample.end - sample.start), nullptr);
+    }
+}
+
+bool SharedSoundfont::lockPrograms(const Array<ProgramSelection>& programs) const
+{
+    if (mappedFile == nullptr || sampleData == nullptr)
+        return true;
+
+    auto used = findUsedSamples(programs);
+    const ScopedLock sl(sampleLockSection);
+    bool allLocked = true;
+
+    if (sampleLocks.size() < samples.size())
+        sampleLocks.insertMultiple(-1, { 0, false }, samples.size() - sampleLocks.size());
+
+    for (int i = 0; i < samples.size(); ++i)
+    {
+        auto& sample = samples.getReference(i);
+
+        if (!used[i] || sample.rom || sample.end <= sample.start)
+            continue;
+
+        auto& sampleLock = sampleLocks.getReference(i);
+
+        if (sampleLock.count++ > 0)
+            continue;
+
+        sampleLock.locked = lockRange(sample.start, sample.end);
+
+        if (sampleLock.locked)
+        {
+            lockedProgramBytes += (int64)(sample.end - sample.start) * (sampleData24 != nullptr ? 3 : 2);
+        }
+        else
+        {
+            ++programLockFailures;
+            allLocked = false;
+        }
+    }
+
+    return allLocked;
+}
+
+void SharedSoundfont::unlockPrograms(const Array<ProgramSelection>& programs) const
+{
+    if (mappedFile == nullptr || sampleData == nullptr)
+        return;
+
+    auto used = findUsedSamples(programs);
+    const ScopedLock sl(sampleLockSection);
+
+    for (int i = 0; i < jmin(samples.size(), sampleLocks.size()); ++i)
+    {
+        auto& sample = samples.getReference(i);
+        auto& sampleLock = sampleLocks.getReference(i);
+
+        if (!used[i] || sampleLock.count == 0 || --sampleLock.count > 0)
+            continue;
+
+        unlockRange(sample.start, sample.end);
+
+        if (sampleLock.locked)
+            lockedProgramBytes -= (int64)(sample.end - sample.start) * (sampleData24 != nullptr ? 3 : 2);
+
+        sampleLock.locked = false;
+    }
+}
+
+int64 SharedSoundfont::getLockedProgramBytes() const
+{
+    return lockedProgramBytes;
+}
+
+int64 SharedSoundfont::getProgramLockFailures() const
+{
+    return programLockFailures;
+}
+
+bool SharedSoundfont::lockRange(int64 start, int64 end) const
+{
+    return updateRangeLocks(start, end, true);
+}
+
+void SharedSoundfont::unlockRange(int64 start, int64 end) const
+{
+    updateRangeLocks(start, end, false);
+}
+
+// Counts the range from start to end in or out of the pages it touches.
+bool SharedSoundfont::updateRangeLocks(int64 start, int64 end, bool shouldLock) const
+{
+    if (mappedFile == nullptr || end <= start)
+        return true;
+
+    const ScopedLock sl(pageLockSection);
+    bool locked = updatePageLocks(sampleData + start, (end - start) * 2, shouldLock);
+
+    if (sampleData24 != nullptr)
+        locked = updatePageLocks(sampleData24 + start, end - start, shouldLock) && locked;
+
+    return locked;
+}
+
+bool SharedSoundfont::updatePageLocks(const void* data, int64 bytes, bool shouldLock) const
+{
+    const auto systemPageSize = getSystemPageSize();
+    const auto mapped = (pointer_sized_uint)mappedFile->getData();
+    const auto base = mapped & ~(systemPageSize - 1);
+
+    if (pageLocks == nullptr)
+        pageLocks.calloc((mapped + (pointer_sized_uint)mappedFile->getSize() - base + systemPageSize - 1) / systemPageSize);
+
+    pointer_sized_uint begin, end;
+    getPages(data, bytes, false, begin, end);
+
+    // Runs of pages that become used, or no longer are, are locked or
+    // unlocked in one go.
+    bool locked = true;
+    pointer_sized_uint runStart = 0;
+    bool inRun = false;
+
+    for (auto page = begin; page <= end; page += systemPageSize)
+    {
+        bool changes = false;
+
+        if (page < end)
+        {
+            auto& count = pageLocks[(page - base) / systemPageSize];
+
+            if (shouldLock)
+            {
+                jassert(count < 0xffff);
+                changes = count++ == 0;
+            }
+            else if (count > 0)
+            {
+                changes = --count == 0;
+            }
+        }
+
+        if (changes && !inRun)
+        {
+            runStart = page;
+            inRun = true;
+        }
+        else if (!changes && inRun)
+        {
+            if (shouldLock)
+                locked = lock((const void*)runStart, (int64)(page - runStart)) && locked;
+            else
+                unlockAndRelease((const void*)runStart, (int64)(page - runStart));
+
+            inRun = false;
+        }
+    }
+
+    return locked;
+}
+
+Array<bool> SharedSoundfont::findUsedSamples(const Array<ProgramSelection>& programs) const
+{
+    Array<bool> used;
+    used.insertMultiple(0, false, samples.size());
+
+    for (auto& preset : presets)
+    {
+        bool selected = false;
+
+        for (auto& selection : programs)
+            selected = selected || (selection.bank == preset.bank && selection.program == preset.program);
+
+        if (!selected)
+            continue;
+
+        for (auto& presetZone : preset.zones)
+            for (auto& instZone : instruments.getReference(presetZone.index).zones)
+                used.set(instZone.index, true);
+    }
+
+    return used;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "SoundfontStream.h"
+#include "ProgramUsage.h"
+
+using namespace juce;
+
+
+// An SF2 file parsed into an immutable form that any number of synths can
+// play from at once. Zones are stored with their global zone already merged
+// in, so a note-on only has to walk the matching zones and apply them.
+// The compressed samples of SF3 files are decoded into the same form, see
+// DecodedSampleCache.
+class SharedSoundfont
+{
+public:
+    struct Generator
+    {
+        int type;
+        float value;
+    };
+
+    struct Zone
+    {
+        int keyLo, keyHi, velLo, velHi;
+
+        // Instrument index for preset zones, sample index for instrument zones.
+        int index;
+
+        Array<Generator> generators;
+        Array<fluid_mod_t*> modulators;
+
+        bool contains(int key, int vel) const
+        {
+            return key >= keyLo && key <= keyHi && vel >= velLo && vel <= velHi;
+        }
+    };
+
+    struct Instrument
+    {
+        String name;
+        Array<Zone> zones;
+    };
+
+    struct Preset
+    {
+        String name;
+        int bank;
+        int program;
+        Array<Zone> zones;
+    };
+
+    struct Sample
+    {
+        String name;
+        uint32 start, end, loopStart, loopEnd;
+        int sampleRate;
+        int rootKey;
+        int fineTune;
+        bool rom;
+
+        // Ogg Vorbis, only until decoded.
+        bool compressed;
+    };
+
+    ~SharedSoundfont();
+
+    // Returns nullptr if the file can't be parsed, has compressed samples that
+    // can't be decoded, has linked modulators or non-linear modulator
+    // transforms, or the load is cancelled through the progress object.
+    // Mapped sample data is left for the OS to page in as it is played, or
+    // for prefaultPrograms().
+    static std::unique_ptr<SharedSoundfont> load(const File& file, SoundfontStream::LoadProgress* progress);
+
+    // Parses everything but the sample data, getSampleData() returns nullptr.
+    // Sizes of SF3 files read this way are those of the compressed data.
+    static std::unique_ptr<SharedSoundfont> loadHeaders(const File& file);
+
+    const Array<Preset>& getPresets() const;
+    const Array<Instrument>& getInstruments() const;
+    const Array<Sample>& getSamples() const;
+
+    // 16 bit sample points, and the optional low bytes of 24 bit samples.
+    const short* getSampleData() const;
+    const char* getSampleData24() const;
+    size_t getNumSamplePoints() const;
+
+    // Sample data in memory, and sample data read straight from a memory
+    // mapped view of the file. Heap copies are always in memory. Of a mapped
+    // view, the pages the OS has resident are counted, measured at most once
+    // a second.
+    int64 getResidentBytes() const;
+    int64 getMappedBytes() const;
+
+    // Whether the sample data is read from a memory mapped view of the file.
+    bool isMapped() const;
+
+    // Size of all sample data.
+    int64 getSampleDataBytes() const;
+
+    // Longest volume envelope release any preset can play, in seconds.
+    double getMaxReleaseSeconds() const;
+
+    // Touches the mapped sample data of the given programs so that playing
+    // them won't page fault. Call this off the audio thread, it may wait on
+    // the disk.
+    void prefaultPrograms(const Array<ProgramSelection>& programs) const;
+
+    // Pages in and locks the mapped sample data of the given programs, so
+    // that it stays resident until every program locking a sample unlocks it
+    // again. Returns false if some of it couldn't be locked, which is then
+    // only paged in. Not for the audio thread.
+    bool lockPrograms(const Array<ProgramSelection>& programs) const;
+    void unlockPrograms(const Array<ProgramSelection>& programs) const;
+
+    // Sample data locked by lockPrograms(), and the samples it failed to lock.
+    int64 getLockedProgramBytes() const;
+    int64 getProgramLockFailures() const;
+
+    // Which samples the given programs play, by index into getSamples().
+    Array<bool> findUsedSamples(const Array<ProgramSelection>& programs) const;
+
+private:
+    SharedSoundfont();
+
+    // Pages in a range of sample points and locks it in memory, or unlocks
+    // it and drops it from memory again. Pages are counted, so one shared
+    // with another locked range stays until both are unlocked, and every
+    // range must be unlocked as it was locked. Dropped pages are read from
+    // the file the next time they're touched. Locking returns false past the
+    // process's lock limit, the range is then only paged in. Both only do
+    // anything for mapped sample data.
+    bool lockRange(int64 start, int64 end) const;
+    void unlockRange(int64 start, int64 end) const;
+
+    bool updatePageLocks(const void* data, int64 bytes, bool shouldLock) const;
+    bool updateRangeLocks(int64 start, int64 end, bool shouldLock) const;
+    bool decodeSamples(const File& file, SoundfontStream::LoadProgress* progress);
+    bool parsePresetData(const MemoryBlock& pdta);
+
+    Array<Preset> presets;
+    Array<Instrument> instruments;
+    Array<Sample> samples;
+
+    // Point either into mappedFile or into the heap copies below it.
+    const short* sampleData;
+    const char* sampleData24;
+    size_t numSamplePoints;
+
+    // Size of the smpl chunk in the file, which differs from the sample
+    // data's once compressed samples are decoded.
+    int64 sampleChunkBytes;
+    bool hasCompressedSamples;
+
+    // Linked modulators or non-linear transforms, which the zones don't keep.
+    bool hasUnsupportedModulators;
+
+    // File offsets of the smpl and sm24 chunk data, -1 if absent.
+    int64 samplePosition;
+    int64 samplePosition24;
+
+    std::unique_ptr<MemoryMappedFile> mappedFile;
+
+    struct SampleLock
+    {
+        int count;
+        bool locked;
+    };
+
+    // Per sample, for lockPrograms().
+    CriticalSection sampleLockSection;
+    mutable Array<SampleLock> sampleLocks;
+    mutable std::atomic<int64> lockedProgramBytes;
+    mutable std::atomic<int64> programLockFailures;
+
+    // How many locked ranges touch each system page of the mapping, as
+    // locking a page twice doesn't nest. Allocated on the first lock.
+    CriticalSection pageLockSection;
+    mutable HeapBlock<uint16> pageLocks;
+
+    mutable std::atomic<int64> mappedResidentBytes;
+    mutable std::atomic<uint32> lastResidencyCheck;
+    HeapBlock<short> heapSampleData;
+    HeapBlock<char> heapSampleData24;
+
+    // Every modulator referenced by the zones, zones share the global ones.
+    Array<fluid_mod_t*> modulators;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SharedSoundfont)
+};
@@ -0,0 +1,429 @@
+#include "SoundfontCache.h"
+#include "SharedSoundfont.h"
+
+namespace
+{
+    thread_local bool bypassed = false;
+
+    struct Entry
+    {
+        // Held while the file is parsed, so that instances asking for the
+        // same file at the same time wait for it instead of parsing it twice.
+        CriticalSection loadLock;
+
+        std::unique_ptr<SharedSoundfont> font;
+        int references = 0;
+    };
+
+    struct Cache
+    {
+        CriticalSection lock;
+        std::map<String, std::shared_ptr<Entry>> entries;
+        Array<fluid_sfont_t*> instances;
+        std::atomic<int> hits { 0 };
+        std::atomic<int> misses { 0 };
+    };
+
+    Cache& getCache()
+    {
+        static Cache cache;
+        return cache;
+    }
+
+    String makeKey(const File& file)
+    {
+        File target = file.isSymbolicLink() ? file.getLinkedTarget() : file;
+        String path = target.getFullPathName();
+
+#if JUCE_WINDOWS
+        path = path.toLowerCase();
+#endif
+
+        return path + "|" + String(target.getSize()) + "|" + String(target.getLastModificationTime().toMilliseconds());
+    }
+
+    void release(const String& key)
+    {
+        auto& cache = getCache();
+        std::unique_ptr<SharedSoundfont> font;
+
+        {
+            const ScopedLock sl(cache.lock);
+            auto it = cache.entries.find(key);
+
+            if (it == cache.entries.end())
+                return;
+
+            if (--it->second->references == 0)
+            {
+                font = std::move(it->second->font);
+                cache.entries.erase(it);
+            }
+        }
+
+        // Freeing a large sample pool can take a while, so do it unlocked.
+        font.reset();
+    }
+
+    SharedSoundfont* acquire(const String& key, const File& file, SoundfontStream::LoadProgress* progress)
+    {
+        auto& cache = getCache();
+        std::shared_ptr<Entry> entry;
+
+        {
+            const ScopedLock sl(cache.lock);
+            auto& slot = cache.entries[key];
+
+            if (slot == nullptr)
+                slot = std::make_shared<Entry>();
+
+            ++slot->references;
+            entry = slot;
+        }
+
+        {
+            const ScopedLock sl(entry->loadLock);
+
+            if (entry->font != nullptr)
+            {
+                ++cache.hits;
+                return entry->font.get();
+            }
+            else
+            {
+                ++cache.misses;
+
+                if (auto font = SharedSoundfont::load(file, progress))
+                {
+                    const ScopedLock cl(cache.lock);
+                    entry->font = std::move(font);
+                    return entry->font.get();
+                }
+            }
+        }
+
+        release(key);
+        return nullptr;
+    }
+
+    // What each synth gets: its own sfont, presets and samples, all pointing
+    // into the shared data. Samples carry per-synth voice reference counts,
+    // so they can't be shared themselves.
+    struct InstanceFont
+    {
+        String key;
+        String name;
+        SharedSoundfont* shared = nullptr;
+        fluid_sfont_t* sfont = nullptr;
+        Array<fluid_sample_t*> samples;
+        Array<fluid_preset_t*> presets;
+        HashMap<int, fluid_preset_t*> presetsByNumber;
+        int iterationIndex = 0;
+    };
+
+    struct InstancePreset
+    {
+        InstanceFont* font;
+        const SharedSoundfont::Preset* preset;
+    };
+
+    InstancePreset& getPresetData(fluid_preset_t* preset)
+    {
+        return *static_cast<InstancePreset*>(fluid_preset_get_data(preset));
+    }
+
+    InstanceFont& getFontData(fluid_sfont_t* sfont)
+    {
+        return *static_cast<InstanceFont*>(fluid_sfont_get_data(sfont));
+    }
+
+    const char* getPresetName(fluid_preset_t* preset)
+    {
+        return getPresetData(preset).preset->name.toRawUTF8();
+    }
+
+    int getPresetBank(fluid_preset_t* preset)
+    {
+        return getPresetData(preset).preset->bank;
+    }
+
+    int getPresetNumber(fluid_preset_t* preset)
+    {
+        return getPresetData(preset).preset->program;
+    }
+
+    // Called on the audio thread. Instrument generators replace the defaults
+    // and preset generators are added on top, as SF 2.04 section 9.4 describes.
+    // The public voice API gives voices no zone range, which FluidSynth's
+    // legato needs, so channels playing mono use a stock copy instead, see
+    // SynthEngine::updateSoundfontRoute().
+    int presetNoteOn(fluid_preset_t* preset, fluid_synth_t* synth, int chan, int key, int vel)
+    {
+        auto& data = getPresetData(preset);
+        auto& instruments = data.font->shared->getInstruments();
+        for (auto& presetZone : data.preset->zones)
+        {
+            if (!presetZone.contains(key, vel))
+                continue;
+
+            for (auto& instZone : instruments.getReference(presetZone.index).zones)
+            {
+                auto* sample = data.font->samples[instZone.index];
+
+                if (sample == nullptr || !instZone.contains(key, vel))
+                    continue;
+
+                auto* voice = fluid_synth_alloc_voice(synth, sample, chan, key, vel);
+
+                if (voice == nullptr)
+                    return FLUID_FAILED;
+
+                for (auto& gen : instZone.generators)
+                    fluid_voice_gen_set(voice, gen.type, gen.value);
+
+                for (auto* mod : instZone.modulators)
+                    fluid_voice_add_mod(voice, mod, FLUID_VOICE_OVERWRITE);
+
+                for (auto& gen : presetZone.generators)
+                    fluid_voice_gen_incr(voice, gen.type, gen.value);
+
+                for (auto* mod : presetZone.modulators)
+                    fluid_voice_add_mod(voice, mod, FLUID_VOICE_ADD);
+
+                fluid_synth_start_voice(synth, voice);
+            }
+        }
+
+        return FLUID_OK;
+    }
+
+    void freePreset(fluid_preset_t* preset)
+    {
+        delete static_cast<InstancePreset*>(fluid_preset_get_data(preset));
+        delete_fluid_preset(preset);
+    }
+
+    const char* getFontName(fluid_sfont_t* sfont)
+    {
+        return getFontData(sfont).name.toRawUTF8();
+    }
+
+    fluid_preset_t* getFontPreset(fluid_sfont_t* sfont, int bank, int prenum)
+    {
+        return getFontData(sfont).presetsByNumber[(bank << 7) | prenum];
+    }
+
+    void startFontIteration(fluid_sfont_t* sfont)
+    {
+        getFontData(sfont).iterationIndex = 0;
+    }
+
+    fluid_preset_t* nextFontPreset(fluid_sfont_t* sfont)
+    {
+        auto& font = getFontData(sfont);
+        return font.presets[font.iterationIndex++];
+    }
+
+    int freeFont(fluid_sfont_t* sfont)
+    {
+        auto* font = &getFontData(sfont);
+
+        {
+            auto& cache = getCache();
+            const ScopedLock sl(cache.lock);
+            cache.instances.removeFirstMatchingValue(sfont);
+        }
+
+        for (auto* preset : font->presets)
+            freePreset(preset);
+
+        for (auto* sample : font->samples)
+            if (sample != nullptr)
+                delete_fluid_sample(sample);
+
+        delete_fluid_sfont(sfont);
+        release(font->key);
+        delete font;
+
+        return 0;
+    }
+
+    fluid_sample_t* createSample(const SharedSoundfont& shared, const SharedSoundfont::Sample& info)
+    {
+        if (info.rom || info.end <= info.start)
+            return nullptr;
+
+        const uint32 length = info.end - info.start;
+        auto* data = const_cast<short*>(shared.getSampleData()) + info.start;
+        auto* data24 = shared.getSampleData24() != nullptr ? const_cast<char*>(shared.getSampleData24()) + info.start : nullptr;
+
+        auto* sample = new_fluid_sample();
+        fluid_sample_set_name(sample, info.name.toRawUTF8());
+        fluid_sample_set_sound_data(sample, data, data24, length, info.sampleRate > 0 ? info.sampleRate : 44100, 0);
+        fluid_sample_set_loop(sample,
+                              jlimit(0u, length, info.loopStart - jmin(info.loopStart, info.start)),
+                              jlimit(0u, length, info.loopEnd - jmin(info.loopEnd, info.start)));
+        fluid_sample_set_pitch(sample, info.rootKey, info.fineTune);
+
+        // Until a sample's loop is scanned, FluidSynth treats it as full
+        // scale when it checks whether a releasing voice has gone below the
+        // noise floor. See SoundfontCache::optimizePresetSamples().
+        if (!shared.isMapped())
+            fluid_voice_optimize_sample(sample);
+
+        return sample;
+    }
+
+    fluid_sfont_t* loadFont(fluid_sfloader_t*, const char* filename)
+    {
+        if (bypassed)
+            return nullptr;
+
+        File file(SoundfontStream::fromStreamPath(String(CharPointer_UTF8(filename))));
+
+        if (!file.existsAsFile())
+            return nullptr;
+
+        const auto key = makeKey(file);
+        auto* shared = acquire(key, file, SoundfontStream::getCurrentLoadProgress());
+
+        if (shared == nullptr)
+            return nullptr;
+
+        auto* font = new InstanceFont();
+        font->key = key;
+        font->name = String(CharPointer_UTF8(filename));
+        font->shared = shared;
+        font->sfont = new_fluid_sfont(getFontName, getFontPreset, startFontIteration, nextFontPreset, freeFont);
+        fluid_sfont_set_data(font->sfont, font);
+
+        for (auto& info : shared->getSamples())
+            font->samples.add(createSample(*shared, info));
+
+        for (auto& info : shared->getPresets())
+        {
+            auto* preset = new_fluid_preset(font->sfont, getPresetName, getPresetBank, getPresetNumber, presetNoteOn, freePreset);
+            fluid_preset_set_data(preset, new InstancePreset { font, &info });
+
+            // The first preset with a given number wins, like FluidSynth's own loader.
+            if (!font->presetsByNumber.contains((info.bank << 7) | info.program))
+                font->presetsByNumber.set((info.bank << 7) | info.program, preset);
+
+            font->presets.add(preset);
+        }
+
+        {
+            auto& cache = getCache();
+            const ScopedLock sl(cache.lock);
+            cache.instances.add(font->sfont);
+        }
+
+        return font->sfont;
+    }
+}
+
+SoundfontCache::Stats SoundfontCache::getStats()
+{
+    auto& cache = getCache();
+    Stats stats { cache.hits, cache.misses, 0, 0, 0, 0, 0 };
+
+    StringArray keys;
+    Array<const SharedSoundfont*> fonts;
+
+    {
+        // Each soundfont is referenced while it is measured, so it outlives
+        // the lock. Asking the OS what is resident can take a while for a
+        // large mapping, and loads would wait for it.
+        const ScopedLock sl(cache.lock);
+
+        for (auto& entry : cache.entries)
+        {
+            if (entry.second->font != nullptr)
+            {
+                ++entry.second->references;
+                keys.add(entry.first);
+                fonts.add(entry.second->font.get());
+            }
+        }
+    }
+
+    for (auto* font : fonts)
+    {
+        ++stats.numSoundfonts;
+        stats.residentBytes += font->getResidentBytes();
+        stats.mappedBytes += font->getMappedBytes();
+        stats.presetLockedBytes += font->getLockedProgramBytes();
+        stats.presetLockFailures += font->getProgramLockFailures();
+    }
+
+    for (auto& key : keys)
+        release(key);
+
+    return stats;
+}
+
+fluid_sfloader_t* SoundfontCache::createLoader()
+{
+    return new_fluid_sfloader(loadFont, delete_fluid_sfloader);
+}
+
+SoundfontCache::ScopedBypass::ScopedBypass()
+    : previous(bypassed)
+{
+    bypassed = true;
+}
+
+SoundfontCache::ScopedBypass::~ScopedBypass()
+{
+    bypassed = previous;
+}
+
+bool SoundfontCache::isCachedSoundfont(fluid_sfont_t* sfont)
+{
+    auto& cache = getCache();
+    const ScopedLock sl(cache.lock);
+
+    return cache.instances.contains(sfont);
+}
+
+const SharedSoundfont* SoundfontCache::getSharedSoundfont(fluid_sfont_t* sfont)
+{
+    return isCachedSoundfont(sfont) ? getFontData(sfont).shared : nullptr;
+}
+
+bool SoundfontCache::prefaultPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs)
+{
+    if (!isCachedSoundfont(sfont))
+        return false;
+
+    getFontData(sfont).shared->prefaultPrograms(programs);
+    return true;
+}
+
+void SoundfontCache::optimizePresetSamples(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs)
+{
+    if (!isCachedSoundfont(sfont))
+        return;
+
+    auto& font = getFontData(sfont);
+    auto used = font.shared->findUsedSamples(programs);
+
+    // FluidSynth scans each sample only once, later calls return at once.
+    for (int i = 0; i < font.samples.size(); ++i)
+        if (used[i] && font.samples[i] != nullptr)
+            fluid_voice_optimize_sample(font.samples[i]);
+}
+
+bool SoundfontCache::lockPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs)
+{
+    if (!isCachedSoundfont(sfont))
+        return false;
+
+    return getFontData(sfont).shared->lockPrograms(programs);
+}
+
+void SoundfontCache::unlockPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs)
+{
+    if (isCachedSoundfont(sfont))
+        getFontData(sfont).shared->unlockPrograms(programs);
+}
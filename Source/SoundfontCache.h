@@ -0,0 +1,77 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "ProgramUsage.h"
+
+using namespace juce;
+
+class SharedSoundfont;
+
+// Process wide cache of parsed SF2 and SF3 files, so that every plugin instance
+// using the same soundfont plays from a single copy of its sample data.
+// Entries are keyed on the canonical path, size and modification time of the
+// file, and are freed once the last synth using them is deleted.
+class SoundfontCache
+{
+public:
+    struct Stats
+    {
+        int hits;
+        int misses;
+        int numSoundfonts;
+        int64 residentBytes;
+        int64 mappedBytes;
+
+        // Sample data of the presets locked in memory for dynamic sample
+        // loading, see PresetPager.
+        int64 presetLockedBytes;
+        int64 presetLockFailures;
+    };
+
+    static Stats getStats();
+
+    // A loader that serves SF2 and SF3 files from the cache, for fluid_synth_add_sfloader().
+    // Anything it can't handle is left to the next loader. Sample data is
+    // paged in as it is played, or by prefaultPresets().
+    static fluid_sfloader_t* createLoader();
+
+    // Makes the cache's loaders pass every file on to the next loader, for
+    // loads made on the calling thread while the scope is alive.
+    class ScopedBypass
+    {
+    public:
+        ScopedBypass();
+        ~ScopedBypass();
+
+    private:
+        bool previous;
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedBypass)
+    };
+
+    // Whether a soundfont loaded into a synth came from the cache.
+    static bool isCachedSoundfont(fluid_sfont_t* sfont);
+
+    // The shared data behind a cached soundfont, nullptr for any other.
+    static const SharedSoundfont* getSharedSoundfont(fluid_sfont_t* sfont);
+
+    // Pages in the samples the given presets play. Returns false if the
+    // soundfont did not come from the cache. Not for the audio thread.
+    static bool prefaultPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs);
+
+    // Has FluidSynth scan the loops of the samples the given presets play,
+    // in this synth's copies of them. Mapped samples are left unscanned
+    // when loaded, as the scan would page them in. Call this once the presets
+    // are paged in, and not while the audio thread may play them.
+    static void optimizePresetSamples(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs);
+
+    // Locks the samples the given presets play in memory, or releases them,
+    // see SharedSoundfont::lockPrograms(). Locking returns false if the
+    // soundfont did not come from the cache or some samples couldn't be
+    // locked. Not for the audio thread.
+    static bool lockPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs);
+    static void unlockPresets(fluid_sfont_t* sfont, const Array<ProgramSelection>& programs);
+};
@@ -0,0 +1,245 @@
+#include "SoundfontLoader.h"
+
+SoundfontLoader::SoundfontLoader(std::unique_ptr<SynthEngine>& engine, const CriticalSection& callbackLock)
+    : Thread("Soundfont loader")
+    , engine(engine)
+    , callbackLock(callbackLock)
+    , pendingEngine(nullptr)
+    , retiredEngine(nullptr)
+    , engineGeneration(0)
+    , requestedSampleRate(44100.0)
+    , loading(false)
+    , tailLengths(engine->getTailLengths())
+    , presetsVersion(0)
+{
+    startThread();
+}
+
+SoundfontLoader::~SoundfontLoader()
+{
+    cancel();
+    stopThread(10000);
+
+    delete pendingEngine.exchange(nullptr);
+    deleteRetiredEngine();
+}
+
+void SoundfontLoader::load(const String& path, double sampleRate, const EngineOptions& options,
+                           const Array<ProgramSelection>& pinnedPresets)
+{
+    const ScopedLock sl(requestLock);
+
+    requestedPath = path;
+    requestedSampleRate = sampleRate;
+    requestedOptions = options;
+    requestedPins = pinnedPresets;
+    progress.cancelled = true;
+    loading = true;
+
+    notify();
+}
+
+void SoundfontLoader::cancel()
+{
+    const ScopedLock sl(requestLock);
+
+    requestedPath = {};
+    progress.cancelled = true;
+
+    notify();
+}
+
+bool SoundfontLoader::isLoading() const
+{
+    return loading;
+}
+
+bool SoundfontLoader::isBuildingEngine() const
+{
+    return loading && pendingEngine == nullptr;
+}
+
+double SoundfontLoader::getProgress() const
+{
+    return progress.progress;
+}
+
+String SoundfontLoader::getLoadedPath() const
+{
+    const ScopedLock sl(resultLock);
+    return loadedPath;
+}
+
+EngineOptions SoundfontLoader::getLoadedOptions() const
+{
+    const ScopedLock sl(resultLock);
+    return loadedOptions;
+}
+
+EngineOptions SoundfontLoader::getRequestedOptions() const
+{
+    const ScopedLock sl(requestLock);
+    return requestedOptions;
+}
+
+String SoundfontLoader::getLastError() const
+{
+    const ScopedLock sl(resultLock);
+    return lastError;
+}
+
+std::shared_ptr<const SharedSoundfont> SoundfontLoader::getSampleIndex() const
+{
+    const ScopedLock sl(resultLock);
+    return sampleIndex;
+}
+
+Array<PresetInfo> SoundfontLoader::getPresets() const
+{
+    const ScopedLock sl(resultLock);
+    return presets;
+}
+
+int SoundfontLoader::getPresetsVersion() const
+{
+    return presetsVersion;
+}
+
+TailLengths SoundfontLoader::getTailLengths() const
+{
+    const ScopedLock sl(resultLock);
+    return tailLengths;
+}
+
+void SoundfontLoader::swapEngine()
+{
+    auto next = pendingEngine.load();
+
+    if (next == nullptr)
+        return;
+
+    jassert(retiredEngine == nullptr);
+
+    retiredEngine = engine.release();
+    engine.reset(next);
+
+    ++engineGeneration;
+
+    // Cleared last: the loader thread deletes the retired engine as soon as
+    // it sees the pending one taken, so that must already be stored.
+    pendingEngine = nullptr;
+}
+
+int SoundfontLoader::getEngineGeneration() const
+{
+    return engineGeneration;
+}
+
+void SoundfontLoader::run()
+{
+    while (!threadShouldExit())
+    {
+        String path;
+        double sampleRate;
+        EngineOptions options;
+        Array<ProgramSelection> pins;
+
+        {
+            const ScopedLock sl(requestLock);
+
+            path = requestedPath;
+            sampleRate = requestedSampleRate;
+            options = requestedOptions;
+            pins = requestedPins;
+            requestedPath = {};
+
+            if (path.isEmpty())
+                loading = false;
+
+            progress.cancelled = false;
+            progress.progress = 0.0;
+            progress.error = {};
+        }
+
+        if (path.isEmpty())
+        {
+            wait(-1);
+            continue;
+        }
+
+        auto staged = std::make_unique<SynthEngine>(sampleRate, options);
+        std::shared_ptr<const SharedSoundfont> index;
+        bool loaded;
+
+        {
+            SoundfontStream::ScopedLoadProgress scope(progress);
+            loaded = staged->loadSoundfont(path);
+
+            if (loaded)
+                staged->pinPresets(pins);
+
+            if (loaded && options.dynamicSampleLoading)
+                index = SharedSoundfont::loadHeaders(File(path));
+        }
+
+        bool cancelled;
+
+        {
+            // Cancelled, or replaced by a newer request while loading.
+            const ScopedLock sl(requestLock);
+            cancelled = progress.cancelled || threadShouldExit();
+        }
+
+        if (!loaded && !cancelled)
+        {
+            const ScopedLock sl(resultLock);
+            lastError = progress.error.isNotEmpty() ? progress.error
+                                                    : "Couldn't load " + File(path).getFileName();
+        }
+
+        if (loaded && !cancelled)
+        {
+            {
+                const ScopedLock sl(resultLock);
+                lastError = {};
+                loadedPath = path;
+                loadedOptions = options;
+                sampleIndex = index;
+                presets = staged->getPresets();
+                tailLengths = staged->getTailLengths();
+            }
+
+            ++presetsVersion;
+
+            handOver(std::move(staged));
+        }
+    }
+}
+
+void SoundfontLoader::handOver(std::unique_ptr<SynthEngine> staged)
+{
+    deleteRetiredEngine();
+
+    pendingEngine = staged.release();
+
+    for (int waited = 0; pendingEngine != nullptr && !threadShouldExit(); waited += 10)
+    {
+        if (waited >= handOverTimeoutMs)
+        {
+            // The host does not seem to be processing. Swapping under the
+            // callback lock is always safe, it just may make the audio thread wait.
+            const ScopedLock sl(callbackLock);
+            swapEngine();
+            break;
+        }
+
+        wait(10);
+    }
+
+    deleteRetiredEngine();
+}
+
+void SoundfontLoader::deleteRetiredEngine()
+{
+    delete retiredEngine.exchange(nullptr);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include "SynthEngine.h"
+#include "SoundfontStream.h"
+#include "SharedSoundfont.h"
+
+using namespace juce;
+
+// Loads soundfonts on a background thread into a fresh SynthEngine.
+// The audio thread picks the finished engine up with swapEngine() at a block
+// boundary, and the engine it replaces is deleted back on this thread.
+class SoundfontLoader : private Thread
+{
+public:
+    SoundfontLoader(std::unique_ptr<SynthEngine>& engine, const CriticalSection& callbackLock);
+    ~SoundfontLoader() override;
+
+    // Starts loading, abandoning any load that is still in progress.
+    // Pinned presets are paged in, and locked with dynamic sample loading,
+    // before the engine is handed over.
+    void load(const String& path, double sampleRate, const EngineOptions& options,
+              const Array<ProgramSelection>& pinnedPresets);
+    void cancel();
+
+    bool isLoading() const;
+
+    // True until a load in progress has either failed or produced an engine
+    // waiting for swapEngine().
+    bool isBuildingEngine() const;
+    double getProgress() const;
+    String getLoadedPath() const;
+    EngineOptions getLoadedOptions() const;
+
+    // The options of the load in progress, or of the last one requested.
+    EngineOptions getRequestedOptions() const;
+
+    // Why the last load that wasn't cancelled failed, empty if it didn't.
+    String getLastError() const;
+
+    // Preset and sample layout of the loaded SF2 file without its sample data,
+    // used to estimate what dynamic sample loading keeps in memory.
+    // Only set with dynamic sample loading.
+    std::shared_ptr<const SharedSoundfont> getSampleIndex() const;
+
+    Array<PresetInfo> getPresets() const;
+    int getPresetsVersion() const;
+    TailLengths getTailLengths() const;
+
+    // Called on the audio thread at a block boundary.
+    void swapEngine();
+
+    // Incremented whenever a new engine has been swapped in.
+    int getEngineGeneration() const;
+
+private:
+    void run() override;
+    void handOver(std::unique_ptr<SynthEngine> staged);
+    void deleteRetiredEngine();
+
+    std::unique_ptr<SynthEngine>& engine;
+    const CriticalSection& callbackLock;
+
+    std::atomic<SynthEngine*> pendingEngine;
+    std::atomic<SynthEngine*> retiredEngine;
+    std::atomic<int> engineGeneration;
+
+    CriticalSection requestLock;
+    String requestedPath;
+    double requestedSampleRate;
+    EngineOptions requestedOptions;
+    Array<ProgramSelection> requestedPins;
+    SoundfontStream::LoadProgress progress;
+    std::atomic<bool> loading;
+
+    CriticalSection resultLock;
+    String loadedPath;
+    EngineOptions loadedOptions;
+    String lastError;
+    std::shared_ptr<const SharedSoundfont> sampleIndex;
+    Array<PresetInfo> presets;
+    TailLengths tailLengths;
+    std::atomic<int> presetsVersion;
+
+    // How long to wait for the audio thread before swapping under the
+    // callback lock, in case the host is not processing at all.
+    static constexpr int handOverTimeoutMs = 500;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SoundfontLoader)
+};
@@ -0,0 +1,146 @@
+#include "SoundfontStream.h"
+
+namespace
+{
+    const char* const streamPrefix = "stream:";
+    const int readChunkSize = 1 << 20;
+    const int bufferSize = 1 << 16;
+
+    thread_local SoundfontStream::LoadProgress* currentProgress = nullptr;
+
+    struct StreamHandle
+    {
+        std::unique_ptr<MemoryMappedFile> mappedFile;
+        std::unique_ptr<InputStream> stream;
+        SoundfontStream::LoadProgress* progress;
+    };
+
+    void* openStream(const char* filename)
+    {
+        String path = SoundfontStream::fromStreamPath(String(CharPointer_UTF8(filename)));
+
+        if (currentProgress != nullptr && currentProgress->cancelled)
+            return nullptr;
+
+        auto handle = std::make_unique<StreamHandle>();
+        handle->progress = currentProgress;
+
+        // Reading from a mapped view saves a buffered copy and a system call
+        // per read, fall back to buffered reads where the file can't be mapped.
+        handle->mappedFile = std::make_unique<MemoryMappedFile>(File(path), MemoryMappedFile::readOnly);
+
+        if (handle->mappedFile->getData() != nullptr)
+        {
+            handle->stream = std::make_unique<MemoryInputStream>(handle->mappedFile->getData(),
+                                                                 handle->mappedFile->getSize(), false);
+            return handle.release();
+        }
+
+        handle->mappedFile.reset();
+
+        auto file = std::make_unique<FileInputStream>(File(path));
+
+        if (file->failedToOpen())
+            return nullptr;
+
+        handle->stream = std::make_unique<BufferedInputStream>(file.release(), bufferSize, true);
+
+        return handle.release();
+    }
+
+    int readStream(void* buf, fluid_long_long_t count, void* handle)
+    {
+        auto* h = static_cast<StreamHandle*>(handle);
+        auto* dest = static_cast<char*>(buf);
+
+        while (count > 0)
+        {
+            if (h->progress != nullptr && h->progress->cancelled)
+                return FLUID_FAILED;
+
+            int chunk = (int)jmin<fluid_long_long_t>(count, readChunkSize);
+
+            if (h->stream->read(dest, chunk) != chunk)
+                return FLUID_FAILED;
+
+            dest += chunk;
+            count -= chunk;
+
+            if (h->progress != nullptr && h->stream->getTotalLength() > 0)
+                h->progress->progress = (double)h->stream->getPosition() / (double)h->stream->getTotalLength();
+        }
+
+        return FLUID_OK;
+    }
+
+    int seekStream(void* handle, fluid_long_long_t offset, int origin)
+    {
+        auto* h = static_cast<StreamHandle*>(handle);
+        int64 position;
+
+        switch (origin)
+        {
+        case SEEK_SET:
+            position = offset;
+            break;
+        case SEEK_CUR:
+            position = h->stream->getPosition() + offset;
+            break;
+        case SEEK_END:
+            position = h->stream->getTotalLength() + offset;
+            break;
+        default:
+            return FLUID_FAILED;
+        }
+
+        if (position < 0 || position > h->stream->getTotalLength())
+            return FLUID_FAILED;
+
+        return h->stream->setPosition(position) ? FLUID_OK : FLUID_FAILED;
+    }
+
+    fluid_long_long_t tellStream(void* handle)
+    {
+        return static_cast<StreamHandle*>(handle)->stream->getPosition();
+    }
+
+    int closeStream(void* handle)
+    {
+        delete static_cast<StreamHandle*>(handle);
+        return FLUID_OK;
+    }
+}
+
+SoundfontStream::ScopedLoadProgress::ScopedLoadProgress(LoadProgress& progress)
+    : previous(currentProgress)
+{
+    currentProgress = &progress;
+}
+
+SoundfontStream::ScopedLoadProgress::~ScopedLoadProgress()
+{
+    currentProgress = previous;
+}
+
+String SoundfontStream::toStreamPath(const String& path)
+{
+    return streamPrefix + path;
+}
+
+String SoundfontStream::fromStreamPath(const String& name)
+{
+    if (name.startsWith(streamPrefix))
+        return name.substring(String(streamPrefix).length());
+
+    return name;
+}
+
+SoundfontStream::LoadProgress* SoundfontStream::getCurrentLoadProgress()
+{
+    return currentProgress;
+}
+
+void SoundfontStream::installCallbacks(fluid_sfloader_t* loader)
+{
+    fluid_sfloader_set_callbacks(loader, openStream, readStream, seekStream, tellStream, closeStream);
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+using namespace juce;
+
+// File access callbacks for FluidSynth's soundfont loaders.
+// Reads are split into bounded chunks, so that a load running on a background
+// thread can report its progress and be cancelled part way through.
+namespace SoundfontStream
+{
+    struct LoadProgress
+    {
+        std::atomic<double> progress { 0.0 };
+        std::atomic<bool> cancelled { false };
+
+        // Why the load failed, where that's worth telling the user. Only
+        // touched by the loading thread.
+        String error;
+    };
+
+    // Attaches a LoadProgress to every file the calling thread opens through
+    // these callbacks while the scope is alive.
+    class ScopedLoadProgress
+    {
+    public:
+        explicit ScopedLoadProgress(LoadProgress& progress);
+        ~ScopedLoadProgress();
+
+    private:
+        LoadProgress* previous;
+
+        JUCE_DECLARE_NON_COPYABLE(ScopedLoadProgress)
+    };
+
+    // Returns the name to pass to fluid_synth_sfload(). Only loaders that have
+    // these callbacks installed can open it, so a cancelled load fails instead
+    // of falling through to FluidSynth's built-in loader.
+    String toStreamPath(const String& path);
+
+    // Undoes toStreamPath(), leaving any other name as it is.
+    String fromStreamPath(const String& name);
+
+    // The LoadProgress set by the innermost ScopedLoadProgress on this thread, if any.
+    LoadProgress* getCurrentLoadProgress();
+
+    void installCallbacks(fluid_sfloader_t* loader);
+}
@@ -0,0 +1,164 @@
+#include <JuceHeader.h>
+
+// JUCE_USE_CUSTOM_PLUGIN_STANDALONE_APP is a JUCE option in the .jucer,
+// which leaves juce_CreateApplication() to this file. Without it JUCE's own
+// standalone app is built and this file compiles to nothing. The plugin
+// targets link the same shared code but never reference it.
+#if JucePlugin_Build_Standalone && JUCE_USE_CUSTOM_PLUGIN_STANDALONE_APP
+
+#include <juce_audio_plugin_client/Standalone/juce_StandaloneFilterWindow.h>
+
+#include "BatchRenderer.h"
+
+#if JUCE_WINDOWS
+ #include <windows.h>
+#endif
+
+using namespace juce;
+
+// JUCE's standalone app, plus a headless mode that renders MIDI files to
+// audio when started with --render, see BatchRenderer.
+class HandySynthApp : public JUCEApplication
+{
+public:
+    HandySynthApp()
+    {
+        PropertiesFile::Options options;
+        options.applicationName = getApplicationName();
+        options.filenameSuffix = ".settings";
+        options.osxLibrarySubFolder = "Application Support";
+#if JUCE_LINUX || JUCE_BSD
+        options.folderName = "~/.config";
+#else
+        options.folderName = "";
+#endif
+
+        appProperties.setStorageParameters(options);
+    }
+
+    const String getApplicationName() override { return CharPointer_UTF8(JucePlugin_Name); }
+    const String getApplicationVersion() override { return JucePlugin_VersionString; }
+    bool moreThanOneInstanceAllowed() override { return true; }
+    void anotherInstanceStarted(const String&) override {}
+
+    void initialise(const String&) override
+    {
+        const ArgumentList args(getApplicationName(), getCommandLineParameterArray());
+
+        if (BatchRenderer::isRenderCommand(args))
+        {
+            startBatchRender(args);
+            return;
+        }
+
+        mainWindow = std::make_unique<StandaloneFilterWindow>(getApplicationName(),
+                                                              LookAndFeel::getDefaultLookAndFeel().findColour(ResizableWindow::backgroundColourId),
+                                                              appProperties.getUserSettings(),
+                                                              false);
+        mainWindow->setVisible(true);
+    }
+
+    void shutdown() override
+    {
+        if (batchThread != nullptr)
+            batchThread->stopThread(10000);
+
+        batchThread = nullptr;
+        mainWindow = nullptr;
+        appProperties.saveIfNeeded();
+    }
+
+    void systemRequestedQuit() override
+    {
+        if (mainWindow != nullptr)
+            mainWindow->pluginHolder->savePluginState();
+
+        if (ModalComponentManager::getInstance()->cancelAllModalComponents())
+        {
+            Timer::callAfterDelay(100, []() {
+                if (auto app = JUCEApplicationBase::getInstance())
+                    app->systemRequestedQuit();
+            });
+        }
+        else
+        {
+            quit();
+        }
+    }
+
+private:
+    // Runs a headless task off the message thread, which the processors
+    // need, and quits with the exit code it returns.
+    class BatchThread : public Thread
+    {
+    public:
+        explicit BatchThread(std::function<int()> task)
+            : Thread("Batch render")
+            , task(std::move(task))
+        {
+        }
+
+        void run() override
+        {
+            const int exitCode = task();
+
+            MessageManager::callAsync([exitCode]() {
+                JUCEApplicationBase::getInstance()->setApplicationReturnValue(exitCode);
+                JUCEApplicationBase::quit();
+            });
+        }
+
+    private:
+        std::function<int()> task;
+    };
+
+    static void attachConsole()
+    {
+#if JUCE_WINDOWS
+        // The app is built for the GUI subsystem, so nothing it prints shows
+        // unless it takes over the console it was started from.
+        if (AttachConsole(ATTACH_PARENT_PROCESS))
+        {
+            freopen("CONOUT$", "w", stdout);
+            freopen("CONOUT$", "w", stderr);
+        }
+#endif
+    }
+
+    void startBatchRender(const ArgumentList& args)
+    {
+        attachConsole();
+
+        BatchRenderer::Options options;
+
+        // The settings the app was last used with, unless given others.
+        MemoryBlock savedState;
+
+        if (savedState.fromBase64Encoding(appProperties.getUserSettings()->getValue("filterState")))
+            options.state = savedState;
+
+        auto error = BatchRenderer::parseCommandLine(args, options);
+
+        if (error.isNotEmpty())
+        {
+            std::cerr << error << std::endl << std::endl << BatchRenderer::getUsage();
+            setApplicationReturnValue(1);
+            quit();
+            return;
+        }
+
+        batchThread = std::make_unique<BatchThread>([options]() {
+            BatchRenderer renderer(options);
+            return renderer.run() > 0 ? 1 : 0;
+        });
+        batchThread->startThread();
+    }
+
+    ApplicationProperties appProperties;
+    std::unique_ptr<StandaloneFilterWindow> mainWindow;
+    std::unique_ptr<BatchThread> batchThread;
+};
+
+JUCE_CREATE_APPLICATION_DEFINE(HandySynthApp)
+
+#endif
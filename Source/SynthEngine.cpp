@@ -0,0 +1,586 @@
+#include "SynthEngine.h"
+#include "SoundfontStream.h"
+#include "SoundfontCache.h"
+#include "SharedSoundfont.h"
+#include "SfzLoader.h"
+#include "SfzInstrument.h"
+
+#if JUCE_LINUX
+ #include <sched.h>
+#elif JUCE_WINDOWS
+ #include <windows.h>
+ #include <tlhelp32.h>
+#endif
+
+namespace
+{
+#if JUCE_LINUX
+    // Thread ids of this process's FluidSynth render workers, which it names "mixer0", "mixer1"...
+    Array<int> findRenderThreads()
+    {
+        Array<int> threads;
+
+        for (auto& task : File("/proc/self/task").findChildFiles(File::findDirectories, false))
+            if (task.getChildFile("comm").loadFileAsString().startsWith("mixer"))
+                threads.add(task.getFileName().getIntValue());
+
+        return threads;
+    }
+#elif JUCE_WINDOWS
+    // Thread ids of this process named "mixer0", "mixer1"... Thread names
+    // need Windows 10 1607 or later; without them no thread can be told to be
+    // a worker, and none is listed.
+    Array<int> findRenderThreads()
+    {
+        using GetThreadDescriptionFunction = HRESULT (WINAPI*)(HANDLE, PWSTR*);
+        static auto getThreadDescription = (GetThreadDescriptionFunction)GetProcAddress(
+            GetModuleHandleW(L"kernel32.dll"), "GetThreadDescription");
+
+        Array<int> threads;
+
+        if (getThreadDescription == nullptr)
+            return threads;
+
+        auto isRenderThread = [](DWORD threadId) {
+            HANDLE handle = OpenThread(THREAD_QUERY_LIMITED_INFORMATION, FALSE, threadId);
+
+            if (handle == nullptr)
+                return false;
+
+            PWSTR name = nullptr;
+            bool found = false;
+
+            if (SUCCEEDED(getThreadDescription(handle, &name)) && name != nullptr)
+            {
+                found = String(name).startsWith("mixer");
+                LocalFree(name);
+            }
+
+            CloseHandle(handle);
+            return found;
+        };
+
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+
+        if (snapshot == INVALID_HANDLE_VALUE)
+            return threads;
+
+        const DWORD process = GetCurrentProcessId();
+        THREADENTRY32 entry;
+        entry.dwSize = sizeof(entry);
+
+        for (BOOL more = Thread32First(snapshot, &entry); more; more = Thread32Next(snapshot, &entry))
+            if (entry.th32OwnerProcessID == process && isRenderThread(entry.th32ThreadID))
+                threads.add((int)entry.th32ThreadID);
+
+        CloseHandle(snapshot);
+        return threads;
+    }
+#endif
+
+    // Serialises creating worker threads, so that each engine can tell its own apart.
+    CriticalSection renderThreadLock;
+
+    // Release assumed for soundfonts that don't come from the SoundfontCache.
+    constexpr double defaultReleaseSeconds = 2.0;
+
+    // FluidSynth's reverb maps the room size linearly onto a decay time of
+    // 0.7 to 12.5 seconds to -60 dB. Waiting half as long again takes the
+    // tail down to -90 dB.
+    double getReverbTailSeconds(double roomSize)
+    {
+        return (0.7 + 11.8 * roomSize) * 1.5;
+    }
+
+    // The chorus has no feedback, its tail is its longest delay.
+    double getChorusTailSeconds(double depthMs)
+    {
+        return (depthMs + 20.0) / 1000.0;
+    }
+}
+
+SynthEngine::SynthEngine(double sampleRate, const EngineOptions& options)
+    : sfId(-1)
+    , stockSfId(-1)
+    , sampleRate(sampleRate)
+    , options(options)
+    , tailLengths({ defaultReleaseSeconds, 0.0, 0.0 })
+    , nextPartition(0)
+{
+    for (auto& channel : notePartitions)
+        for (auto& partition : channel)
+            partition = -1;
+
+    const int numPartitions = jlimit(1, maxPartitions, options.partitions);
+
+    for (int i = 0; i < numPartitions; ++i)
+    {
+        // Each synth registers setting callbacks, so they can't share settings.
+        auto* partitionSettings = new_fluid_settings();
+
+#if JUCE_DEBUG
+        fluid_settings_setint(partitionSettings, "synth.verbose", 1);
+#endif
+
+        // Every synth call is made from the audio thread, control changes reach it
+        // through the processor's ControlQueue, so FluidSynth's API mutex is not needed.
+        fluid_settings_setint(partitionSettings, "synth.threadsafe-api", 0);
+
+        // Allocate all voices up front so that raising the polyphony later does
+        // not reallocate on the audio thread. The partitions share them.
+        fluid_settings_setint(partitionSettings, "synth.polyphony", getPartitionPolyphony(maxPolyphony, numPartitions));
+
+        fluid_settings_setint(partitionSettings, "synth.chorus.active", 0);
+        fluid_settings_setint(partitionSettings, "synth.reverb.active", 0);
+        fluid_settings_setnum(partitionSettings, "synth.sample-rate", sampleRate);
+
+        const int audioGroups = jlimit(1, maxAudioGroups, options.audioGroups);
+        fluid_settings_setint(partitionSettings, "synth.audio-groups", audioGroups);
+        fluid_settings_setint(partitionSettings, "synth.audio-channels", audioGroups);
+        fluid_settings_setint(partitionSettings, "synth.midi-channels", jlimit(1, maxMidiPorts, options.midiPorts) * 16);
+
+        fluid_settings_setint(partitionSettings, "synth.cpu-cores", jlimit(1, maxRenderThreads, options.renderThreads));
+
+        auto* synth = new_fluid_synth(partitionSettings);
+
+        fluid_synth_set_interp_method(synth, -1, FLUID_INTERP_HIGHEST);
+
+        auto loader = new_fluid_defsfloader(partitionSettings);
+        SoundfontStream::installCallbacks(loader);
+        fluid_synth_add_sfloader(synth, loader);
+
+        // Loaders are tried newest first, so SFZ files and then SF2 and SF3
+        // files come from the shared caches, and everything else falls through
+        // to the loader above.
+        // FluidSynth's own synth.dynamic-sample-loading is not used: it loads
+        // samples on whichever thread selects a preset, and its sample reference
+        // counts can't be touched from another thread while the audio thread plays.
+        fluid_synth_add_sfloader(synth, SoundfontCache::createLoader());
+        fluid_synth_add_sfloader(synth, SfzLoader::createLoader());
+
+        settings.add(partitionSettings);
+        synths.add(synth);
+
+        // The first synth renders on the audio thread itself.
+        if (i > 0)
+            workers.add(new PartitionWorker(synth, jlimit(1, maxAudioGroups, options.audioGroups) * 2));
+    }
+
+    if (options.renderThreads > 1)
+        startRenderThreads();
+
+    double roomSize = 0.2, chorusDepth = 8.0;
+    fluid_settings_getnum(settings.getFirst(), "synth.reverb.room-size", &roomSize);
+    fluid_settings_getnum(settings.getFirst(), "synth.chorus.depth", &chorusDepth);
+
+    tailLengths.reverb = getReverbTailSeconds(roomSize);
+    tailLengths.chorus = getChorusTailSeconds(chorusDepth);
+}
+
+SynthEngine::~SynthEngine()
+{
+    pager.reset();
+    workers.clear();
+
+    for (auto* synth : synths)
+        delete_fluid_synth(synth);
+
+    for (auto* partitionSettings : settings)
+        delete_fluid_settings(partitionSettings);
+}
+
+bool SynthEngine::loadSoundfont(const String& path)
+{
+    const auto streamPath = SoundfontStream::toStreamPath(path);
+
+    // Every synth loads the file into the same ids. After the first, SF2 files
+    // are cache hits sharing its sample data.
+    for (auto* synth : synths)
+    {
+        sfId = fluid_synth_sfload(synth, streamPath.toRawUTF8(), 1);
+
+        if (sfId == FLUID_FAILED)
+        {
+            sfId = -1;
+            return false;
+        }
+
+        auto* sfont = fluid_synth_get_sfont_by_id(synth, sfId);
+
+        if (!SoundfontCache::isCachedSoundfont(sfont))
+            continue;
+
+        // Channels playing mono get a copy from FluidSynth's own loader, see
+        // updateSoundfontRoute(). FluidSynth shares its sample data between
+        // the copies of every synth in the process.
+        {
+            const SoundfontCache::ScopedBypass bypass;
+            stockSfId = fluid_synth_sfload(synth, streamPath.toRawUTF8(), 0);
+        }
+
+        // Program changes pick the most recently added soundfont that has
+        // the preset, which has to be the cached one.
+        if (stockSfId != FLUID_FAILED)
+        {
+            fluid_synth_remove_sfont(synth, sfont);
+            sfId = fluid_synth_add_sfont(synth, sfont);
+        }
+        else
+        {
+            stockSfId = -1;
+        }
+    }
+
+    fluid_sfont_t* sfont = getSoundfont();
+
+    fluid_sfont_iteration_start(sfont);
+    while (auto preset = fluid_sfont_iteration_next(sfont))
+    {
+        presets.add({
+            fluid_preset_get_banknum(preset),
+            fluid_preset_get_num(preset),
+            String(CharPointer_ASCII(fluid_preset_get_name(preset)))
+        });
+    }
+
+    if (auto* shared = SoundfontCache::getSharedSoundfont(sfont))
+        tailLengths.release = shared->getMaxReleaseSeconds();
+    else if (auto* instrument = SfzLoader::getInstrument(sfont))
+        tailLengths.release = instrument->getMaxReleaseSeconds();
+
+    if (options.dynamicSampleLoading && SoundfontCache::isCachedSoundfont(sfont))
+    {
+        Array<fluid_sfont_t*> sfonts;
+
+        for (auto* synth : synths)
+            sfonts.add(fluid_synth_get_sfont_by_id(synth, sfId));
+
+        pager = std::make_unique<PresetPager>(sfonts);
+    }
+
+    // Channels start out on the first melodic and percussion presets.
+    pinPresets({ { 0, 0 }, { 128, 0 } });
+
+    return true;
+}
+
+void SynthEngine::pinPresets(const Array<ProgramSelection>& programs)
+{
+    // Without dynamic sample loading other presets still play, their samples
+    // are paged in by the OS as they do, and their loops left unscanned.
+    if (pager != nullptr)
+        pager->pageIn(programs);
+    else if (SoundfontCache::prefaultPresets(getSoundfont(), programs))
+        for (auto* synth : synths)
+            SoundfontCache::optimizePresetSamples(fluid_synth_get_sfont_by_id(synth, sfId), programs);
+}
+
+bool SynthEngine::isPresetResident(int bank, int program) const noexcept
+{
+    return pager == nullptr || pager->isResident(bank, program);
+}
+
+bool SynthEngine::requestPreset(int bank, int program) noexcept
+{
+    return pager == nullptr || pager->request(bank, program);
+}
+
+fluid_synth_t* SynthEngine::getSynth() const
+{
+    assertNotMessageThread();
+    return synths.getFirst();
+}
+
+void SynthEngine::noteOn(int channel, int key, int velocity) noexcept
+{
+    if (velocity == 0)
+    {
+        noteOff(channel, key);
+        return;
+    }
+
+    if (options.partitionMode == EngineOptions::partitionByNote && isPositiveAndBelow(channel, getNumMidiChannels())
+        && isPositiveAndBelow(key, 128))
+    {
+        auto& partition = notePartitions[channel][key];
+        const int previous = partition;
+
+        if (canSplitChannel(channel))
+        {
+            partition = (int8)nextPartition;
+            nextPartition = (nextPartition + 1) % synths.size();
+        }
+        else
+        {
+            partition = 0;
+        }
+
+        // A single synth would release the previous note on the same key itself.
+        if (previous >= 0 && previous != partition)
+            fluid_synth_noteoff(synths.getUnchecked(previous), channel, key);
+    }
+
+    fluid_synth_noteon(getNoteSynth(channel, key), channel, key, velocity);
+}
+
+void SynthEngine::noteOff(int channel, int key) noexcept
+{
+    fluid_synth_noteoff(getNoteSynth(channel, key), channel, key);
+}
+
+fluid_synth_t* SynthEngine::getNoteSynth(int channel, int key) const noexcept
+{
+    assertNotMessageThread();
+
+    if (options.partitionMode == EngineOptions::partitionByNote)
+    {
+        if (isPositiveAndBelow(channel, getNumMidiChannels()) && isPositiveAndBelow(key, 128)
+            && notePartitions[channel][key] >= 0)
+            return synths.getUnchecked(notePartitions[channel][key]);
+
+        return synths.getFirst();
+    }
+
+    return synths.getUnchecked(jmax(0, channel) % synths.size());
+}
+
+bool SynthEngine::canSplitChannel(int channel) const noexcept
+{
+    auto* synth = synths.getFirst();
+    int sfontId, bank, program;
+
+    // Drum channels select from bank 128, and so do drum kits picked by a
+    // bank select on any other channel.
+    if (fluid_synth_get_program(synth, channel, &sfontId, &bank, &program) == FLUID_OK && bank == 128)
+        return false;
+
+    // Portamento switch (65).
+    int portamento = 0;
+    fluid_synth_get_cc(synth, channel, 65, &portamento);
+
+    return portamento < 64 && !playsMono(channel);
+}
+
+bool SynthEngine::playsMono(int channel) const noexcept
+{
+    auto* synth = synths.getFirst();
+    int basicChannel, mode, numChannels;
+
+    // Channels outside any basic channel group are disabled, with a mode of -1.
+    if (fluid_synth_get_basic_channel(synth, channel, &basicChannel, &mode, &numChannels) == FLUID_OK
+        && basicChannel >= 0 && (mode & FLUID_CHANNEL_POLY_OFF) != 0)
+        return true;
+
+    // Legato switch (68).
+    int legato = 0;
+    fluid_synth_get_cc(synth, channel, 68, &legato);
+
+    return legato >= 64;
+}
+
+void SynthEngine::updateSoundfontRoute(int channel) noexcept
+{
+    if (stockSfId < 0)
+        return;
+
+    if (channel < 0)
+    {
+        for (int c = 0; c < getNumMidiChannels(); ++c)
+            updateSoundfontRoute(c);
+
+        return;
+    }
+
+    int sfontId, bank, program;
+    const int wanted = playsMono(channel) ? stockSfId : sfId;
+
+    // Unset programs are numbered past 127.
+    if (fluid_synth_get_program(synths.getFirst(), channel, &sfontId, &bank, &program) != FLUID_OK
+        || sfontId == wanted || program > 127)
+        return;
+
+    for (auto* synth : synths)
+        fluid_synth_program_select(synth, channel, wanted, bank, program);
+}
+
+int SynthEngine::getNumSynths() const noexcept
+{
+    return synths.size();
+}
+
+fluid_synth_t* SynthEngine::getSynth(int index) const noexcept
+{
+    assertNotMessageThread();
+    return synths[index];
+}
+
+int SynthEngine::getPartitionPolyphony(int polyphony, int numPartitions) noexcept
+{
+    return jmax(1, (polyphony + numPartitions - 1) / numPartitions);
+}
+
+int SynthEngine::getNumMidiChannels() const noexcept
+{
+    return jlimit(1, maxMidiPorts, options.midiPorts) * 16;
+}
+
+int SynthEngine::getActiveVoiceCount() const noexcept
+{
+    assertNotMessageThread();
+    int voices = 0;
+
+    for (auto* synth : synths)
+        voices += fluid_synth_get_active_voice_count(synth);
+
+    return voices;
+}
+
+void SynthEngine::process(int numSamples, int numChannels, float** out) noexcept
+{
+    assertNotMessageThread();
+
+    if (workers.isEmpty())
+    {
+        fluid_synth_process(synths.getFirst(), numSamples, 0, nullptr, numChannels, out);
+    }
+    else
+    {
+        numChannels = jmin(numChannels, maxOutputChannels);
+        float* chunk[maxOutputChannels];
+
+        for (int done = 0; done < numSamples; done += PartitionWorker::maxBlockSize)
+        {
+            const int chunkSize = jmin(numSamples - done, PartitionWorker::maxBlockSize);
+
+            for (int channel = 0; channel < numChannels; ++channel)
+                chunk[channel] = out[channel] + done;
+
+            for (auto* worker : workers)
+                worker->startRender(chunkSize, numChannels);
+
+            fluid_synth_process(synths.getFirst(), chunkSize, 0, nullptr, numChannels, chunk);
+
+            // A partition that takes longer than the chunk lasts is left out
+            // of it, the host's deadline is lost by then anyway.
+            for (auto* worker : workers)
+                worker->finishRender(chunk, chunkSize * 1000.0 / sampleRate);
+        }
+    }
+}
+
+fluid_sfont_t* SynthEngine::getSoundfont() const
+{
+    if (sfId == -1)
+        return nullptr;
+    else
+        return fluid_synth_get_sfont_by_id(synths.getFirst(), sfId);
+}
+
+const Array<PresetInfo>& SynthEngine::getPresets() const
+{
+    return presets;
+}
+
+const TailLengths& SynthEngine::getTailLengths() const
+{
+    return tailLengths;
+}
+
+const EngineOptions& SynthEngine::getOptions() const
+{
+    return options;
+}
+
+double SynthEngine::getSampleRate() const
+{
+    return sampleRate;
+}
+
+void SynthEngine::setSampleRate(double newSampleRate)
+{
+    assertNotMessageThread();
+    sampleRate = newSampleRate;
+
+    for (auto* synth : synths)
+        fluid_synth_set_sample_rate(synth, (float)newSampleRate);
+}
+
+void SynthEngine::assertNotMessageThread() noexcept
+{
+    jassert(!MessageManager::existsAndIsCurrentThread());
+}
+
+void SynthEngine::startRenderThreads()
+{
+    // FluidSynth queues the creation of its workers until the first render,
+    // which would spawn threads on the audio thread. Render one silent block
+    // here instead. On Linux new threads inherit the floating point mode of
+    // their creator, so this also keeps denormals out of the workers.
+    const ScopedLock sl(renderThreadLock);
+    const ScopedNoDenormals noDenormals;
+
+#if JUCE_LINUX || JUCE_WINDOWS
+    auto existing = findRenderThreads();
+#endif
+
+    float left[64], right[64];
+
+    for (auto* synth : synths)
+        fluid_synth_write_float(synth, 64, left, 0, 1, right, 0, 1);
+
+#if JUCE_LINUX || JUCE_WINDOWS
+    if (!options.pinRenderThreads)
+        return;
+
+    // The cores this process may run on. Which one the host's audio thread
+    // uses isn't known, so the workers take the last ones, a core each, and
+    // may still share one with it.
+    Array<int> cpus;
+
+#if JUCE_WINDOWS
+    // An affinity mask only reaches the cores of the process's processor group.
+    DWORD_PTR processMask = 0, systemMask = 0;
+
+    if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        for (int cpu = 0; cpu < (int)sizeof(DWORD_PTR) * 8; ++cpu)
+            if ((processMask & ((DWORD_PTR)1 << cpu)) != 0)
+                cpus.add(cpu);
+#else
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (CPU_ISSET(cpu, &allowed))
+                cpus.add(cpu);
+#endif
+
+    if (cpus.size() < 2)
+        return;
+
+    int next = 0;
+
+    // Only threads named as workers and new since the render above, so other
+    // engines' workers and threads of the host are never pinned.
+    for (auto thread : findRenderThreads())
+    {
+        if (existing.contains(thread))
+            continue;
+
+        const int cpu = cpus[cpus.size() - 1 - next++ % cpus.size()];
+
+#if JUCE_WINDOWS
+        if (HANDLE handle = OpenThread(THREAD_SET_INFORMATION | THREAD_QUERY_INFORMATION, FALSE, (DWORD)thread))
+        {
+            SetThreadAffinityMask(handle, (DWORD_PTR)1 << cpu);
+            CloseHandle(handle);
+        }
+#else
+        cpu_set_t single;
+        CPU_ZERO(&single);
+        CPU_SET(cpu, &single);
+        sched_setaffinity(thread, sizeof(single), &single);
+#endif
+    }
+#endif
+}
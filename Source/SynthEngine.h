@@ -0,0 +1,207 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "ProgramUsage.h"
+#include "PresetPager.h"
+#include "PartitionWorker.h"
+
+using namespace juce;
+
+struct PresetInfo
+{
+    int bank;
+    int program;
+    String name;
+};
+
+// Settings that FluidSynth only reads when a synth is created, so changing
+// any of them means building a new engine.
+struct EngineOptions
+{
+    // See SynthEngine::SynthEngine().
+    bool dynamicSampleLoading = false;
+
+    // synth.cpu-cores, the audio thread counts as one of them. Extra threads
+    // render voices in parallel. Pinning them to a core each is opt-in, and
+    // only reaches threads the OS reports under FluidSynth's worker names:
+    // on Linux, and on Windows 10 1607 or later.
+    int renderThreads = 1;
+    bool pinRenderThreads = false;
+
+    // Number of separate synths the voices are split across, each rendered
+    // on its own thread from the SoundfontCache's one copy of the samples.
+    // Notes go to a synth by MIDI channel or to each in turn, every other
+    // message to all of them. In turn, drum kits and mono, legato or
+    // portamento channels stay on the first synth, so that exclusive classes
+    // and legato see all their notes. Melodic presets' exclusive classes
+    // are still split. The polyphony limit is divided evenly between the
+    // synths, so split by channel a channel can only play its synth's
+    // share: with 4 synths and 128 voices, 32 for the channels of one.
+    enum PartitionMode
+    {
+        partitionByChannel,
+        partitionByNote
+    };
+
+    int partitions = 1;
+    PartitionMode partitionMode = partitionByChannel;
+
+    // synth.audio-groups, one stereo output per group. MIDI channel n plays
+    // into group n modulo the number of groups.
+    int audioGroups = 1;
+
+    // synth.midi-channels, 16 for each port.
+    int midiPorts = 1;
+
+    bool operator==(const EngineOptions& other) const
+    {
+        return dynamicSampleLoading == other.dynamicSampleLoading
+            && renderThreads == other.renderThreads
+            && pinRenderThreads == other.pinRenderThreads
+            && partitions == other.partitions
+            && partitionMode == other.partitionMode
+            && audioGroups == other.audioGroups
+            && midiPorts == other.midiPorts;
+    }
+
+    bool operator!=(const EngineOptions& other) const
+    {
+        return !operator==(other);
+    }
+};
+
+// How long the synth keeps sounding after its last note-off, in seconds.
+struct TailLengths
+{
+    double release;
+    double reverb;
+    double chorus;
+};
+
+// A FluidSynth instance together with its settings and loaded soundfont.
+// Engines are built and torn down off the audio thread and handed to it whole.
+class SynthEngine
+{
+public:
+    // With dynamic sample loading the samples of an SF2 file are only paged
+    // in and locked for presets that get pinned or selected, see PresetPager.
+    // Unused presets are left on disk.
+    // Formats that don't come from the SoundfontCache are always loaded whole,
+    // and so is the stock copy of a cached one, see updateSoundfontRoute().
+    SynthEngine(double sampleRate, const EngineOptions& options);
+    ~SynthEngine();
+
+    bool loadSoundfont(const String& path);
+
+    // Pages in the samples of the given presets, and with dynamic sample
+    // loading locks them, since they are the only ones that play then. Reads
+    // from disk and sets up the synths' samples, so only call it before the
+    // engine is handed to the audio thread.
+    void pinPresets(const Array<ProgramSelection>& programs);
+
+    // Called on the audio thread before selecting a preset. A preset that is
+    // not resident has to be requested, and selected once it is.
+    bool isPresetResident(int bank, int program) const noexcept;
+    bool requestPreset(int bank, int program) noexcept;
+
+    // The first synth, the one settings and programs are read back from.
+    fluid_synth_t* getSynth() const;
+
+    // Called on the audio thread. Notes are routed to one synth, everything
+    // else should be sent to all of them.
+    void noteOn(int channel, int key, int velocity) noexcept;
+    void noteOff(int channel, int key) noexcept;
+    fluid_synth_t* getNoteSynth(int channel, int key) const noexcept;
+
+    // Whether notes on the channel may go to different synths, see
+    // EngineOptions::partitionByNote.
+    bool canSplitChannel(int channel) const noexcept;
+
+    // Whether the channel is in mono mode or has legato switched on.
+    bool playsMono(int channel) const noexcept;
+
+    // Called on the audio thread after anything that may change a channel's
+    // program or mono mode, for one channel or all of them when negative.
+    // FluidSynth's legato keeps voices gliding within the key and velocity
+    // range of the zone they play, which only its own loader can give them.
+    // Channels playing mono are moved to a copy of the soundfont loaded by
+    // it, and back to the cached one when they play poly again.
+    void updateSoundfontRoute(int channel) noexcept;
+
+    int getNumSynths() const noexcept;
+    fluid_synth_t* getSynth(int index) const noexcept;
+
+    // Each synth's share of a polyphony limit, so that the partitions
+    // together play no more voices than a single synth would. The shares
+    // are fixed, one synth can't borrow voices another isn't using.
+    static int getPartitionPolyphony(int polyphony, int numPartitions) noexcept;
+
+    template <typename Callback>
+    void forEachSynth(Callback&& callback) const
+    {
+        assertNotMessageThread();
+
+        for (auto* partition : synths)
+            callback(partition);
+    }
+
+    // 16 for each MIDI port, port n owning channels 16n to 16n + 15.
+    int getNumMidiChannels() const noexcept;
+
+    // Voices playing across every synth.
+    int getActiveVoiceCount() const noexcept;
+
+    // Renders every synth and mixes them into out, like fluid_synth_process().
+    // Audio group n goes to channels 2n and 2n + 1.
+    void process(int numSamples, int numChannels, float** out) noexcept;
+
+    fluid_sfont_t* getSoundfont() const;
+    const Array<PresetInfo>& getPresets() const;
+    const TailLengths& getTailLengths() const;
+
+    const EngineOptions& getOptions() const;
+
+    double getSampleRate() const;
+    void setSampleRate(double newSampleRate);
+
+    static constexpr int maxPolyphony = 1024;
+    static constexpr int maxRenderThreads = 16;
+    static constexpr int maxPartitions = 8;
+    static constexpr int maxAudioGroups = 16;
+    static constexpr int maxOutputChannels = maxAudioGroups * 2;
+    static constexpr int maxMidiPorts = 16;
+    static constexpr int maxMidiChannels = maxMidiPorts * 16;
+
+private:
+    // The synths run with synth.threadsafe-api off. Once the processor has
+    // an engine, only its audio thread calls into them, and the editor and
+    // the message thread go through ControlQueue. Every accessor checks
+    // this in debug builds.
+    static void assertNotMessageThread() noexcept;
+
+    void startRenderThreads();
+
+    Array<fluid_settings_t*> settings;
+    Array<fluid_synth_t*> synths;
+    OwnedArray<PartitionWorker> workers;
+    int sfId;
+
+    // The stock loader's copy of a cached soundfont, -1 for any other.
+    int stockSfId;
+
+    double sampleRate;
+    EngineOptions options;
+    std::unique_ptr<PresetPager> pager;
+
+    Array<PresetInfo> presets;
+    TailLengths tailLengths;
+
+    // Which synth each sounding note went to, and the next one in turn.
+    int8 notePartitions[maxMidiChannels][128];
+    int nextPartition;
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(SynthEngine)
+};
@@ -0,0 +1,428 @@
+#include "TuningWorker.h"
+#include "SynthEngine.h"
+
+namespace
+{
+    // Where a voice keeps the deviation its fine tune was last given, so
+    // that it can be swapped for another one. Unused by the specification,
+    // SharedSoundfont drops it from files, and voices start with it at 0.
+    constexpr int tuningGen = GEN_UNUSED1;
+
+    // xx yy zz: semitone, then a 14 bit fraction of one, as cents off the key.
+    float getDeviation(const uint8* note, int key)
+    {
+        return (float)(note[0] & 0x7F) * 100.0f + (float)(((note[1] & 0x7F) << 7) | (note[2] & 0x7F)) * 100.0f / 16384.0f
+               - (float)key * 100.0f;
+    }
+
+    // 7F 7F 7F leaves a key as it is.
+    bool isNoChange(const uint8* note)
+    {
+        return note[0] == 0x7F && note[1] == 0x7F && note[2] == 0x7F;
+    }
+}
+
+TuningWorker::TuningWorker()
+    : Thread("Tuning worker")
+    , tables(maxTables, true)
+    , messageFifo(queueSize)
+    , changeFifo(queueSize)
+    , retiredFifo(maxTables + 1)
+    , numPosted(0)
+    , numInstalled(0)
+    , numWoken(0)
+    , numPrepared(0)
+    , deviceId(0)
+    , numFreeSlots(maxTables)
+    , numTuningTables(0)
+{
+    auto* settings = new_fluid_settings();
+    fluid_settings_getint(settings, "synth.device-id", &deviceId);
+    delete_fluid_settings(settings);
+
+    std::fill(std::begin(preparedSlots), std::end(preparedSlots), (int16)-1);
+    std::fill(std::begin(installedSlots), std::end(installedSlots), (int16)-1);
+
+    for (int slot = 0; slot < maxTables; ++slot)
+        freeSlots[slot] = (int16)slot;
+
+    resetChannels();
+    startThread();
+}
+
+TuningWorker::~TuningWorker()
+{
+    signalThreadShouldExit();
+    semaphore.signal();
+    stopThread(5000);
+}
+
+bool TuningWorker::post(const uint8* body, int size, int port) noexcept
+{
+    if (size > maxMessageBytes || messageFifo.getFreeSpace() == 0)
+        return false;
+
+    messageFifo.write(1).forEach([&](int index) {
+        messages[index].size = size;
+        messages[index].port = port;
+        std::memcpy(messages[index].bytes, body, (size_t)size);
+    });
+
+    ++numPosted;
+    return true;
+}
+
+bool TuningWorker::applyNow(const uint8* body, int size, int port, const SynthEngine& engine) noexcept
+{
+    // The worker only touches the tables again once something is posted.
+    if (numPrepared.load(std::memory_order_acquire) != numPosted)
+        return false;
+
+    install(engine);
+
+    if (prepare(body, size, port, false))
+        installChanges(engine);
+
+    return true;
+}
+
+void TuningWorker::wake() noexcept
+{
+    if (numWoken == numPosted)
+        return;
+
+    numWoken = numPosted;
+    semaphore.signal();
+}
+
+void TuningWorker::install(const SynthEngine& engine) noexcept
+{
+    // Read first, so that the change of every message counted is queued.
+    const int prepared = numPrepared.load(std::memory_order_acquire);
+
+    if (prepared == numInstalled)
+        return;
+
+    installChanges(engine);
+    numInstalled = prepared;
+}
+
+void TuningWorker::installChanges(const SynthEngine& engine) noexcept
+{
+    changeFifo.read(changeFifo.getNumReady()).forEach([this](int index) {
+        const auto& change = changes[index];
+        const int retired = installedSlots[change.tuning];
+
+        installedSlots[change.tuning] = (int16)change.slot;
+
+        // Back to the worker, there is room for every table.
+        if (retired >= 0)
+            retiredFifo.write(1).forEach([&](int i) { retiredSlots[i] = (int16)retired; });
+
+        for (int n = 0; n < 16; ++n)
+        {
+            const int channel = change.port * 16 + n;
+
+            if ((change.channelMask & (1 << n)) != 0 && channel < maxChannels)
+            {
+                channelTunings[channel] = (int16)change.tuning;
+                retunedChannels[channel] = retunedChannels[channel] || change.apply;
+            }
+        }
+
+        if (change.apply)
+            for (int channel = 0; channel < maxChannels; ++channel)
+                if (channelTunings[channel] == change.tuning)
+                    retunedChannels[channel] = true;
+    });
+
+    retuneChannels(engine);
+}
+
+int TuningWorker::getNumPending() const noexcept
+{
+    return numPosted - numInstalled;
+}
+
+void TuningWorker::tuneNote(const SynthEngine& engine, int channel, int key) noexcept
+{
+    if (channelTunings[channel] < 0)
+        return;
+
+    // Only voices still held at the key, those in their release keep the
+    // tuning they were started with.
+    fluid_synth_get_voicelist(engine.getNoteSynth(channel, key), voices, SynthEngine::maxPolyphony, -1);
+
+    for (int i = 0; i < SynthEngine::maxPolyphony && voices[i] != nullptr; ++i)
+        if (fluid_voice_get_channel(voices[i]) == channel && fluid_voice_get_key(voices[i]) == key && fluid_voice_is_on(voices[i]))
+            retuneVoice(voices[i], channel);
+}
+
+bool TuningWorker::handleControlChange(const SynthEngine& engine, int channel, int controller, int value) noexcept
+{
+    switch (controller)
+    {
+    case 98:
+    case 99:
+        channelNrpns[channel] = true;
+        return false;
+    case 100:
+    case 101:
+        channelNrpns[channel] = false;
+        channelRpns[channel][101 - controller] = (uint8)value;
+        return false;
+    case 121:
+        // Reset all controllers leaves no parameter selected.
+        channelNrpns[channel] = false;
+        channelRpns[channel][0] = channelRpns[channel][1] = 127;
+        return false;
+    case 6:
+    case 38:
+        break;
+    default:
+        return false;
+    }
+
+    const auto* rpn = channelRpns[channel];
+
+    if (channelNrpns[channel] || rpn[0] != 0 || (rpn[1] != 3 && rpn[1] != 4))
+        return false;
+
+    // Only the data entry MSB carries the program or bank.
+    if (controller == 6)
+    {
+        if (rpn[1] == 4)
+            channelTuningBanks[channel] = (uint8)value;
+        else
+            selectTuning(engine, channel, channelTuningBanks[channel] * 128 + value);
+    }
+
+    return true;
+}
+
+void TuningWorker::resetChannels() noexcept
+{
+    for (int channel = 0; channel < maxChannels; ++channel)
+    {
+        channelTunings[channel] = -1;
+        channelTuningBanks[channel] = 0;
+        channelRpns[channel][0] = channelRpns[channel][1] = 127;
+        channelNrpns[channel] = false;
+        retunedChannels[channel] = false;
+    }
+}
+
+bool TuningWorker::isTuningMessage(const uint8* body, int size) noexcept
+{
+    // Universal non-real-time or real-time, sub-ID 08: 7E|7F <device> 08 ...
+    return size >= 4 && (body[0] == 0x7E || body[0] == 0x7F) && body[2] == 0x08;
+}
+
+void TuningWorker::run()
+{
+    while (!threadShouldExit())
+    {
+        semaphore.wait();
+
+        while (messageFifo.getNumReady() > 0 && !threadShouldExit())
+        {
+            messageFifo.read(1).forEach([this](int index) {
+                prepare(messages[index].bytes, messages[index].size, messages[index].port, true);
+            });
+            numPrepared.fetch_add(1, std::memory_order_release);
+        }
+    }
+}
+
+bool TuningWorker::prepare(const uint8* body, int size, int port, bool canWait) noexcept
+{
+    if (size < 5 || (body[1] != deviceId && body[1] != 0x7F))
+        return false;
+
+    const int format = body[3];
+    const bool banked = format == 0x04 || format == 0x07;
+    const int program = body[banked ? 5 : 4] & 0x7F;
+    int tuning = banked ? (body[4] & 0x7F) * 128 + program : program;
+    int channelMask = 0;
+    int numNotes = 0;
+    const uint8* notes = nullptr;
+    float octave[12];
+
+    switch (format)
+    {
+    case 0x01:
+    case 0x04:
+        // Bulk tuning dump: [bb] tt, a 16 character name, then xx yy zz for
+        // every key.
+        numNotes = 128;
+        notes = body + (banked ? 6 : 5) + 16;
+
+        if (size < (int)(notes - body) + 3 * numNotes)
+            return false;
+
+        break;
+    case 0x02:
+    case 0x07:
+        // Single note tuning change: [bb] tt ll, then kk xx yy zz for ll keys.
+        if (size < (banked ? 7 : 6))
+            return false;
+
+        numNotes = body[banked ? 6 : 5] & 0x7F;
+        notes = body + (banked ? 7 : 6);
+
+        if (size < (int)(notes - body) + 4 * numNotes)
+            return false;
+
+        break;
+    case 0x08:
+    case 0x09:
+    {
+        // Scale/octave tuning in one or two bytes a note: ff gg hh, masking
+        // the port's channels 15-14, 13-7 and 6-0, then 12 notes from C.
+        // FluidSynth keeps it as bank 0, program 0.
+        const int noteBytes = format == 0x09 ? 2 : 1;
+
+        if (size < 7 + 12 * noteBytes)
+            return false;
+
+        tuning = 0;
+        channelMask = ((body[4] & 0x03) << 14) | ((body[5] & 0x7F) << 7) | (body[6] & 0x7F);
+
+        for (int n = 0; n < 12; ++n)
+        {
+            const auto* note = body + 7 + n * noteBytes;
+
+            octave[n] = noteBytes == 1 ? (float)((note[0] & 0x7F) - 64)
+                                       : (float)((((note[0] & 0x7F) << 7) | (note[1] & 0x7F)) - 8192) * 100.0f / 8192.0f;
+        }
+
+        break;
+    }
+    default:
+        // Dump requests, which there is no MIDI output to answer on.
+        return false;
+    }
+
+    // The audio thread empties the queue every block.
+    while (changeFifo.getFreeSpace() == 0)
+    {
+        if (!canWait || threadShouldExit())
+            return false;
+
+        Thread::sleep(1);
+    }
+
+    int slot;
+
+    if (!acquireTable(canWait, slot))
+        return false;
+
+    const int previous = preparedSlots[tuning];
+    auto& table = tables[slot];
+
+    if (format == 0x08 || format == 0x09)
+    {
+        for (int key = 0; key < 128; ++key)
+            table.cents[key] = octave[key % 12];
+    }
+    else if (format == 0x01 || format == 0x04)
+    {
+        for (int key = 0; key < 128; ++key)
+            table.cents[key] = isNoChange(notes + key * 3) ? 0.0f : getDeviation(notes + key * 3, key);
+    }
+    else
+    {
+        // Changes the keys given of the tuning there is, or of equal temperament.
+        table = previous >= 0 ? tables[previous] : Table {};
+
+        for (int n = 0; n < numNotes; ++n)
+        {
+            const auto* note = notes + n * 4;
+            const int key = note[0] & 0x7F;
+
+            if (!isNoChange(note + 1))
+                table.cents[key] = getDeviation(note + 1, key);
+        }
+    }
+
+    // The previous table comes back once the audio thread has switched away
+    // from it.
+    if (previous < 0)
+        ++numTuningTables;
+
+    preparedSlots[tuning] = (int16)slot;
+
+    changeFifo.write(1).forEach([&](int index) {
+        changes[index] = { tuning, slot, port, channelMask, body[0] == 0x7F };
+    });
+
+    return true;
+}
+
+bool TuningWorker::acquireTable(bool canWait, int& slot) noexcept
+{
+    for (;;)
+    {
+        retiredFifo.read(retiredFifo.getNumReady()).forEach([this](int index) {
+            freeSlots[numFreeSlots++] = retiredSlots[index];
+        });
+
+        if (numFreeSlots > 0)
+        {
+            slot = freeSlots[--numFreeSlots];
+            return true;
+        }
+
+        // Once every table holds a tuning, none will come back and further
+        // tunings are ignored. Otherwise some are waiting for the audio
+        // thread to switch away from them.
+        if (!canWait || numTuningTables == maxTables || threadShouldExit())
+            return false;
+
+        Thread::sleep(1);
+    }
+}
+
+void TuningWorker::selectTuning(const SynthEngine& engine, int channel, int tuning) noexcept
+{
+    // Like FluidSynth, a tuning select retunes the notes sounding.
+    channelTunings[channel] = (int16)tuning;
+    retunedChannels[channel] = true;
+    retuneChannels(engine);
+}
+
+void TuningWorker::retuneChannels(const SynthEngine& engine) noexcept
+{
+    if (std::find(std::begin(retunedChannels), std::end(retunedChannels), true) == std::end(retunedChannels))
+        return;
+
+    engine.forEachSynth([this](fluid_synth_t* synth) {
+        fluid_synth_get_voicelist(synth, voices, SynthEngine::maxPolyphony, -1);
+
+        for (int i = 0; i < SynthEngine::maxPolyphony && voices[i] != nullptr; ++i)
+        {
+            const int channel = fluid_voice_get_channel(voices[i]);
+
+            if (channel < maxChannels && retunedChannels[channel] && fluid_voice_is_on(voices[i]))
+                retuneVoice(voices[i], channel);
+        }
+    });
+
+    std::fill(std::begin(retunedChannels), std::end(retunedChannels), false);
+}
+
+void TuningWorker::retuneVoice(fluid_voice_t* voice, int channel) noexcept
+{
+    const int tuning = channelTunings[channel];
+    const int slot = tuning >= 0 ? installedSlots[tuning] : -1;
+    const float cents = slot >= 0 ? tables[slot].cents[jlimit(0, 127, fluid_voice_get_actual_key(voice))] : 0.0f;
+    const float previous = fluid_voice_gen_get(voice, tuningGen);
+
+    if (cents == previous)
+        return;
+
+    // The fine tune the soundfont gave the voice stays underneath.
+    fluid_voice_gen_set(voice, GEN_FINETUNE, fluid_voice_gen_get(voice, GEN_FINETUNE) - previous + cents);
+    fluid_voice_gen_set(voice, tuningGen, cents);
+    fluid_voice_update_param(voice, GEN_FINETUNE);
+}
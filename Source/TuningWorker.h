@@ -0,0 +1,152 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+#include <fluidsynth.h>
+
+#include "Semaphore.h"
+#include "SynthEngine.h"
+
+using namespace juce;
+
+// Applies MIDI Tuning Standard messages without FluidSynth's tuning API,
+// which allocates for every tuning it is given or selects. A tuning here is
+// a table of each key's deviation from equal temperament, in a pool that is
+// allocated up front. A background thread parses messages into tables from
+// the pool, and the audio thread switches to them with install() at the
+// start of a block, holding the events that follow a tuning until then.
+// Voices take their key's deviation through their fine tune generator, when
+// they start and, for real-time messages, while they sound. The worker
+// sleeps on a semaphore, which wake() signals once a block has rendered;
+// neither side takes a lock or allocates.
+class TuningWorker : private Thread
+{
+public:
+    TuningWorker();
+    ~TuningWorker() override;
+
+    // Called on the audio thread with a SysEx body, without F0 and F7, and
+    // the MIDI port whose channels a scale/octave tuning selects. Returns
+    // false if it is too long or the queue is full.
+    bool post(const uint8* body, int size, int port) noexcept;
+
+    // Called on the audio thread offline and in deterministic mode, where
+    // the output mustn't depend on the worker's timing. Parses the message
+    // and installs its tuning right away. Returns false, leaving it to
+    // post(), while the worker is still busy with earlier ones.
+    bool applyNow(const uint8* body, int size, int port, const SynthEngine& engine) noexcept;
+
+    // Called on the audio thread after the block, wakes the worker if
+    // anything was posted.
+    void wake() noexcept;
+
+    // Called on the audio thread before the block's events. Switches to the
+    // tables prepared since the last block.
+    void install(const SynthEngine& engine) noexcept;
+
+    // Messages posted and not yet installed.
+    int getNumPending() const noexcept;
+
+    // Called on the audio thread after a note-on, tunes the voices it started.
+    void tuneNote(const SynthEngine& engine, int channel, int key) noexcept;
+
+    // Called on the audio thread with every controller change. Tracks the
+    // channel's registered parameter, and handles the tuning program and
+    // bank select ones (RPN 3 and 4) itself. Returns true when FluidSynth
+    // mustn't see the controller, as it would allocate a tuning for it.
+    bool handleControlChange(const SynthEngine& engine, int channel, int controller, int value) noexcept;
+
+    // Called on the audio thread on a system reset or a new engine. Channels
+    // go back to equal temperament, the tables are kept.
+    void resetChannels() noexcept;
+
+    static bool isTuningMessage(const uint8* body, int size) noexcept;
+
+    // A single note tuning change for all 128 keys, the longest message,
+    // is 518 bytes.
+    static constexpr int maxMessageBytes = 520;
+
+private:
+    void run() override;
+    bool prepare(const uint8* body, int size, int port, bool canWait) noexcept;
+    bool acquireTable(bool canWait, int& slot) noexcept;
+    void installChanges(const SynthEngine& engine) noexcept;
+    void selectTuning(const SynthEngine& engine, int channel, int tuning) noexcept;
+    void retuneChannels(const SynthEngine& engine) noexcept;
+    void retuneVoice(fluid_voice_t* voice, int channel) noexcept;
+
+    static constexpr int queueSize = 64;
+
+    // Tables in the pool. Each bank and program with a tuning holds one,
+    // and a message that changes it one more until the audio thread has
+    // switched to the new one.
+    static constexpr int maxTables = 128;
+
+    // Tunings are numbered bank * 128 + program.
+    static constexpr int numTunings = 128 * 128;
+    static constexpr int maxChannels = SynthEngine::maxMidiChannels;
+
+    struct Message
+    {
+        int size;
+        int port;
+        uint8 bytes[maxMessageBytes];
+    };
+
+    struct Table
+    {
+        // Cents off equal temperament, by key.
+        float cents[128];
+    };
+
+    // A tuning switched to another table, and the channels a scale/octave
+    // tuning selects it on: 16 of the message's port, by mask bit.
+    struct Change
+    {
+        int tuning;
+        int slot;
+        int port;
+        int channelMask;
+        // Retunes sounding notes, for real-time messages.
+        bool apply;
+    };
+
+    Semaphore semaphore;
+    HeapBlock<Table> tables;
+
+    AbstractFifo messageFifo, changeFifo, retiredFifo;
+    Message messages[queueSize];
+    Change changes[queueSize];
+    int16 retiredSlots[maxTables + 1];
+
+    // Counted by the audio thread and the worker. numPrepared is raised
+    // after a message's change is queued.
+    int numPosted, numInstalled, numWoken;
+    std::atomic<int> numPrepared;
+
+    // The device ID FluidSynth answers to, read from its settings.
+    int deviceId;
+
+    // Owned by the worker, or by the audio thread in applyNow() while the
+    // worker has nothing to do. preparedSlots holds each tuning's latest
+    // table, -1 for none, and freeSlots the tables no tuning uses.
+    int16 preparedSlots[numTunings];
+    int16 freeSlots[maxTables];
+    int numFreeSlots, numTuningTables;
+
+    // Audio thread only. The table each tuning plays, and each channel's
+    // tuning, -1 for equal temperament. Channels also keep the tuning bank
+    // and the registered parameter selected with RPN 4 and CC 101/100.
+    int16 installedSlots[numTunings];
+    int16 channelTunings[maxChannels];
+    uint8 channelTuningBanks[maxChannels];
+    uint8 channelRpns[maxChannels][2];
+    bool channelNrpns[maxChannels];
+
+    // Channels whose sounding voices install() retunes. voices is the
+    // buffer they are listed into.
+    bool retunedChannels[maxChannels];
+    fluid_voice_t* voices[SynthEngine::maxPolyphony];
+
+    JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(TuningWorker)
+};